@@ -7,22 +7,145 @@
 #include <ctype.h> // iscntrl()
 #include <errno.h> // errno, EAGAIN
 #include <fcntl.h>
+#include <poll.h> // poll()
+#include <pthread.h>
+#include <signal.h> // sigaction() SIGWINCH
+#include <limits.h> // IOV_MAX
 #include <stdio.h> // printf() perror()
 #include <stdarg.h>
+#include <stdint.h> // uint64_t
 #include <stdlib.h> // atexit() realloc() free()
 #include <string.h> // memcpy()
 #include <sys/ioctl.h> // ioctl() TIOCGWINSZ struct winsize
+#include <sys/mman.h> // mmap() munmap()
+#include <sys/stat.h> // fstat()
 #include <sys/types.h>
+#include <sys/uio.h> // writev() struct iovec
+#include <sys/wait.h> // waitpid()
 #include <termios.h> // struct termios, tcgetattr(), tcsetattr(), ECHO, TCSAFLUSH, OPOST, IXON, ICANON, ISIG, IEXTEN
 // VMIN, VTIME
 #include <time.h>
 #include <unistd.h> // read() STDIN_FILENO write() STDOUT_FILENO
+#include <zlib.h> // inflate() deflate()
+#ifdef __linux__
+#include <sys/inotify.h> // inotify_init1() inotify_add_watch()
+#endif
+#ifdef YIM_ZSTD
+#include <zstd.h> // ZSTD_decompressStream() ZSTD_compressStream2()
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h> // _mm_cmplt_epi8() _mm_movemask_epi8()
+#endif
 
 /*----------- Defines ----------*/
 #define CTRL_KEY(k) ((k) & 0x1F)
 #define YIM_VERSION "0.0.1"
 #define YIM_TAB_STOP 8
 #define YIM_QUIT_TIMES 3
+// Rows that aren't plain ASCII keep the screen column of every this
+// many bytes, so mapping a byte to its column never scans further.
+#define YIM_COLMAP_STEP 256
+// Rows at least this long are edited through a gap buffer and aren't
+// syntax highlighted.
+#define YIM_LONG_ROW (64 * 1024)
+#define YIM_INPUT_BUF (64 * 1024)
+// How long to wait for the rest of an escape sequence before taking the
+// Esc on its own, in milliseconds.
+#define YIM_ESC_MS 100
+// Row structs are allocated YIM_ROW_SLAB at a time. Row text of up to
+// YIM_TEXT_SLAB_MAX bytes comes out of YIM_TEXT_SLAB byte blocks, in
+// YIM_TEXT_CLASSES power-of-two size classes.
+#define YIM_ROW_SLAB 4096
+#define YIM_TEXT_SLAB (256 * 1024)
+#define YIM_TEXT_SLAB_MIN 16
+#define YIM_TEXT_CLASSES 5
+#define YIM_TEXT_SLAB_MAX (YIM_TEXT_SLAB_MIN << (YIM_TEXT_CLASSES - 1))
+// Load generations that can be alive at once, see memLoadNext().
+#define YIM_LOAD_GENS 8
+// Files are loaded by one thread per CPU (or $YIM_LOAD_THREADS of them),
+// up to YIM_LOAD_THREADS_MAX, each given at least YIM_LOAD_CHUNK bytes.
+#define YIM_LOAD_CHUNK (4 << 20)
+#define YIM_LOAD_THREADS_MAX 64
+// Compressed files are read and written YIM_ZIP_BUF bytes at a time, and
+// decompressed into blocks of at least YIM_ZIP_BLOCK bytes.
+#define YIM_ZIP_BUF (1 << 20)
+#define YIM_ZIP_BLOCK (4 << 20)
+// How many iovecs editorSave() hands to each writev().
+#define YIM_SAVE_IOV 1024
+#define YIM_SEARCH_MAX_ROWS (1 << 20)
+// The swap file is written this long after the buffer first changes, and
+// started over once it is more than twice the size of the buffer.
+#define YIM_SWAP_MS 2000
+// Buffers with at least two shards' worth of rows are searched on worker
+// threads, a shard of rows at a time.
+#define YIM_SEARCH_SHARD 65536
+#define YIM_SEARCH_THREADS_MAX 16
+// The viewer (-R) notes the start of every YIM_VIEW_STRIDE-th line and
+// keeps at most YIM_VIEW_ROWS rows of at most YIM_VIEW_LINE_MAX bytes.
+#define YIM_VIEW_STRIDE 1024
+#define YIM_VIEW_ROWS 512
+#define YIM_VIEW_LINE_MAX (64 * 1024)
+#define YIM_VIEW_CHUNK (1 << 20)
+#define YIM_VIEW_NOTIFY_MS 50
+// A followed file (-F) is read at most every YIM_FOLLOW_MS however fast
+// it grows, and at most YIM_FOLLOW_MAX bytes at a time. Without inotify,
+// or while the file has gone, it is looked at every YIM_FOLLOW_POLL_MS.
+#define YIM_FOLLOW_MS 100
+#define YIM_FOLLOW_MAX (64 << 20)
+#define YIM_FOLLOW_POLL_MS 500
+// Limits for compiled regular expressions. The DFA cache is thrown away
+// and rebuilt from scratch whenever it fills up.
+#define YIM_REGEX_MAX_STATES 65536
+#define YIM_REGEX_MAX_REPEAT 1000
+#define YIM_REGEX_DFA_STATES 2048
+// Status messages disappear after this many seconds.
+#define YIM_MSG_TIMEOUT 5
+// Frames are drawn at most this often, in milliseconds. Keys that arrive
+// in between are all handled before the next frame.
+#define YIM_FRAME_MS 16
+// The undo history is trimmed from the oldest end once it takes up more
+// than this many bytes.
+#ifndef YIM_UNDO_BYTES
+#define YIM_UNDO_BYTES (64 << 20)
+#endif
+// Built with -DYIM_STATS ("make yim-stats") the editor counts what it does
+// in its hot paths, see the Stats section. Otherwise the counting
+// compiles to nothing.
+#ifdef YIM_STATS
+#define STAT_ADD(counter, n) (S.counter += (n))
+#define STAT_LINES S.overlay // Lines the overlay takes at the bottom.
+#else
+#define STAT_ADD(counter, n) ((void) 0)
+#define STAT_LINES 0
+#endif
+
+// Attributes of a screen cell. Each one maps to an SGR escape sequence
+// in editorHighlightEscape().
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_STATUS,
+    HL_MATCH,
+    HL_COMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER,
+    HL_PREPROC
+};
+
+// What a syntax highlights, see struct editorSyntax.
+#define SYN_NUMBERS (1 << 0)
+#define SYN_PREPROC (1 << 1) // Lines starting with '#' are preprocessor directives.
+#define SYN_KEYS (1 << 2) // A string followed by ':' is an object key.
+
+// The lexer state a line ends in, which is the state the next line starts
+// in. SYN_STRING also carries the quote character in the bits above 8.
+enum syntaxState {
+    SYN_NORMAL = 0,
+    SYN_COMMENT, // Inside a multi-line comment.
+    SYN_STRING, // Inside a string continued with a backslash.
+    SYN_DIRECTIVE // On a preprocessor line continued with a backslash.
+};
 
 enum editorKey { 
     BACKSPACE = 127,
@@ -34,42 +157,681 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END
 };
 
 /*---------- Data -----------*/
 // This is an editor row. It stores a line of text as a pointer
-// to the dynamically allocated character data and its length.
+// to the character data and its length, see the Row Memory section for
+// where the data lives. chars is UTF-8. Tabs, wide characters and combining marks make a byte
+// index (cx) and a screen column (rx) differ, so rows that have any of
+// them keep checkpoints of the mapping, see editorRowColmap().
+// The row being edited, if it is a long one, is kept as a gap buffer:
+// chars holds the bytes before position gap, then gaplen unused bytes,
+// then the rest of the row. See editorRowSplice() and editorGapClose().
+// The fields are ordered to pack into 64 bytes, there is one per line.
 typedef struct erow {
-    int size;
-    int rsize;
     char *chars;
-    char *render;
+    int *colmap; // Pairs of cx and rx, one for every YIM_COLMAP_STEP bytes.
+    unsigned char *hl; // The highlight of each byte of chars, NULL until the row is drawn.
+    int size;
+    int cap; // Bytes of room at chars, 0 while they are in the load buffer.
+    int gap;
+    int gaplen;
+    int ncolmap; // Checkpoints filled in so far.
+    int colmapcap;
+    unsigned int gen; // Bumped every time chars change, see editorUpdateRow().
+    int refs; // Number of leaves pointing at the row, see rowTreeSnapshot().
+    unsigned int hlgen; // The gen hlstart and hlend belong to, 0 if never lexed.
+    signed char plain; // 1 if chars is all printable ASCII, 0 if not, -1 if not known yet.
+    unsigned char hlstart, hlend; // The lexer state the row was lexed from and ends in, see syntaxPack().
+    unsigned int loadgen : 7; // The load generation the row struct is in, 0 if it's from a slab.
+    unsigned int lf : 1; // The line ends in a lone '\n' though the file uses "\r\n".
 } erow;
 
+// Free lists and the blocks being carved up, see the Row Memory section.
+// The blocks a file was loaded into, and how many of the row structs
+// in them are still alive.
+struct loadGen {
+    void *blocks;
+    long long rows;
+};
+
+struct rowMemory {
+    void *blocks;
+    struct loadGen gens[YIM_LOAD_GENS];
+    int gen; // Where loading goes now, 1 up, or 0 before the first load.
+    erow *freerows;
+    erow *rowblock;
+    int rowsleft;
+    char *freetext[YIM_TEXT_CLASSES];
+    char *textblock;
+    int textleft;
+};
+
+// The rows of the buffer are kept in a counted B+tree so that inserting,
+// deleting and finding a row by its line number are all O(log n).
+// Leaves hold pointers to the rows, internal nodes hold pointers to their
+// children together with the number of rows and the number of bytes
+// (not counting line endings) under each child, so the byte offset of a
+// line and the line at a byte offset can both be found in O(log n).
+// While lines are wrapped, wraps counts the screen lines under each child,
+// or that each row of a leaf takes, the same way.
+// Nodes and rows are reference counted so a snapshot of the whole tree
+// can be taken in O(1) and read from other threads while the editor keeps
+// going; anything shared is copied before it is modified.
+#define ROWTREE_FANOUT 64
+#define ROWTREE_MAXDEPTH 16
+
+typedef struct rowNode {
+    int leaf;
+    int n;
+    int refs;
+    int count[ROWTREE_FANOUT];
+    long long bytes[ROWTREE_FANOUT];
+    int wraps[ROWTREE_FANOUT];
+    union {
+        struct rowNode *child[ROWTREE_FANOUT];
+        erow *row[ROWTREE_FANOUT];
+    } u;
+} rowNode;
+
+// The part of a file one thread loads. Chunks start at the start of a
+// line and end after a line break or at the end of the file, so no line
+// is split between two of them.
+typedef struct loadChunk {
+    const char *src; // The chunk as read in.
+    char *data; // Where it is copied to for the rows to point into.
+    size_t len;
+    int numrows;
+    erow *rows; // Room for numrows rows.
+    erow **table; // Where they go in the table of all rows.
+    unsigned int gen;
+    int loadgen; // See memLoadRows().
+    rowNode **nodes; // If not NULL, the rows are put in leaves and the leaves in nodes here.
+    int nnodes;
+} loadChunk;
+
+// One direction of a gzip or zstd stream, see the Compressed Files section.
+typedef struct zipStream {
+    int format;
+    int ended; // The data so far makes up whole gzip members or zstd frames.
+    int trailing; // Whatever follows the last gzip member is ignored.
+    z_stream gz;
+#ifdef YIM_ZSTD
+    ZSTD_DStream *zd;
+    ZSTD_CStream *zc;
+#endif
+} zipStream;
+
+// A block of whole lines decompressed by the loading thread.
+typedef struct zipBlock {
+    char *data;
+    size_t len;
+} zipBlock;
+
+// A compressed file being decompressed on a thread. The blocks it has
+// filled wait in blocks for the main thread. Everything after z is
+// guarded by lock.
+typedef struct zipLoad {
+    int fd;
+    zipStream z;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    zipBlock *blocks;
+    int nblocks;
+    int capblocks;
+    int done;
+    int error; // An errno from reading, or -1 if the data was bad.
+} zipLoad;
+
+// Rows going out compressed, see zipWriteRows().
+typedef struct zipWriter {
+    zipStream z;
+    int fd;
+    char *in; // Text waiting to be compressed.
+    size_t inlen;
+    char *out;
+} zipWriter;
+
+// One line of the terminal as a row of cells. E.screen holds what the
+// terminal is currently showing so that a refresh only has to send the
+// cells that changed. For lines that show a file row we also remember
+// which row (and which version of it) was drawn, so unchanged rows are
+// skipped without even being rendered.
+// A cell is one column. Its text is chars[cell[x]] up to chars[cell[x + 1]],
+// which is one byte for ASCII, a whole UTF-8 sequence plus any combining
+// marks otherwise, and empty for the right half of a wide character.
+typedef struct screenLine {
+    erow *row;
+    unsigned int gen;
+    unsigned int hlgen;
+    int hlstate; // The lexer state the row started in.
+    int coloff;
+    int len;
+    int *cell; // len + 1 offsets into chars.
+    char *chars;
+    int cap; // Bytes allocated for chars.
+    unsigned char *hl;
+} screenLine;
+
+// Keyboard input is read in as large a chunk as is available and decoded
+// from here, instead of with one read() per byte.
+struct inputBuffer {
+    char buf[YIM_INPUT_BUF];
+    int start;
+    int end;
+};
+
+// A regular expression is parsed straight into a Thompson NFA. Every
+// state is either a byte set to match, a split into two branches, an
+// empty step, a "^" or "$" assertion, or the final match state.
+enum regexOp {
+    RX_CHAR = 0,
+    RX_SPLIT,
+    RX_EMPTY,
+    RX_BOL,
+    RX_EOL,
+    RX_MATCH
+};
+
+typedef struct regexState {
+    int op;
+    int out;
+    int out1; // Second branch of RX_SPLIT.
+    unsigned char set[32]; // Bytes accepted by RX_CHAR, one bit each.
+} regexState;
+
+// A DFA state stands for a set of NFA states. Its transitions are only
+// worked out the first time the scanner needs them, so a pattern costs
+// no more than the states the text actually drives it through.
+//
+// In a leftmost DFA the set is split into groups by where their match
+// began, earliest first, so one forward pass finds where the leftmost
+// longest match ends. The set then starts with RX_OPEN or RX_CLOSED, and
+// each group is sorted and ends with RX_GROUP.
+#define RX_GROUP (-1)
+#define RX_OPEN (-2) // New matches may still begin.
+#define RX_CLOSED (-3) // A match was found, so later starts can't win.
+#define RX_TRAIL 64 // Bytes between the checkpoints of a scan, see regexLeftmostEnd().
+
+typedef struct regexDState {
+    int *set; // Sorted RX_CHAR, RX_EOL and RX_MATCH states.
+    int n;
+    int accept; // A match ends here.
+    int accepteol; // A match ends here if this is the end of the row.
+    int next[256]; // -1 until computed.
+} regexDState;
+
+typedef struct regexDfa {
+    regexDState **states;
+    int n;
+    int *hash; // Open addressing table of indices into states, -1 if free.
+    int hashcap;
+    int start[2]; // Start states in the middle and at the beginning of a row.
+    int leftmost; // A new match may begin at every position.
+    unsigned int flushes; // Bumped when the states are thrown away and renumbered.
+} regexDfa;
+
+typedef struct regex {
+    regexState *nfa;
+    int n;
+    int cap;
+    int start;
+    char *prefix; // Literal text every match begins with.
+    int prefixlen;
+    regexDfa dfa; // Leftmost, or anchored for the reversed pattern.
+    struct regex *reverse; // The pattern read backwards, to find a start.
+    int *stack;
+    unsigned int *mark;
+    unsigned int markgen;
+    int *scratch;
+    // Where the forward scans over text went, for regexFindNext() to pick
+    // up from: a state and the last match end at or after it, for every
+    // RX_TRAIL bytes of trails.
+    const char *trails;
+    int traillen;
+    unsigned int trailflushes;
+    int *trail;
+    int trailcap;
+} regex;
+
+// A compiled search string. The row scanner jumps between occurrences of
+// the needle's rarest byte with memchr() (which is vectorised in libc)
+// and only then compares the last byte and the rest.
+typedef struct searchPattern {
+    char *needle;
+    int len;
+    int rare; // Offset of the byte memchr() looks for.
+    regex *re; // Set when the needle is a regular expression.
+    const char *error; // Why the regular expression didn't compile.
+} searchPattern;
+
+// What one shard of a background search found. first is the first row
+// (going forward from the cursor) with a match, or -1.
+typedef struct searchShard {
+    int *rows;
+    int nrows;
+    int cap;
+    int first;
+    long long matches;
+    int done;
+} searchShard;
+
+// A search running on worker threads over a snapshot of the rows. Shard
+// k covers the rows from k * YIM_SEARCH_SHARD onwards counting from the
+// cursor (wrapping around the end), and shards are handed out in that
+// order so the nearest match is usually known almost at once. Everything
+// the workers share with the main thread is guarded by lock.
+typedef struct searchJob {
+    pthread_mutex_t lock;
+    rowNode *snap;
+    int numrows;
+    int origin;
+    int origincol;
+    searchPattern pat;
+    searchShard *shards;
+    int nshards;
+    int nextshard;
+    int shardsdone;
+    int listed; // Rows recorded in finished shards.
+    int overflow; // Too many matching rows to keep a list of them.
+    int cancel;
+    pthread_t *threads;
+    int nthreads;
+    int notify; // Written to whenever a shard finishes.
+} searchJob;
+
+// State of an incremental search. rows lists every row that contains a
+// match for the current query, as long as there aren't more than
+// YIM_SEARCH_MAX_ROWS of them. When the query is only extended, only the
+// rows on that list need to be looked at again.
+struct searchState {
+    int active;
+    searchPattern pat;
+    int *rows;
+    int nrows;
+    int cap;
+    int complete;
+    int regex; // The query is a regular expression.
+    int matchrow; // The current match, or -1.
+    int matchcol;
+    long long matches; // Total number of matches found so far.
+    searchJob *job; // The background search that is still running, if any.
+    int notify[2];
+    int saved_cx, saved_cy, saved_coloff, saved_rowoff, saved_wrapoff;
+};
+
+// Maps a node or row of the last swap checkpoint to the line it starts
+// at. Open addressing on the pointer.
+typedef struct swapMap {
+    const void **keys;
+    int *vals;
+    char *kept; // Set for nodes that are still in the tree, whole.
+    int n;
+    int cap;
+} swapMap;
+
+// One piece of a swap checkpoint: count rows of the last checkpoint from
+// line start on, or, with start -1, count new rows from lit[at] on.
+typedef struct swapOp {
+    int start;
+    int count;
+    int at;
+    rowNode *leaf; // A leaf whose rows still have to be looked up.
+} swapOp;
+
+// Collects a checkpoint into batches of iovecs. Headers and lengths are
+// copied into meta, the text of the rows is pointed at where it is.
+typedef struct swapOut {
+    int fd;
+    struct iovec iov[YIM_SAVE_IOV];
+    int niov;
+    char meta[YIM_SAVE_IOV * 16];
+    int metalen;
+    long long total;
+} swapOut;
+
+// A checkpoint being written by the swap thread. The snapshots are handed
+// back to the main thread to release.
+typedef struct swapJob {
+    pthread_mutex_t lock;
+    int cancel;
+    rowNode *snap;
+    rowNode *prev; // The snapshot of the last checkpoint, NULL to write every row.
+    int flags;
+    char *path;
+    int fd; // Appended to, unless prev is NULL.
+    int newfd; // The file the full checkpoint went to.
+    long long size; // Bytes in the swap file.
+    int error; // errno if writing failed, or 0.
+    swapMap nodes;
+    swapMap rows;
+    swapOp *ops;
+    int nops;
+    int capops;
+    erow **lit;
+    int nlit;
+    int caplit;
+    pthread_t thread;
+    int notify;
+} swapJob;
+
+// State of the swap file. prev stays referenced so its rows and nodes
+// aren't freed or changed in place: anything edited is copied first,
+// which is how the next checkpoint tells it apart.
+struct swapState {
+    int off; // Another yim is keeping a swap file for this file, or it can't be written.
+    char *path; // NULL until the first checkpoint.
+    int fd;
+    long long size;
+    rowNode *prev;
+    long long since; // When the buffer was first seen changed, or 0.
+    swapJob *job;
+    int notify[2];
+};
+
+// Walks the rows in order starting at a given line number without paying
+// for a full lookup on every step.
+typedef struct rowIter {
+    int depth;
+    rowNode *path[ROWTREE_MAXDEPTH];
+    int idx[ROWTREE_MAXDEPTH];
+    int at; // The next line, in the viewer.
+    int wraps; // The screen lines the last row returned wraps into, with wrap on.
+} rowIter;
+
+// A row the viewer has read in, and where its line is in the file.
+typedef struct viewSlot {
+    erow *row; // NULL if the slot is free.
+    int line;
+    long long off;
+    long long next; // Where the next line starts.
+    unsigned int used; // When the row was last asked for.
+} viewSlot;
+
+// State of the read-only viewer, see the Viewer section. The indexer
+// thread only touches the fields below lock, and only while holding it.
+struct viewState {
+    int on;
+    int fd;
+    char *map;
+    long long size;
+    viewSlot slots[YIM_VIEW_ROWS];
+    unsigned int clock;
+    int notify[2]; // The indexer writes here when it has made progress.
+    pthread_t thread;
+    // Jumped to the end before the index got there. The last line starts
+    // at aoff and is numbered aline, which is a guess unless exact is set.
+    int anchored;
+    int exact;
+    int floor; // The first line numbered from the last one.
+    // What the first line of the file came out as when counting back from
+    // the last line, or -1. Numbers below it don't belong to any line.
+    int top;
+    int aline;
+    long long aoff;
+
+    pthread_mutex_t lock;
+    long long *index; // index[k] is where line k * YIM_VIEW_STRIDE starts.
+    int nindex;
+    int capindex;
+    long long lines; // Line breaks counted so far.
+    long long bytes; // How far the indexer has got.
+    int done;
+};
+
+// Following a file that is being appended to, see the Follow section.
+struct followState {
+    int on;
+    int fd; // The file being followed, which may no longer have its name.
+    int inotify; // -1 if there is no inotify.
+    int wd; // The watch on the file, or -1 if it has to be polled.
+    long long off; // How much of the file is in the buffer.
+    int pending; // The file changed since it was last read.
+    int lost; // The file was moved away or removed and nothing has its name yet.
+    long long last; // When the file was last looked at, in milliseconds.
+};
+
+// One change in the undo log. It is followed in the arena by the text it
+// removed, the text it inserted, padding, and a copy of size so the log
+// can be walked backwards too. The records made while handling one key
+// form a step, which is what undo and redo work on.
+enum undoType {
+    UNDO_TEXT = 0, // Replaced dellen bytes at (row, col) with inslen bytes.
+    UNDO_INSROW, // Inserted row "row" with the inserted text.
+    UNDO_DELROW // Deleted row "row", which held the deleted text.
+};
+
+typedef struct undoRec {
+    int size;
+    unsigned char type;
+    unsigned char first; // First record of a step.
+    int row;
+    int col;
+    int dellen;
+    int inslen;
+    int cx, cy; // The cursor before and after the step, on its first record.
+    int aftercx, aftercy;
+} undoRec;
+
+// Offsets into buf. Records before cur are done, the ones from cur to
+// len have been undone and can be redone.
+struct undoLog {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t cur;
+    size_t last; // The last record.
+    size_t step; // First record of the step being recorded.
+    int open; // A step has been started for the current key.
+    int coalesce; // The next typed character may extend the last record.
+    int typing; // The current key types (1) or deletes (2) a character.
+    int applying; // Undoing or redoing, so changes aren't recorded.
+    long long saved; // cur when the file was last saved, or -1.
+    int keycx, keycy; // The cursor when the current key came in.
+};
+
+// A file type for syntax highlighting. Keywords ending in '|' are
+// highlighted as HL_KEYWORD2, the rest as HL_KEYWORD1.
+struct editorSyntax {
+    char *filetype;
+    char **filematch;
+    char **keywords;
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    char *quotes; // The characters that open and close a string.
+    int flags;
+};
+
 // This struct contains the editor state
 struct editorConfig {
     int cx, cy;
     int rx;
     int rowoff;
     int coloff;
+    int wrap; // Long lines are wrapped at the edge of the screen.
+    int wrapoff; // With wrap on, the first screen line of row E.rowoff that is shown.
     int screenrows;
     int screencols;
     int numrows;
-    erow *row;
+    rowNode *rows;
+    unsigned int gen;
+    screenLine *screen; // The text, the status bar, the message bar and the stats overlay if shown.
+    int screenlines; // E.screenrows + 2 + STAT_LINES.
+    screenLine scratch; // The line currently being drawn.
+    int screenvalid; // 0 when the terminal has to be cleared and redrawn from scratch.
+    long long drawntop; // editorScreenTop() as of the last frame.
+    int termx, termy; // Where the terminal cursor is while a frame is being emitted.
+    int termhl;
+    int frame_bytes; // Bytes written to the terminal by the last refresh.
     int dirty; // We call a text buffer dirty if it had been modified since opening or saving the file.
+    int crlf; // The file uses "\r\n" line endings.
+    int noeol; // The file's last line had no line ending.
+    int compress; // ZIP_GZIP or ZIP_ZSTD if the file is compressed, 0 if not.
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct termios orig_termios;
+    struct inputBuffer in;
+    struct searchState search;
+    struct viewState view;
+    struct swapState swap;
+    struct followState follow;
+    struct undoLog undo;
+    unsigned int hlgen; // Bumped when highlighting not tied to a row changes.
+    erow *gaprow; // The one row that may have a gap in it, or NULL.
+    struct rowMemory mem;
+    struct editorSyntax *syntax; // NULL if the file type isn't highlighted.
+    int hlclean; // The lexer state at the end of every row before this one is up to date.
+    int sigpipe[2]; // SIGWINCH writes a byte here so poll() wakes up.
+    int redraw; // Set when something changed since the last frame.
+    long long lastframe; // When the last frame was drawn, in milliseconds.
 };
 
 struct editorConfig E;
 
+#ifdef YIM_STATS
+// Counters behind the stats overlay (Ctrl-P) and the dump at exit.
+struct editorStats {
+    long long keys;
+    long long frames;
+    long long frametime; // Nanoseconds spent in editorRefreshScreen().
+    long long framemax;
+    long long lastframe;
+    long long bytes; // Appended to the frame buffer.
+    int lastbytes; // Written by the last frame.
+    long long syscalls; // Reads, writes and polls on the way from a key to a frame.
+    long long mallocs; // Since the start, loading the file included.
+    long long rowupdates;
+    long long lines; // Text lines looked at when drawing.
+    long long linehits; // Text lines that were on screen already.
+    int nodes; // Row tree nodes allocated.
+    int overlay;
+};
+
+struct editorStats S;
+
+// Everything below allocates through these, so allocations get counted.
+// Search threads allocate too, hence the atomic add.
+void *statsMalloc(size_t size) {
+    __sync_fetch_and_add(&S.mallocs, 1);
+    return malloc(size);
+}
+
+void *statsRealloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&S.mallocs, 1);
+    return realloc(ptr, size);
+}
+
+void *statsCalloc(size_t n, size_t size) {
+    __sync_fetch_and_add(&S.mallocs, 1);
+    return calloc(n, size);
+}
+
+#define malloc(size) statsMalloc(size)
+#define realloc(ptr, size) statsRealloc(ptr, size)
+#define calloc(n, size) statsCalloc(n, size)
+#endif
+
+#ifdef YIM_HEADLESS
+// How long each of a kind of operation took, in nanoseconds.
+typedef struct latencyLog {
+    long long *ns;
+    int n;
+    int cap;
+} latencyLog;
+
+// A part of a script, started by "mark". Each one is reported on its own.
+typedef struct headlessSection {
+    char name[32];
+    latencyLog keypress;
+    latencyLog refresh;
+    long long bytes; // Written to the terminal by its frames.
+    long long mallocs; // Made by its keys and frames, in a stats build.
+    int noalloc; // The run fails if mallocs isn't 0.
+} headlessSection;
+
+// A workload of -b timed against another program doing the same job.
+typedef struct headlessCompare {
+    const char *name;
+    long long ns;
+    const char *other;
+    long long otherns; // -1 if the other program failed.
+    long long count; // What both found, if they count something.
+    long long othercount;
+    long long bytes; // What both went through, to report the throughput, or 0.
+} headlessCompare;
+
+// A key from the script: the bytes a terminal would send for it, in
+// H.bytes.
+typedef struct headlessKey {
+    size_t off;
+    int len;
+    int section;
+} headlessKey;
+
+// State of a headless run, see the Headless section.
+struct headlessState {
+    int rows, cols; // The size of the virtual terminal.
+    char *bytes;
+    size_t nbytes;
+    size_t capbytes;
+    headlessKey *keys;
+    int nkeys;
+    int capkeys;
+    int next; // The next key to send.
+    size_t keypos; // What is left of the key being sent.
+    int keyleft;
+    headlessSection *sections;
+    int nsections;
+    int section; // The section of the key being handled.
+    FILE *report; // Where the terminal was; the editor's output goes elsewhere.
+    char *tmpfile; // The file made up for -b, removed at exit.
+    long long opentime; // Nanoseconds taken by editorOpen() and the first frame.
+    long long firstframe;
+    headlessCompare compare[8];
+    int ncompare;
+    int roundtrips; // Files -b opened and saved straight back.
+    int roundtripsbad; // Ones that didn't come back the same.
+};
+
+struct headlessState H;
+#endif
+
 /*---------- Function Prototypes ----------*/
 void editorSetStatusMessage(const char *fmt, ...);
+void editorFreeRow(erow *row);
+void editorGapClose();
+int editorRowWraps(erow *row);
 void editorRefreshScreen();
-char *editorPrompt(char* prompt);
+long long editorNow();
+long long editorNowNs();
+erow *viewRowAt(int line);
+long long viewFind(int line);
+int viewPoll();
+void swapRemove();
+void swapPoll();
+int viewProgress();
+void editorHandleResize();
+int editorWaitEvents(int timeout);
+void undoRecord(int type, int row, int col, const char *del, int dellen, const char *ins, int inslen);
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowempty);
+int zipDetect(int fd);
+const char *zipName(int format);
+void zipOpen(int fd, int format);
+long long zipWriteRows(int fd, int format);
+void followStart();
+void followStop();
+#ifdef YIM_HEADLESS
+int headlessRead(char *buf, int len);
+int headlessNextKey();
+int headlessMain(int argc, char *argv[]);
+void initEditor();
+#endif
 
 /*---------- Terminal Functions -----------*/
 
@@ -81,6 +843,8 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    // Turn bracketed paste back off so the shell doesn't get the markers.
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
         die("tcsetattr");
     }
@@ -113,45 +877,137 @@ void enableRawMode() {
     // Adding IEXTEN disables ctrl-v.
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
+    // read() never waits: poll() does all the waiting, see
+    // editorWaitEvents() and editorInputWait().
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     //tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
+
+    // Bracketed paste makes the terminal wrap pasted text in
+    // "\x1b[200~" ... "\x1b[201~" so it can be inserted in one go
+    // instead of being replayed as keypresses.
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// All the signal handler does is poke the event loop. The actual resize
+// happens in editorHandleResize() outside of signal context.
+void editorSigwinch(int sig) {
+    (void) sig;
+    int saved = errno;
+    write(E.sigpipe[1], "w", 1);
+    errno = saved;
+}
+
+void editorInitSignals() {
+    if (pipe(E.sigpipe) == -1) die("pipe");
+    fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorSigwinch;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+// Reads whatever input is available into E.in with a single read().
+// Returns the number of bytes read, or 0 if there was none.
+int editorFillInput() {
+    struct inputBuffer *in = &E.in;
+    if (in->start == in->end) {
+        in->start = in->end = 0;
+    }
+    else if (in->end == YIM_INPUT_BUF) {
+        memmove(in->buf, &in->buf[in->start], in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+
+#ifdef YIM_HEADLESS
+    int nread = headlessRead(&in->buf[in->end], YIM_INPUT_BUF - in->end);
+#else
+    int nread = read(STDIN_FILENO, &in->buf[in->end], YIM_INPUT_BUF - in->end);
+    STAT_ADD(syscalls, 1);
+#endif
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread <= 0) return 0;
+    in->end += nread;
+    return nread;
+}
+
+// Waits up to ms milliseconds (-1 for ever) for input and reads it in.
+// Returns the number of bytes read, 0 if none came in time, or -1 if the
+// terminal hung up or the input ended.
+int editorInputWait(int ms) {
+#ifdef YIM_HEADLESS
+    // The script has no more of this key.
+    (void) ms;
+    int nread = editorFillInput();
+    return nread ? nread : -1;
+#else
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    int ready = poll(&pfd, 1, ms);
+    STAT_ADD(syscalls, 1);
+    if (ready == -1 && errno != EINTR) die("poll");
+    if (ready <= 0) return 0;
+    int nread = editorFillInput();
+    // Readable but nothing to read is the end of the input.
+    return nread ? nread : -1;
+#endif
+}
+
+// Takes the next byte of input, waiting up to YIM_ESC_MS for it. Returns
+// 0 if nothing arrived in time.
+int editorInputByte(char *c) {
+    if (E.in.start == E.in.end && editorInputWait(YIM_ESC_MS) <= 0) return 0;
+    *c = E.in.buf[E.in.start++];
+    return 1;
 }
 
 // The job of this function is to wait for one keypress and return it.
 int editorReadKey() {
-    int nread;
     char c;
-    // Asking read() to read 1 byte from the std input into the var c
-    // and will keep doing it until there aren't anymore bytes to read.
-    // It returns the number of bytes that it read, and will return 0
-    // when it reaches the end of the file.
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+    // Sleep in poll() until there is a byte. When the input buffer is
+    // empty this refills it with everything that is available at once.
+    while (E.in.start == E.in.end) {
+        if (editorWaitEvents(-1)) editorRefreshScreen();
     }
+    c = E.in.buf[E.in.start++];
+    STAT_ADD(keys, 1);
 
     if (c == '\x1b') {
-        char seq[3];
+        char seq[2];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (!editorInputByte(&seq[0])) return '\x1b';
+        if (!editorInputByte(&seq[1])) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                // Sequences like "\x1b[5~" or "\x1b[200~" carry a number.
+                int num = seq[1] - '0';
+                char next;
+                while (1) {
+                    if (!editorInputByte(&next)) return '\x1b';
+                    if (next < '0' || next > '9') break;
+                    num = num * 10 + (next - '0');
+                }
+                if (next == '~') {
+                    switch (num) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return PASTE_START;
+                        case 201: return PASTE_END;
                     }
                 }
             }
@@ -175,7 +1031,49 @@ int editorReadKey() {
         return '\x1b';
     }
     else {
-        return c;
+        // Bytes of UTF-8 characters come through as 128 to 255.
+        return (unsigned char) c;
+    }
+}
+
+// Called after PASTE_START. Collects everything up to the closing
+// "\x1b[201~" straight from the input buffer and returns it. If the input
+// ends first, the paste ends with it.
+char *editorReadPaste(size_t *len) {
+    static const char endmark[] = "\x1b[201~";
+    size_t marklen = sizeof(endmark) - 1;
+    size_t cap = YIM_INPUT_BUF;
+    char *buf = malloc(cap);
+    *len = 0;
+
+    while (1) {
+        struct inputBuffer *in = &E.in;
+        if (in->start == in->end) {
+            int nread;
+            while ((nread = editorInputWait(-1)) == 0);
+            if (nread == -1) return buf;
+        }
+        size_t avail = in->end - in->start;
+        if (*len + avail > cap) {
+            while (*len + avail > cap) cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        memcpy(&buf[*len], &in->buf[in->start], avail);
+        in->start = in->end;
+
+        // The end marker may straddle two reads, so look a little back.
+        size_t from = *len > marklen ? *len - marklen : 0;
+        *len += avail;
+        char *mark = memmem(&buf[from], *len - from, endmark, marklen);
+        if (mark) {
+            // Anything typed after the paste goes back into the input buffer.
+            size_t after = &buf[*len] - (mark + marklen);
+            memcpy(in->buf, mark + marklen, after);
+            in->start = 0;
+            in->end = after;
+            *len = mark - buf;
+            return buf;
+        }
     }
 }
 
@@ -186,6 +1084,10 @@ int getCursorPosition(int *rows, int *cols) {
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while (i < sizeof(buf) - 1) {
+        struct pollfd pfd;
+        pfd.fd = STDIN_FILENO;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, YIM_ESC_MS) != 1) break;
         if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
 
         if (buf[i] == 'R') break;
@@ -200,6 +1102,11 @@ int getCursorPosition(int *rows, int *cols) {
 }
 
 int getWindowSize(int *rows, int *cols) {
+#ifdef YIM_HEADLESS
+    *rows = H.rows;
+    *cols = H.cols;
+    return 0;
+#else
     struct winsize ws;
 
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
@@ -215,289 +1122,5901 @@ int getWindowSize(int *rows, int *cols) {
         *rows = ws.ws_row;
         return 0;
     }
+#endif
 }
 
-/*---------- Row Operations ----------*/
+/*---------- Row Memory ----------*/
+// Millions of short rows make malloc's per-block header and rounding cost
+// more than the text itself, so rows don't get a block each. Row structs
+// are handed out from large blocks and go on a free list when they're
+// freed. Row text either stays in the buffer the file was read into,
+// until the row is first edited (cap is 0), or lives in a power-of-two
+// size class carved out of large blocks, or, past YIM_TEXT_SLAB_MAX
+// bytes, in a block of its own. Slabs are never given back to the
+// system, only reused. The blocks a file is loaded into are, once the
+// buffer has started over from the file and their last row is gone. All
+// of it is only used from the main thread.
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx +=  (YIM_TAB_STOP - 1) - (rx % YIM_TAB_STOP);
-        rx++;
+// memBlock() in steps, for a block that is filled in on another thread
+// before its size is known. Only memBlockKeep() or memLoadKeep(), which
+// chain the block with the others, have to be called on the main thread.
+void *memBlockNew(size_t size) {
+    void **block = malloc(sizeof(void *) + size);
+    if (block == NULL) die("malloc");
+    return &block[1];
+}
+
+void *memBlockResize(void *p, size_t size) {
+    void **block = realloc((void **) p - 1, sizeof(void *) + size);
+    if (block == NULL) die("realloc");
+    return &block[1];
+}
+
+void *memBlockKeep(void *p) {
+    void **block = (void **) p - 1;
+    block[0] = E.mem.blocks;
+    E.mem.blocks = block;
+    return p;
+}
+
+// Gets size bytes that are never freed. The blocks are chained so that
+// they can still be found (by leak checkers, say).
+void *memBlock(size_t size) {
+    return memBlockKeep(memBlockNew(size));
+}
+
+// Loaded text and the rows made from it go into blocks of the current
+// load generation. Row text borrowed from them (cap 0) is only ever
+// borrowed by row structs of the same generation, so the blocks can go
+// with the last of those.
+int memLoadGen() {
+    if (E.mem.gen == 0) E.mem.gen = 1;
+    return E.mem.gen;
+}
+
+// memBlockKeep() for a block of the current load generation.
+void *memLoadKeep(void *p) {
+    struct loadGen *g = &E.mem.gens[memLoadGen()];
+    void **block = (void **) p - 1;
+    block[0] = g->blocks;
+    g->blocks = block;
+    return p;
+}
+
+void *memLoadBlock(size_t size) {
+    return memLoadKeep(memBlockNew(size));
+}
+
+// Counts n rows about to be made in the current load generation and
+// returns it, for their loadgen.
+int memLoadRows(int n) {
+    int gen = memLoadGen();
+    E.mem.gens[gen].rows += n;
+    return gen;
+}
+
+void memLoadFree(struct loadGen *g) {
+    while (g->blocks) {
+        void **block = g->blocks;
+        g->blocks = block[0];
+        free(block);
     }
+}
 
-    return rx;
+// A row struct of generation gen is freed.
+void memLoadRelease(int gen) {
+    struct loadGen *g = &E.mem.gens[gen];
+    if (--g->rows == 0 && gen != E.mem.gen) memLoadFree(g);
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+// Starts a new load generation once the buffer has let go of its rows.
+// The old one is freed now, or with its last row if a snapshot still has
+// some. If every generation is still held, loading goes on in this one.
+void memLoadNext() {
+    if (E.mem.gen == 0) return;
+    struct loadGen *g = &E.mem.gens[E.mem.gen];
+    if (g->rows == 0) {
+        memLoadFree(g);
+        return;
+    }
     int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
+    for (j = 1; j < YIM_LOAD_GENS; j++) {
+        if (E.mem.gens[j].rows == 0 && E.mem.gens[j].blocks == NULL) {
+            E.mem.gen = j;
+            return;
+        }
+    }
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(YIM_TAB_STOP - 1) + 1);
+erow *rowAlloc() {
+    erow *row = E.mem.freerows;
+    if (row) {
+        E.mem.freerows = *(erow **) row;
+        return row;
+    }
+    if (E.mem.rowsleft == 0) {
+        E.mem.rowblock = memBlock(sizeof(erow) * YIM_ROW_SLAB);
+        E.mem.rowsleft = YIM_ROW_SLAB;
+    }
+    E.mem.rowsleft--;
+    return E.mem.rowblock++;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % YIM_TAB_STOP != 0) row->render[idx++] = ' ';
-        }
-        else {
-            row->render[idx++] = row->chars[j];
-        }
+// A freed row keeps the link to the next free one where chars was.
+void rowFree(erow *row) {
+    *(erow **) row = E.mem.freerows;
+    E.mem.freerows = row;
+}
+
+// Returns room for at least need bytes of text and sets *cap to how much
+// room there is.
+char *rowTextAlloc(int need, int *cap) {
+    if (need > YIM_TEXT_SLAB_MAX) {
+        char *p = malloc(need);
+        if (p == NULL) die("malloc");
+        *cap = need;
+        return p;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    int k = 0;
+    while ((YIM_TEXT_SLAB_MIN << k) < need) k++;
+    int size = YIM_TEXT_SLAB_MIN << k;
+    *cap = size;
+    char *p = E.mem.freetext[k];
+    if (p) {
+        E.mem.freetext[k] = *(char **) p;
+        return p;
+    }
+    if (E.mem.textleft < size) {
+        // Whatever is left of the old block is too small for this class
+        // and is let go.
+        E.mem.textblock = memBlock(YIM_TEXT_SLAB);
+        E.mem.textleft = YIM_TEXT_SLAB;
+    }
+    p = E.mem.textblock;
+    E.mem.textblock += size;
+    E.mem.textleft -= size;
+    return p;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+void rowTextFree(char *p, int cap) {
+    if (cap == 0) return;
+    if (cap > YIM_TEXT_SLAB_MAX) {
+        free(p);
+        return;
+    }
+    int k = 0;
+    while ((YIM_TEXT_SLAB_MIN << k) < cap) k++;
+    *(char **) p = E.mem.freetext[k];
+    E.mem.freetext[k] = p;
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+// Room for the highlight of a row. It follows the room of the text, which
+// only changes in editorRowResize(), so typing into a row doesn't grow it.
+int rowHlRoom(erow *row) {
+    return row->cap ? row->cap : row->size + 1;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// Moves the text of a row to room for at least need bytes that the row
+// owns, keeping the first keep bytes.
+void editorRowResize(erow *row, int need, int keep) {
+    // The highlight was sized for the old room; the next draw makes one
+    // for the new room.
+    free(row->hl);
+    row->hl = NULL;
+    if (row->cap > YIM_TEXT_SLAB_MAX && need > YIM_TEXT_SLAB_MAX) {
+        row->chars = realloc(row->chars, need);
+        if (row->chars == NULL) die("realloc");
+        row->cap = need;
+        return;
+    }
+    int cap;
+    char *p = rowTextAlloc(need, &cap);
+    memcpy(p, row->chars, keep < need ? keep : need);
+    rowTextFree(row->chars, row->cap);
+    row->chars = p;
+    row->cap = cap;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+/*---------- Row Store ----------*/
+// Helpers for the B+tree that holds the rows. Nothing outside this section
+// should look at rowNode directly; everything goes through editorRowAt(),
+// editorRowAtMut(), rowTreeInsert(), rowTreeRemove() and the row iterator.
+// Reference counts are only ever touched from the main thread. Threads
+// reading a snapshot leave releasing it to the main thread.
 
-    E.numrows++;
-    E.dirty++;
+// rowNodeNew() without counting the node in the stats, for threads
+// building a tree while the loader loads a file.
+rowNode *rowNodeAlloc(int leaf) {
+    rowNode *node = calloc(1, sizeof(rowNode));
+    if (node == NULL) die("calloc");
+    node->leaf = leaf;
+    node->refs = 1;
+    return node;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+rowNode *rowNodeNew(int leaf) {
+    STAT_ADD(nodes, 1);
+    return rowNodeAlloc(leaf);
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+// Sets up a row whose text is s, which stays where it is. s[len] has to
+// be '\0' and s must not change, as with the load buffer. This touches
+// nothing but the row, so loading threads use it too.
+void editorRowInit(erow *row, char *s, size_t len, unsigned int gen) {
+    row->size = len;
+    row->chars = s;
+    row->cap = 0;
+    row->gap = 0;
+    row->gaplen = 0;
+    row->plain = -1;
+    row->colmap = NULL;
+    row->ncolmap = 0;
+    row->colmapcap = 0;
+    row->gen = gen;
+    row->refs = 1;
+    row->hl = NULL;
+    row->hlstart = row->hlend = SYN_NORMAL;
+    row->hlgen = 0;
+    row->loadgen = 0;
+    row->lf = 0;
 }
 
-// This lets inserting a single character into an erow at a given position.
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+// Makes a row that borrows its text, as above.
+erow *editorRowBorrow(char *s, size_t len) {
+    erow *row = rowAlloc();
+    editorRowInit(row, s, len, ++E.gen);
+    return row;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+// Makes a row holding a copy of s.
+erow *editorRowNew(const char *s, size_t len) {
+    int cap;
+    char *chars = rowTextAlloc(len + 1, &cap);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    erow *row = editorRowBorrow(chars, len);
+    row->cap = cap;
+    return row;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at+1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorRowRelease(erow *row) {
+    if (--row->refs == 0) editorFreeRow(row);
 }
 
-/*---------- Editor Operations ----------*/
-// This section will contain functions that we'll call from 
-// editorProcessKeypress() when mapping keypresses to text
-// editing operations.
+// The number of rows stored under a node.
+int rowNodeCount(rowNode *node) {
+    if (node->leaf) return node->n;
+    int total = 0;
+    int j;
+    for (j = 0; j < node->n; j++) total += node->count[j];
+    return total;
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+// What a row adds to the bytes of the tree: its size, less one if its line
+// ends in a lone '\n' in a CRLF file. Adding the file's line ending for
+// every line then gives offsets into the file.
+int rowTreeSize(erow *row) {
+    return row->size - row->lf;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+// The number of bytes in the rows stored under a node.
+long long rowNodeBytes(rowNode *node) {
+    long long total = 0;
+    int j;
+    for (j = 0; j < node->n; j++) total += node->leaf ? rowTreeSize(node->u.row[j]) : node->bytes[j];
+    return total;
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+// The number of screen lines the rows under a node take when wrapped.
+int rowNodeWraps(rowNode *node) {
+    int total = 0;
+    int j;
+    for (j = 0; j < node->n; j++) total += node->wraps[j];
+    return total;
+}
+
+// Drops a reference to a node, freeing it and whatever it alone pointed
+// to once nothing else refers to it.
+void rowNodeRelease(rowNode *node) {
+    if (node == NULL || --node->refs > 0) return;
+    int j;
+    for (j = 0; j < node->n; j++) {
+        if (node->leaf) editorRowRelease(node->u.row[j]);
+        else rowNodeRelease(node->u.child[j]);
     }
-    else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+    STAT_ADD(nodes, -1);
+    free(node);
+}
+
+// Returns a node that can be modified in place: the node itself, or a
+// private copy if a snapshot still refers to it.
+rowNode *rowNodeUnshare(rowNode *node) {
+    if (node->refs == 1) return node;
+    rowNode *copy = malloc(sizeof(rowNode));
+    if (copy == NULL) die("malloc");
+    memcpy(copy, node, sizeof(rowNode));
+    copy->refs = 1;
+    int j;
+    for (j = 0; j < copy->n; j++) {
+        if (copy->leaf) copy->u.row[j]->refs++;
+        else copy->u.child[j]->refs++;
     }
+    node->refs--;
+    return copy;
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+// Moves the upper half of a full node into a new sibling and returns it.
+rowNode *rowNodeSplit(rowNode *node) {
+    rowNode *sib = rowNodeNew(node->leaf);
+    int half = node->n / 2;
+    sib->n = node->n - half;
+    memcpy(sib->count, &node->count[half], sizeof(int) * sib->n);
+    memcpy(sib->bytes, &node->bytes[half], sizeof(long long) * sib->n);
+    memcpy(sib->wraps, &node->wraps[half], sizeof(int) * sib->n);
+    if (node->leaf)
+        memcpy(sib->u.row, &node->u.row[half], sizeof(erow *) * sib->n);
+    else
+        memcpy(sib->u.child, &node->u.child[half], sizeof(rowNode *) * sib->n);
+    node->n = half;
+    return sib;
+}
+
+// Inserts a row so that it ends up at index "at" under this node. If the
+// node fills up it is split and the new right half is returned.
+rowNode *rowNodeInsert(rowNode *node, int at, erow *row) {
+    if (node->leaf) {
+        memmove(&node->u.row[at + 1], &node->u.row[at], sizeof(erow *) * (node->n - at));
+        memmove(&node->wraps[at + 1], &node->wraps[at], sizeof(int) * (node->n - at));
+        node->u.row[at] = row;
+        node->wraps[at] = E.wrap ? editorRowWraps(row) : 0;
+        node->n++;
     }
     else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        int i = 0;
+        while (i < node->n - 1 && at > node->count[i]) {
+            at -= node->count[i];
+            i++;
+        }
+        node->u.child[i] = rowNodeUnshare(node->u.child[i]);
+        rowNode *sib = rowNodeInsert(node->u.child[i], at, row);
+        node->count[i]++;
+        node->bytes[i] += rowTreeSize(row);
+        if (sib) {
+            memmove(&node->u.child[i + 2], &node->u.child[i + 1], sizeof(rowNode *) * (node->n - i - 1));
+            memmove(&node->count[i + 2], &node->count[i + 1], sizeof(int) * (node->n - i - 1));
+            memmove(&node->bytes[i + 2], &node->bytes[i + 1], sizeof(long long) * (node->n - i - 1));
+            memmove(&node->wraps[i + 2], &node->wraps[i + 1], sizeof(int) * (node->n - i - 1));
+            node->u.child[i + 1] = sib;
+            node->count[i + 1] = rowNodeCount(sib);
+            node->count[i] -= node->count[i + 1];
+            node->bytes[i + 1] = rowNodeBytes(sib);
+            node->bytes[i] -= node->bytes[i + 1];
+            node->wraps[i + 1] = E.wrap ? rowNodeWraps(sib) : 0;
+            node->n++;
+        }
+        // With wrap off every row takes 0 screen lines, and so does every
+        // subtree. That saves adding them up for each row a file grows by.
+        if (E.wrap) node->wraps[i] = rowNodeWraps(node->u.child[i]);
     }
-    E.cy++;
-    E.cx = 0;
+    return node->n == ROWTREE_FANOUT ? rowNodeSplit(node) : NULL;
 }
 
-/*---------- File I/O ----------*/
+// Folds child i + 1 into child i. The caller makes sure both fit.
+void rowNodeMerge(rowNode *node, int i) {
+    rowNode *left = node->u.child[i];
+    rowNode *right = node->u.child[i + 1];
+    memcpy(&left->count[left->n], right->count, sizeof(int) * right->n);
+    memcpy(&left->bytes[left->n], right->bytes, sizeof(long long) * right->n);
+    memcpy(&left->wraps[left->n], right->wraps, sizeof(int) * right->n);
+    if (left->leaf)
+        memcpy(&left->u.row[left->n], right->u.row, sizeof(erow *) * right->n);
+    else
+        memcpy(&left->u.child[left->n], right->u.child, sizeof(rowNode *) * right->n);
+    left->n += right->n;
+    STAT_ADD(nodes, -1);
+    free(right);
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) 
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
+    node->count[i] += node->count[i + 1];
+    node->bytes[i] += node->bytes[i + 1];
+    node->wraps[i] += node->wraps[i + 1];
+    memmove(&node->u.child[i + 1], &node->u.child[i + 2], sizeof(rowNode *) * (node->n - i - 2));
+    memmove(&node->count[i + 1], &node->count[i + 2], sizeof(int) * (node->n - i - 2));
+    memmove(&node->bytes[i + 1], &node->bytes[i + 2], sizeof(long long) * (node->n - i - 2));
+    memmove(&node->wraps[i + 1], &node->wraps[i + 2], sizeof(int) * (node->n - i - 2));
+    node->n--;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
-    }
+// Evens out children i and i + 1 when they are too full to merge.
+void rowNodeRebalance(rowNode *node, int i) {
+    rowNode *left = node->u.child[i];
+    rowNode *right = node->u.child[i + 1];
+    int total = left->n + right->n;
+    int moved = 0;
+    long long movedbytes = 0;
+    int k;
 
-    return buf;
+    if (left->n < right->n) {
+        int m = total / 2 - left->n;
+        for (k = 0; k < m; k++) {
+            moved += left->leaf ? 1 : right->count[k];
+            movedbytes += left->leaf ? rowTreeSize(right->u.row[k]) : right->bytes[k];
+        }
+        memcpy(&left->count[left->n], right->count, sizeof(int) * m);
+        memmove(right->count, &right->count[m], sizeof(int) * (right->n - m));
+        memcpy(&left->bytes[left->n], right->bytes, sizeof(long long) * m);
+        memmove(right->bytes, &right->bytes[m], sizeof(long long) * (right->n - m));
+        memcpy(&left->wraps[left->n], right->wraps, sizeof(int) * m);
+        memmove(right->wraps, &right->wraps[m], sizeof(int) * (right->n - m));
+        if (left->leaf) {
+            memcpy(&left->u.row[left->n], right->u.row, sizeof(erow *) * m);
+            memmove(right->u.row, &right->u.row[m], sizeof(erow *) * (right->n - m));
+        }
+        else {
+            memcpy(&left->u.child[left->n], right->u.child, sizeof(rowNode *) * m);
+            memmove(right->u.child, &right->u.child[m], sizeof(rowNode *) * (right->n - m));
+        }
+        left->n += m;
+        right->n -= m;
+        node->count[i] += moved;
+        node->count[i + 1] -= moved;
+        node->bytes[i] += movedbytes;
+        node->bytes[i + 1] -= movedbytes;
+    }
+    else {
+        int m = total / 2 - right->n;
+        int from = left->n - m;
+        for (k = from; k < left->n; k++) {
+            moved += left->leaf ? 1 : left->count[k];
+            movedbytes += left->leaf ? rowTreeSize(left->u.row[k]) : left->bytes[k];
+        }
+        memmove(&right->count[m], right->count, sizeof(int) * right->n);
+        memcpy(right->count, &left->count[from], sizeof(int) * m);
+        memmove(&right->bytes[m], right->bytes, sizeof(long long) * right->n);
+        memcpy(right->bytes, &left->bytes[from], sizeof(long long) * m);
+        memmove(&right->wraps[m], right->wraps, sizeof(int) * right->n);
+        memcpy(right->wraps, &left->wraps[from], sizeof(int) * m);
+        if (left->leaf) {
+            memmove(&right->u.row[m], right->u.row, sizeof(erow *) * right->n);
+            memcpy(right->u.row, &left->u.row[from], sizeof(erow *) * m);
+        }
+        else {
+            memmove(&right->u.child[m], right->u.child, sizeof(rowNode *) * right->n);
+            memcpy(right->u.child, &left->u.child[from], sizeof(rowNode *) * m);
+        }
+        left->n -= m;
+        right->n += m;
+        node->count[i] -= moved;
+        node->count[i + 1] += moved;
+        node->bytes[i] -= movedbytes;
+        node->bytes[i + 1] += movedbytes;
+    }
+    node->wraps[i] = rowNodeWraps(left);
+    node->wraps[i + 1] = rowNodeWraps(right);
 }
 
-// For opening and reading a file from disk.
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+// Unlinks the row at index "at" under this node and returns it. Children
+// that get too sparse are merged with a neighbour so the tree stays shallow.
+erow *rowNodeRemove(rowNode *node, int at) {
+    if (node->leaf) {
+        erow *row = node->u.row[at];
+        memmove(&node->u.row[at], &node->u.row[at + 1], sizeof(erow *) * (node->n - at - 1));
+        memmove(&node->wraps[at], &node->wraps[at + 1], sizeof(int) * (node->n - at - 1));
+        node->n--;
+        return row;
+    }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
+    int i = 0;
+    while (at >= node->count[i]) {
+        at -= node->count[i];
+        i++;
+    }
+    rowNode *child = node->u.child[i] = rowNodeUnshare(node->u.child[i]);
+    erow *row = rowNodeRemove(child, at);
+    node->count[i]--;
+    node->bytes[i] -= rowTreeSize(row);
+    node->wraps[i] = rowNodeWraps(child);
 
-        editorInsertRow(E.numrows, line, linelen);
+    if (child->n < ROWTREE_FANOUT / 4 && node->n > 1) {
+        int j = (i + 1 < node->n) ? i : i - 1;
+        node->u.child[j] = rowNodeUnshare(node->u.child[j]);
+        node->u.child[j + 1] = rowNodeUnshare(node->u.child[j + 1]);
+        if (node->u.child[j]->n + node->u.child[j + 1]->n < ROWTREE_FANOUT)
+            rowNodeMerge(node, j);
+        else
+            rowNodeRebalance(node, j);
     }
-    free(line);
-    fclose(fp);
-    // editorOpen() calls editorAppendRow() which increments E.dirty.
-    // This turns the dirty flag on before modifying anything.
-    // The line below is here so that (modified) does not show before 
-    // making changes to the file.
-    E.dirty = 0;
+    return row;
 }
 
-void editorSave() {
-    // If the file name is not given.
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)");
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted!");
-            return;
+// Returns the row at the given line number. O(log n).
+erow *editorRowAt(int at) {
+    if (E.view.on) return viewRowAt(at);
+    if (at < 0 || at >= E.numrows) return NULL;
+    rowNode *node = E.rows;
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->count[i]) {
+            at -= node->count[i];
+            i++;
         }
+        node = node->u.child[i];
     }
+    return node->u.row[at];
+}
 
-    int len;
-    char* buf = editorRowsToString(&len);
-
-    // O_CREAT -> tells open() to create a new file if it doesn't exist.
-    // O_RDWR -> tells open() we want to open it for reading and writing.
-    // 0644 is the permission code. This gives the owner of the file permission to 
-    // read and write the file.
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    // Ensuring that whether or not an error occured the file is closed
-    // and the memory that buf points to is freed
-    if (fd != -1) {
-        // Sets the file's size to the specified length. If it is shorter, this will add 
-        // 0 bytes at the end to make it that length.
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+// Like editorRowAt(), but for a row that is about to be modified. Any node
+// on the way down and the row itself are copied first if a snapshot
+// shares them.
+erow *editorRowAtMut(int at) {
+    if (at < 0 || at >= E.numrows) return NULL;
+    rowNode *node = E.rows = rowNodeUnshare(E.rows);
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->count[i]) {
+            at -= node->count[i];
+            i++;
         }
-        close(fd);
+        node = node->u.child[i] = rowNodeUnshare(node->u.child[i]);
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+
+    erow *row = node->u.row[at];
+    if (row->refs > 1) {
+        // The copy is from a slab, so it can't borrow text from a load
+        // block, which may go before it does.
+        erow *copy = editorRowNew(row->chars, row->size);
+        copy->lf = row->lf;
+        row->refs--;
+        node->u.row[at] = row = copy;
+    }
+    return row;
 }
 
-/*---------- Append Buffer ----------*/
+// Tells the tree that row "at" grew or shrank by delta bytes. Called after
+// editorRowAtMut(), so the path down is already unshared.
+void rowTreeAddBytes(int at, long long delta) {
+    rowNode *node = E.rows = rowNodeUnshare(E.rows);
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->count[i]) {
+            at -= node->count[i];
+            i++;
+        }
+        node->bytes[i] += delta;
+        node = node->u.child[i] = rowNodeUnshare(node->u.child[i]);
+    }
+}
+
+// Returns the number of bytes in the lines before line "at", not counting
+// their line endings, as rowTreeSize() counts them. O(log n).
+long long rowTreeOffset(int at) {
+    long long off = 0;
+    rowNode *node = E.rows;
+    if (node == NULL) return 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n - 1 && at >= node->count[i]) {
+            at -= node->count[i];
+            off += node->bytes[i];
+            i++;
+        }
+        node = node->u.child[i];
+    }
+    int j;
+    for (j = 0; j < at && j < node->n; j++) off += rowTreeSize(node->u.row[j]);
+    return off;
+}
+
+// Finds the line holding byte "off" of the file, if every line but those
+// marked lf ends in eol bytes, and the column of that byte in it. Returns -1 if off is past
+// the end. O(log n).
+int rowTreeFindOffset(long long off, int eol, int *col) {
+    rowNode *node = E.rows;
+    if (node == NULL || off < 0) return -1;
+    int line = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n && off >= node->bytes[i] + (long long) node->count[i] * eol) {
+            off -= node->bytes[i] + (long long) node->count[i] * eol;
+            line += node->count[i];
+            i++;
+        }
+        if (i == node->n) return -1;
+        node = node->u.child[i];
+    }
+    int j;
+    for (j = 0; j < node->n; j++) {
+        int len = node->u.row[j]->size;
+        int span = rowTreeSize(node->u.row[j]) + eol;
+        if (off < span) {
+            // A byte of the line ending counts as the end of the line.
+            *col = off < len ? off : len;
+            return line + j;
+        }
+        off -= span;
+    }
+    return -1;
+}
+
+// Works out again how many screen lines row "at" wraps into, after it
+// was edited. Called after editorRowAtMut() like rowTreeAddBytes().
+void rowTreeUpdateWraps(int at) {
+    rowNode *path[ROWTREE_MAXDEPTH];
+    int idx[ROWTREE_MAXDEPTH];
+    int depth = 0;
+    rowNode *node = E.rows;
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->count[i]) {
+            at -= node->count[i];
+            i++;
+        }
+        path[depth] = node;
+        idx[depth++] = i;
+        node = node->u.child[i];
+    }
+    int delta = editorRowWraps(node->u.row[at]) - node->wraps[at];
+    node->wraps[at] += delta;
+    while (depth > 0) {
+        depth--;
+        path[depth]->wraps[idx[depth]] += delta;
+    }
+}
+
+// Fills in the screen line counts of the whole tree from scratch, when
+// wrapping is turned on or the screen changes width. O(n).
+void rowTreeRewrap(rowNode *node) {
+    int j;
+    for (j = 0; j < node->n; j++) {
+        if (node->leaf) {
+            node->wraps[j] = editorRowWraps(node->u.row[j]);
+        } else {
+            rowTreeRewrap(node->u.child[j]);
+            node->wraps[j] = rowNodeWraps(node->u.child[j]);
+        }
+    }
+}
+
+// Returns the number of screen lines the lines before line "at" wrap
+// into. O(log n).
+long long rowTreeWrapOffset(int at) {
+    long long off = 0;
+    rowNode *node = E.rows;
+    if (node == NULL) return 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n - 1 && at >= node->count[i]) {
+            at -= node->count[i];
+            off += node->wraps[i];
+            i++;
+        }
+        node = node->u.child[i];
+    }
+    int j;
+    for (j = 0; j < at && j < node->n; j++) off += node->wraps[j];
+    return off;
+}
+
+// Finds the line that screen line pos of the wrapped text belongs to, and
+// which of its screen lines it is. Past the end that is E.numrows and 0.
+// O(log n).
+int rowTreeFindWrap(long long pos, int *seg) {
+    rowNode *node = E.rows;
+    *seg = 0;
+    if (node == NULL || pos < 0) return 0;
+    int line = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n && pos >= node->wraps[i]) {
+            pos -= node->wraps[i];
+            line += node->count[i];
+            i++;
+        }
+        if (i == node->n) return E.numrows;
+        node = node->u.child[i];
+    }
+    int j;
+    for (j = 0; j < node->n; j++) {
+        if (pos < node->wraps[j]) {
+            *seg = pos;
+            return line + j;
+        }
+        pos -= node->wraps[j];
+    }
+    return E.numrows;
+}
+
+// Takes an O(1) read-only snapshot of the rows. The snapshot stays valid
+// however the buffer is edited afterwards, and can be walked from another
+// thread with rowIterSeekIn(). Hand it back with rowNodeRelease() on the
+// main thread.
+rowNode *rowTreeSnapshot() {
+    // Other threads read rows as plain strings.
+    editorGapClose();
+    if (E.rows == NULL) E.rows = rowNodeNew(1);
+    E.rows->refs++;
+    return E.rows;
+}
+
+void rowTreeInsert(int at, erow *row) {
+    if (E.rows == NULL) E.rows = rowNodeNew(1);
+    E.rows = rowNodeUnshare(E.rows);
+    rowNode *sib = rowNodeInsert(E.rows, at, row);
+    if (sib) {
+        // The root was split, so the tree grows by one level.
+        rowNode *root = rowNodeNew(0);
+        root->n = 2;
+        root->u.child[0] = E.rows;
+        root->u.child[1] = sib;
+        root->count[0] = rowNodeCount(E.rows);
+        root->count[1] = rowNodeCount(sib);
+        root->bytes[0] = rowNodeBytes(E.rows);
+        root->bytes[1] = rowNodeBytes(sib);
+        root->wraps[0] = rowNodeWraps(E.rows);
+        root->wraps[1] = rowNodeWraps(sib);
+        E.rows = root;
+    }
+}
+
+erow *rowTreeRemove(int at) {
+    E.rows = rowNodeUnshare(E.rows);
+    erow *row = rowNodeRemove(E.rows, at);
+    // Drop internal roots that are left with a single child.
+    while (!E.rows->leaf && E.rows->n == 1) {
+        rowNode *old = E.rows;
+        E.rows = old->u.child[0];
+        STAT_ADD(nodes, -1);
+        free(old);
+    }
+    return row;
+}
+
+// A whole tree is built bottom-up from an array of rows in O(n). This is
+// used when loading a file, instead of inserting the rows one at a time.
+// Nodes are only filled three quarters of the way so the first edits
+// don't immediately split every node they touch. The bottom levels can be
+// built a stretch of rows at a time on other threads, so the nodes made
+// there aren't counted in the stats; the caller does that.
+#define ROWTREE_BUILD_FILL (ROWTREE_FANOUT * 3 / 4)
+
+// Packs rows into leaves and returns how many there are.
+int rowTreeLeaves(erow **rows, int numrows, rowNode **level) {
+    int per = ROWTREE_BUILD_FILL;
+    int n = (numrows + per - 1) / per;
+    int j;
+    for (j = 0; j < n; j++) {
+        int from = j * per;
+        int take = numrows - from < per ? numrows - from : per;
+        level[j] = rowNodeAlloc(1);
+        level[j]->n = take;
+        memcpy(level[j]->u.row, &rows[from], sizeof(erow *) * take);
+        int k;
+        for (k = 0; E.wrap && k < take; k++) level[j]->wraps[k] = editorRowWraps(rows[from + k]);
+    }
+    return n;
+}
+
+// Packs n nodes into parents, in place, and returns how many there are.
+int rowTreeParents(rowNode **level, int n) {
+    int per = ROWTREE_BUILD_FILL;
+    int up = (n + per - 1) / per;
+    int j;
+    for (j = 0; j < up; j++) {
+        int from = j * per;
+        int take = n - from < per ? n - from : per;
+        rowNode *node = rowNodeAlloc(0);
+        int k;
+        node->n = take;
+        for (k = 0; k < take; k++) {
+            node->u.child[k] = level[from + k];
+            node->count[k] = rowNodeCount(level[from + k]);
+            node->bytes[k] = rowNodeBytes(level[from + k]);
+            node->wraps[k] = rowNodeWraps(level[from + k]);
+        }
+        level[j] = node;
+    }
+    return up;
+}
+
+// Builds the rest of the tree on top of n nodes of the same height and
+// makes it the buffer's tree. Takes over level.
+void rowTreeRaise(rowNode **level, int n) {
+    if (n == 0) {
+        level[0] = rowNodeNew(1);
+        n = 1;
+    }
+    while (n > 1) {
+        n = rowTreeParents(level, n);
+        STAT_ADD(nodes, n);
+    }
+    // The bottom levels may have been built from very few rows.
+    rowNode *root = level[0];
+    while (!root->leaf && root->n == 1) {
+        rowNode *old = root;
+        root = old->u.child[0];
+        STAT_ADD(nodes, -1);
+        free(old);
+    }
+
+    rowNodeRelease(E.rows);
+    E.rows = root;
+    free(level);
+}
+
+void rowTreeBuild(erow **rows, int numrows) {
+    rowNode **level = malloc(sizeof(rowNode *) * (numrows / ROWTREE_BUILD_FILL + 1));
+    int n = rowTreeLeaves(rows, numrows, level);
+    STAT_ADD(nodes, n);
+    rowTreeRaise(level, n);
+}
+
+// Positions the iterator so that the next call to rowIterNext() returns
+// the row at line "at" of the tree under root, which holds numrows rows.
+void rowIterSeekIn(rowIter *it, rowNode *root, int numrows, int at) {
+    it->depth = 0;
+    if (root == NULL || at < 0 || at >= numrows) {
+        it->path[0] = NULL;
+        return;
+    }
+    rowNode *node = root;
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->count[i]) {
+            at -= node->count[i];
+            i++;
+        }
+        it->path[it->depth] = node;
+        it->idx[it->depth] = i;
+        it->depth++;
+        node = node->u.child[i];
+    }
+    it->path[it->depth] = node;
+    it->idx[it->depth] = at;
+}
+
+void rowIterSeek(rowIter *it, int at) {
+    it->at = at;
+    if (E.view.on) return;
+    rowIterSeekIn(it, E.rows, E.numrows, at);
+}
+
+erow *rowIterNext(rowIter *it) {
+    if (E.view.on) return viewRowAt(it->at++);
+    rowNode *leaf = it->path[it->depth];
+    if (leaf == NULL) return NULL;
+
+    it->wraps = leaf->wraps[it->idx[it->depth]];
+    erow *row = leaf->u.row[it->idx[it->depth]++];
+    if (it->idx[it->depth] < leaf->n) return row;
+
+    // The leaf is used up, so climb until there is a next sibling and
+    // then walk back down its leftmost edge.
+    int d = it->depth - 1;
+    while (d >= 0 && it->idx[d] + 1 >= it->path[d]->n) d--;
+    if (d < 0) {
+        it->path[it->depth] = NULL;
+        return row;
+    }
+    it->idx[d]++;
+    for (; d < it->depth; d++) {
+        it->path[d + 1] = it->path[d]->u.child[it->idx[d]];
+        it->idx[d + 1] = 0;
+    }
+    return row;
+}
+
+/*---------- UTF-8 ----------*/
+// Column widths follow what terminals do: East Asian wide and fullwidth
+// characters and most emoji take two columns, combining marks and other
+// zero width characters none. Control characters and bytes that aren't
+// valid UTF-8 are shown as '?' in one column.
+
+typedef struct utf8Range {
+    int from;
+    int to;
+} utf8Range;
+
+utf8Range utf8ZeroWidth[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+    {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711}, {0x0730, 0x074a},
+    {0x07a6, 0x07b0}, {0x0900, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c},
+    {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0962, 0x0963},
+    {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064},
+    {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff},
+    {0x1f3fb, 0x1f3ff}, {0xe0000, 0xe007f}, {0xe0100, 0xe01ef},
+};
+
+utf8Range utf8Wide[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+    {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+    {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19},
+    {0xfe30, 0xfe6f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4},
+    {0x17000, 0x18aff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f202}, {0x1f210, 0x1f23b},
+    {0x1f240, 0x1f248}, {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f3fa},
+    {0x1f400, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f9ff},
+    {0x1fa70, 0x1faff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+int utf8InRanges(utf8Range *r, int n, int cp) {
+    int lo = 0;
+    int hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < r[mid].from) hi = mid - 1;
+        else if (cp > r[mid].to) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
+}
+
+// Decodes the character at the start of s. Returns its length in bytes
+// and stores the code point in *cp, or -1 for a byte that doesn't start a
+// valid sequence. Such a byte is a character of its own.
+int utf8Decode(const char *s, int len, int *cp) {
+    unsigned char c = s[0];
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+
+    int n, min, v;
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+        min = 0x80;
+        v = c & 0x1f;
+    }
+    else if ((c & 0xf0) == 0xe0) {
+        n = 3;
+        min = 0x800;
+        v = c & 0x0f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        min = 0x10000;
+        v = c & 0x07;
+    }
+    else {
+        *cp = -1;
+        return 1;
+    }
+
+    int i;
+    for (i = 1; i < n; i++) {
+        if (i >= len || ((unsigned char) s[i] & 0xc0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        v = v << 6 | ((unsigned char) s[i] & 0x3f);
+    }
+    // Overlong forms and UTF-16 surrogates aren't valid either.
+    if (v < min || v > 0x10ffff || (v >= 0xd800 && v <= 0xdfff)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = v;
+    return n;
+}
+
+// Characters that are shown as '?'.
+int utf8IsControl(int cp) {
+    return cp < 0x20 || (cp >= 0x7f && cp < 0xa0);
+}
+
+int utf8Width(int cp) {
+    if (cp < 0x300 || utf8IsControl(cp)) return 1;
+    if (utf8InRanges(utf8ZeroWidth, sizeof(utf8ZeroWidth) / sizeof(utf8ZeroWidth[0]), cp)) return 0;
+    if (cp >= 0x1100 && utf8InRanges(utf8Wide, sizeof(utf8Wide) / sizeof(utf8Wide[0]), cp)) return 2;
+    return 1;
+}
+
+// Measures the character at the start of s, given that it starts at
+// column rx. Returns its length in bytes and stores its width in *w.
+int utf8Step(const char *s, int len, int rx, int *w) {
+    if (s[0] == '\t') {
+        *w = YIM_TAB_STOP - rx % YIM_TAB_STOP;
+        return 1;
+    }
+    int cp;
+    int n = utf8Decode(s, len, &cp);
+    *w = utf8Width(cp);
+    return n;
+}
+
+// Returns 1 if s is all printable ASCII, so that every byte is one column
+// and the mapping between the two can be skipped. Most rows are like
+// that, so this looks at 16 (or 8) bytes at a time.
+int utf8IsPlain(const char *s, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i space = _mm_set1_epi8(0x20);
+    __m128i del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) &s[i]);
+        // The compare is signed, so bytes from 0x80 up are below 0x20 too.
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+        if (_mm_movemask_epi8(bad)) return 0;
+    }
+#else
+    uint64_t ones = 0x0101010101010101ULL;
+    uint64_t high = 0x8080808080808080ULL;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, &s[i], 8);
+        // Flags a byte with the top bit set, below 0x20 or equal to 0x7f.
+        uint64_t below = (v - ones * 0x20) & ~v;
+        uint64_t d = v ^ (ones * 0x7f);
+        if ((v | below | ((d - ones) & ~d)) & high) return 0;
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = s[i];
+        if (c < 0x20 || c >= 0x7f) return 0;
+    }
+    return 1;
+}
+
+/*---------- Syntax Highlighting ----------*/
+// Each row remembers the lexer state it ends in, so a line can be lexed
+// on its own given the state of the line above. Only rows that are drawn
+// keep a highlight per byte. Rows above the screen are lexed just far
+// enough to know the state the first visible row starts in.
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "const", "volatile", "extern", "inline", "register",
+    "restrict",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", "bool|", NULL
+};
+
+char *JSON_HL_extensions[] = {".json", NULL};
+char *JSON_HL_keywords[] = {"true", "false", "null", NULL};
+
+char *LOG_HL_extensions[] = {".log", NULL};
+char *LOG_HL_keywords[] = {
+    "FATAL", "ERROR", "WARN", "WARNING", "fatal", "error", "warn", "warning",
+    "INFO|", "DEBUG|", "TRACE|", "NOTICE|", "info|", "debug|", "trace|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", "\"'",
+        SYN_NUMBERS | SYN_PREPROC},
+    {"json", JSON_HL_extensions, JSON_HL_keywords, NULL, NULL, NULL, "\"",
+        SYN_NUMBERS | SYN_KEYS},
+    {"log", LOG_HL_extensions, LOG_HL_keywords, NULL, NULL, NULL, "\"",
+        SYN_NUMBERS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+int syntaxIsSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:!&|^?", c) != NULL;
+}
+
+void syntaxPaint(unsigned char *hl, int from, int to, int c) {
+    if (hl && from < to) memset(&hl[from], c, to - from);
+}
+
+int syntaxKeyword(struct editorSyntax *syn, const char *s, int len) {
+    char **kw;
+    if (syn->keywords == NULL) return HL_NORMAL;
+    for (kw = syn->keywords; *kw; kw++) {
+        if ((*kw)[0] != s[0]) continue;
+        int klen = strlen(*kw);
+        int kw2 = (*kw)[klen - 1] == '|';
+        if (kw2) klen--;
+        if (klen == len && memcmp(*kw, s, len) == 0) return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+    return HL_NORMAL;
+}
+
+// Lexes one line that starts in the given state and returns the state it
+// ends in. The highlight of every byte is written to hl, unless hl is
+// NULL because only the state is wanted.
+int syntaxLex(struct editorSyntax *syn, const char *s, int len, int state, unsigned char *hl) {
+    char *scs = syn->singleline_comment_start;
+    char *mcs = syn->multiline_comment_start;
+    char *mce = syn->multiline_comment_end;
+    int scslen = scs ? strlen(scs) : 0;
+    int mcslen = mcs ? strlen(mcs) : 0;
+    int mcelen = mce ? strlen(mce) : 0;
+
+    // When only the state it ends in is wanted, a line that starts outside
+    // of everything can only end inside something if it opens a block
+    // comment or ends in a backslash. Most don't, and aren't looked at.
+    if (hl == NULL && state == SYN_NORMAL && (len == 0 || s[len - 1] != '\\') &&
+            (mcslen == 0 || memmem(s, len, mcs, mcslen) == NULL))
+        return SYN_NORMAL;
+
+    int comment = state == SYN_COMMENT;
+    int quote = (state & 0xff) == SYN_STRING ? state >> 8 : 0;
+    int directive = state == SYN_DIRECTIVE;
+    int strstart = 0;
+    int escaped = 0; // The line ends in a backslash inside a string.
+    int prevsep = 1;
+    int lead = 0;
+    while (lead < len && isspace((unsigned char) s[lead])) lead++;
+
+    syntaxPaint(hl, 0, len, directive ? HL_PREPROC : HL_NORMAL);
+    int i = 0;
+    while (i < len) {
+        unsigned char c = s[i];
+
+        if (comment) {
+            if (mcelen && len - i >= mcelen && memcmp(&s[i], mce, mcelen) == 0) {
+                syntaxPaint(hl, i, i + mcelen, HL_COMMENT);
+                i += mcelen;
+                comment = 0;
+                prevsep = 1;
+            }
+            else {
+                syntaxPaint(hl, i, i + 1, HL_COMMENT);
+                i++;
+            }
+            continue;
+        }
+
+        if (quote) {
+            if (c == '\\') {
+                escaped = i + 1 == len;
+                syntaxPaint(hl, i, escaped ? len : i + 2, HL_STRING);
+                i += 2;
+                continue;
+            }
+            syntaxPaint(hl, i, i + 1, HL_STRING);
+            i++;
+            if (c == quote) {
+                quote = 0;
+                prevsep = 1;
+                if (syn->flags & SYN_KEYS) {
+                    int j = i;
+                    while (j < len && isspace((unsigned char) s[j])) j++;
+                    if (j < len && s[j] == ':') syntaxPaint(hl, strstart, i, HL_KEYWORD2);
+                }
+            }
+            continue;
+        }
+
+        if (scslen && len - i >= scslen && memcmp(&s[i], scs, scslen) == 0) {
+            syntaxPaint(hl, i, len, HL_COMMENT);
+            break;
+        }
+        if (mcslen && len - i >= mcslen && memcmp(&s[i], mcs, mcslen) == 0) {
+            syntaxPaint(hl, i, i + mcslen, HL_COMMENT);
+            i += mcslen;
+            comment = 1;
+            continue;
+        }
+        if (c && syn->quotes && strchr(syn->quotes, c)) {
+            quote = c;
+            strstart = i;
+            syntaxPaint(hl, i, i + 1, HL_STRING);
+            i++;
+            continue;
+        }
+
+        // The rest of a directive is all one color, apart from the strings
+        // and comments in it.
+        if (directive) {
+            syntaxPaint(hl, i, i + 1, HL_PREPROC);
+            i++;
+            continue;
+        }
+        if (c == '#' && i == lead && (syn->flags & SYN_PREPROC)) {
+            directive = 1;
+            syntaxPaint(hl, i, i + 1, HL_PREPROC);
+            i++;
+            continue;
+        }
+
+        if ((syn->flags & SYN_NUMBERS) && prevsep &&
+                (isdigit(c) || (c == '.' && i + 1 < len && isdigit((unsigned char) s[i + 1])))) {
+            int j = i + 1;
+            while (j < len && (isalnum((unsigned char) s[j]) || s[j] == '.' || s[j] == '_')) j++;
+            syntaxPaint(hl, i, j, HL_NUMBER);
+            i = j;
+            prevsep = 0;
+            continue;
+        }
+
+        if (isalpha(c) || c == '_') {
+            int j = i + 1;
+            while (j < len && (isalnum((unsigned char) s[j]) || s[j] == '_')) j++;
+            // Looking up keywords is only worth it if the result is kept.
+            if (hl && prevsep) syntaxPaint(hl, i, j, syntaxKeyword(syn, &s[i], j - i));
+            i = j;
+            prevsep = 0;
+            continue;
+        }
+
+        prevsep = syntaxIsSeparator(c);
+        i++;
+    }
+
+    if (comment) return SYN_COMMENT;
+    if (quote && escaped) return SYN_STRING | quote << 8;
+    if (directive && len && s[len - 1] == '\\') return SYN_DIRECTIVE;
+    return SYN_NORMAL;
+}
+
+// Called when row "at" changes, or rows are inserted or deleted there.
+void editorSyntaxInvalidate(int at) {
+    if (at < E.hlclean) E.hlclean = at;
+}
+
+// Rows keep their states in a byte each: the quote of a string with the
+// top bit set, or else the state itself.
+unsigned char syntaxPack(int state) {
+    return (state & 0xff) == SYN_STRING ? 0x80 | state >> 8 : state;
+}
+
+int syntaxUnpack(unsigned char packed) {
+    return packed & 0x80 ? SYN_STRING | (packed & 0x7f) << 8 : packed;
+}
+
+// Brings a row up to date for the state it starts in and returns the state
+// it ends in. With wanthl the highlight of each byte is kept too; rows
+// that are never drawn don't get one, to save the memory. A row that has
+// one keeps it up to date in room sized like its text's (see rowHlRoom()),
+// so lexing the row being typed into again doesn't allocate. A row whose
+// text and start state are the same as when it was last lexed isn't lexed
+// again. That is what keeps
+// an edit cheap: the new states only spread down until they match the old
+// ones again.
+int editorSyntaxRow(erow *row, int start, int wanthl) {
+    // Long rows are left unhighlighted, and whatever they end in isn't
+    // carried on, so editing one never re-lexes megabytes.
+    if (row->size >= YIM_LONG_ROW) {
+        free(row->hl);
+        row->hl = NULL;
+        return row->hlend = SYN_NORMAL;
+    }
+    if (row->hlgen == row->gen && row->hlstart == syntaxPack(start) && (row->hl || !wanthl))
+        return syntaxUnpack(row->hlend);
+    if (wanthl && row->hl == NULL && (row->hl = malloc(rowHlRoom(row))) == NULL)
+        die("malloc");
+    int end = syntaxLex(E.syntax, row->chars, row->size, start, row->hl);
+    row->hlstart = syntaxPack(start);
+    row->hlend = syntaxPack(end);
+    row->hlgen = row->gen;
+    return end;
+}
+
+// Returns the state row "at" starts in, lexing the rows above it that
+// are out of date.
+int editorSyntaxStateAt(int at) {
+    if (at == 0) return SYN_NORMAL;
+    if (E.hlclean >= at) return syntaxUnpack(editorRowAt(at - 1)->hlend);
+
+    int state = E.hlclean ? syntaxUnpack(editorRowAt(E.hlclean - 1)->hlend) : SYN_NORMAL;
+    rowIter it;
+    rowIterSeek(&it, E.hlclean);
+    int y;
+    for (y = E.hlclean; y < at; y++) state = editorSyntaxRow(rowIterNext(&it), state, 0);
+    E.hlclean = at;
+    return state;
+}
+
+// Picks the syntax by the file name. Rows are lexed lazily when they are
+// drawn, so nothing is done here beyond resetting the state. The syntax is
+// only ever picked for a buffer that wasn't highlighted before, so no row
+// carries a state from another syntax.
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    E.hlclean = 0;
+    E.hlgen++;
+    if (E.filename == NULL) return;
+
+    char *ext = strrchr(E.filename, '.');
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        int i;
+        for (i = 0; s->filematch[i]; i++) {
+            int is_ext = s->filematch[i][0] == '.';
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                    (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                return;
+            }
+        }
+    }
+}
+
+/*---------- Row Operations ----------*/
+
+// The byte at position at of a row, looking past the gap if it has one.
+char editorRowByte(erow *row, int at) {
+    return row->chars[at < row->gap ? at : at + row->gaplen];
+}
+
+// Returns the bytes of a row from position at on and sets *len to how many
+// can be read there. Where a character may straddle the gap, up to 4 bytes
+// are copied into buf instead, which is enough to decode one.
+const char *editorRowPeek(erow *row, int at, char *buf, int *len) {
+    if (at >= row->gap) {
+        *len = row->size - at;
+        return &row->chars[at + row->gaplen];
+    }
+    if (row->gaplen == 0 || at + 4 <= row->gap) {
+        *len = (row->gaplen ? row->gap : row->size) - at;
+        return &row->chars[at];
+    }
+    int n;
+    for (n = 0; n < 4 && at + n < row->size; n++) buf[n] = editorRowByte(row, at + n);
+    *len = n;
+    return buf;
+}
+
+// utf8Step() and utf8Decode() on the character at position at of a row.
+int editorRowStep(erow *row, int at, int rx, int *w) {
+    char buf[4];
+    int len;
+    const char *s = editorRowPeek(row, at, buf, &len);
+    return utf8Step(s, len, rx, w);
+}
+
+int editorRowDecode(erow *row, int at, int *cp) {
+    char buf[4];
+    int len;
+    const char *s = editorRowPeek(row, at, buf, &len);
+    return utf8Decode(s, len, cp);
+}
+
+// Moves the gap of a row to position at.
+void editorRowGapMove(erow *row, int at) {
+    if (at < row->gap)
+        memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+    else if (at > row->gap)
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+    row->gap = at;
+}
+
+// Makes the gap at least need bytes long. It grows by YIM_LONG_ROW more
+// than that, so a run of typing reallocates once in a while rather than on
+// every key.
+void editorRowGapGrow(erow *row, int need) {
+    if (row->gaplen >= need) return;
+    int grow = need - row->gaplen + YIM_LONG_ROW;
+    int tail = row->size - row->gap;
+    editorRowResize(row, row->size + row->gaplen + grow + 1, row->size + row->gaplen + 1);
+    memmove(&row->chars[row->gap + row->gaplen + grow],
+            &row->chars[row->gap + row->gaplen], tail + 1);
+    row->gaplen += grow;
+}
+
+// Turns the gap row back into a plain string. Anything that reads chars
+// directly has to call this first; the editing keys and drawing don't.
+void editorGapClose() {
+    erow *row = E.gaprow;
+    if (row == NULL) return;
+    E.gaprow = NULL;
+    editorRowGapMove(row, row->size);
+    editorRowResize(row, row->size + 1, row->size);
+    row->chars[row->size] = '\0';
+    row->gap = 0;
+    row->gaplen = 0;
+}
+
+int editorRowIsPlain(erow *row) {
+    if (row->plain == -1) {
+        int head = row->gaplen ? row->gap : row->size;
+        row->plain = utf8IsPlain(row->chars, head) &&
+            utf8IsPlain(&row->chars[head + row->gaplen], row->size - head);
+    }
+    return row->plain;
+}
+
+// Adds the next checkpoint to a row's column map. Checkpoint k sits at
+// the first character boundary at or after k * YIM_COLMAP_STEP. Returns
+// 0 once the map covers the whole row.
+int editorRowColmapGrow(erow *row) {
+    if (row->ncolmap == row->colmapcap) {
+        row->colmapcap = row->colmapcap ? row->colmapcap * 2 : 4;
+        row->colmap = realloc(row->colmap, sizeof(int) * 2 * row->colmapcap);
+        if (row->colmap == NULL) die("realloc");
+    }
+    int k = row->ncolmap;
+    if (k == 0) {
+        row->colmap[0] = 0;
+        row->colmap[1] = 0;
+        row->ncolmap = 1;
+        return 1;
+    }
+    int stop = k * YIM_COLMAP_STEP;
+    if (stop > row->size) return 0;
+    int cx = row->colmap[2 * (k - 1)];
+    int rx = row->colmap[2 * (k - 1) + 1];
+    while (cx < stop) {
+        int w;
+        cx += editorRowStep(row, cx, rx, &w);
+        rx += w;
+    }
+    row->colmap[2 * k] = cx;
+    row->colmap[2 * k + 1] = rx;
+    row->ncolmap++;
+    return 1;
+}
+
+// Returns the last checkpoint at or before cx, filling in the map that
+// far if needed.
+int editorRowColmap(erow *row, int cx) {
+    int k = cx / YIM_COLMAP_STEP;
+    while (row->ncolmap <= k && editorRowColmapGrow(row));
+    if (k >= row->ncolmap) k = row->ncolmap - 1;
+    if (row->colmap[2 * k] > cx) k--;
+    return k;
+}
+
+// Maps a byte index to a screen column. Plain rows map to themselves,
+// anything else starts from the nearest checkpoint, so this costs at most
+// YIM_COLMAP_STEP bytes of scanning however long the row is.
+int editorRowCxToRx(erow *row, int cx) {
+    if (editorRowIsPlain(row)) return cx;
+    int k = editorRowColmap(row, cx);
+    int at = row->colmap[2 * k];
+    int rx = row->colmap[2 * k + 1];
+    while (at < cx) {
+        int w;
+        at += editorRowStep(row, at, rx, &w);
+        rx += w;
+    }
+    return rx;
+}
+
+// The other way around: returns the start of the character that covers
+// screen column rx, or the end of the row if it is shorter, and stores
+// the column that character starts at in *startrx.
+int editorRowRxToCx(erow *row, int rx, int *startrx) {
+    if (editorRowIsPlain(row)) {
+        int cx = rx < row->size ? rx : row->size;
+        *startrx = cx;
+        return cx;
+    }
+    if (row->ncolmap == 0) editorRowColmapGrow(row);
+    while (row->colmap[2 * (row->ncolmap - 1) + 1] <= rx && editorRowColmapGrow(row));
+
+    int lo = 0;
+    int hi = row->ncolmap - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->colmap[2 * mid + 1] <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    int cx = row->colmap[2 * lo];
+    int r = row->colmap[2 * lo + 1];
+    while (cx < row->size) {
+        int w;
+        int n = editorRowStep(row, cx, r, &w);
+        if (r + w > rx) break;
+        cx += n;
+        r += w;
+    }
+    *startrx = r;
+    return cx;
+}
+
+int editorRowIsZeroWidth(erow *row, int cx) {
+    int cp;
+    editorRowDecode(row, cx, &cp);
+    return cp > 0 && utf8Width(cp) == 0;
+}
+
+// Returns the start of the character before cx.
+int editorRowPrevChar(erow *row, int cx) {
+    int p = cx - 1;
+    while (p > 0 && p > cx - 4 && ((unsigned char) editorRowByte(row, p) & 0xc0) == 0x80) p--;
+    int cp;
+    if (editorRowDecode(row, p, &cp) == cx - p) return p;
+    return cx - 1;
+}
+
+// The cursor moves by graphemes: a character together with the combining
+// marks that follow it.
+int editorRowNextGrapheme(erow *row, int cx) {
+    int cp;
+    cx += editorRowDecode(row, cx, &cp);
+    while (cx < row->size && editorRowIsZeroWidth(row, cx))
+        cx += editorRowDecode(row, cx, &cp);
+    return cx;
+}
+
+int editorRowPrevGrapheme(erow *row, int cx) {
+    cx = editorRowPrevChar(row, cx);
+    while (cx > 0 && editorRowIsZeroWidth(row, cx)) cx = editorRowPrevChar(row, cx);
+    return cx;
+}
+
+// The number of screen lines a row takes when long lines are wrapped at
+// the edge of the screen. A row that exactly fills its last line gets an
+// empty one after it for the cursor to sit in at the end. Rows are only
+// given a column map if they have one already, so turning wrapping on
+// for a big file doesn't build one for every line.
+int editorRowWraps(erow *row) {
+    int width;
+    if (editorRowIsPlain(row)) {
+        width = row->size;
+    } else if (row->ncolmap) {
+        width = editorRowCxToRx(row, row->size);
+    } else {
+        int cx = 0;
+        width = 0;
+        while (cx < row->size) {
+            int w;
+            cx += editorRowStep(row, cx, width, &w);
+            width += w;
+        }
+    }
+    return width / E.screencols + 1;
+}
+
+// Called whenever a row's chars change.
+void editorUpdateRow(erow *row) {
+    STAT_ADD(rowupdates, 1);
+    row->gen = ++E.gen;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+
+    erow *row = editorRowNew(s, len);
+    rowTreeInsert(at, row);
+    editorSyntaxInvalidate(at);
+    E.numrows++;
+    E.dirty++;
+    undoRecord(UNDO_INSROW, at, 0, NULL, 0, s, len);
+}
+
+void editorFreeRow(erow *row) {
+    if (row == E.gaprow) E.gaprow = NULL;
+    rowTextFree(row->chars, row->cap);
+    free(row->colmap);
+    free(row->hl);
+    if (row->loadgen) memLoadRelease(row->loadgen);
+    else rowFree(row);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    erow *row = editorRowAt(at);
+    if (row == E.gaprow) editorGapClose();
+    undoRecord(UNDO_DELROW, at, 0, row->chars, row->size, NULL, 0);
+    editorRowRelease(rowTreeRemove(at));
+    editorSyntaxInvalidate(at);
+    E.numrows--;
+    E.dirty++;
+}
+
+// Replaces del bytes at position "at" of row y with s. Every change to
+// the text of a row goes through here, which is where it gets logged for
+// undo. The functions below are the shapes of it the editor uses.
+// A long row is edited through a gap kept at the last edit, so typing
+// into it only moves the bytes between one edit and the next instead of
+// the whole rest of the row.
+void editorRowSplice(int y, int at, int del, const char *s, size_t len) {
+    if (del == 0 && len == 0) return;
+    erow *row = editorRowAtMut(y);
+    // Text in the load buffer is copied out before it's changed.
+    if (row->cap == 0) editorRowResize(row, row->size + len + 1, row->size + 1);
+    if (row->size >= YIM_LONG_ROW && row != E.gaprow) {
+        editorGapClose();
+        E.gaprow = row;
+        row->gap = row->size;
+    }
+    if (row == E.gaprow) {
+        editorRowGapMove(row, at);
+        undoRecord(UNDO_TEXT, y, at, &row->chars[at + row->gaplen], del, s, len);
+        row->gaplen += del;
+        row->size -= del;
+        editorRowGapGrow(row, len);
+        if (len) memcpy(&row->chars[at], s, len);
+        row->gap += len;
+        row->gaplen -= len;
+        row->size += len;
+    } else {
+        undoRecord(UNDO_TEXT, y, at, &row->chars[at], del, s, len);
+        // Rows grow by half again (or to the next size class) so typing
+        // doesn't copy the row on every key.
+        int need = row->size + len - del + 1;
+        if (need > row->cap)
+            editorRowResize(row, need > YIM_TEXT_SLAB_MAX ? need + need / 2 : need, row->size + 1);
+        memmove(&row->chars[at + len], &row->chars[at + del], row->size - at - del + 1);
+        if (len) memcpy(&row->chars[at], s, len);
+        row->size += len - del;
+    }
+    if (row == E.gaprow && row->size < YIM_LONG_ROW) editorGapClose();
+    if (row->plain == 1 && !utf8IsPlain(s, len)) row->plain = 0;
+    // A checkpoint only depends on the bytes before it, but the character
+    // that ends there may have been decoded by peeking up to 3 bytes ahead.
+    int lo = 0;
+    int hi = row->ncolmap;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (row->colmap[2 * mid] > at - 3) hi = mid;
+        else lo = mid + 1;
+    }
+    row->ncolmap = lo;
+    rowTreeAddBytes(y, (long long) len - del);
+    if (E.wrap) rowTreeUpdateWraps(y);
+    editorUpdateRow(row);
+    editorSyntaxInvalidate(y);
+    E.dirty++;
+}
+
+// This lets inserting a single character into an erow at a given position.
+void editorRowInsertChar(int y, int at, int c) {
+    erow *row = editorRowAt(y);
+    if (at < 0 || at > row->size) at = row->size;
+    char ch = c;
+    editorRowSplice(y, at, 0, &ch, 1);
+}
+
+void editorRowAppendString(int y, const char *s, size_t len) {
+    editorRowSplice(y, editorRowAt(y)->size, 0, s, len);
+}
+
+// Replaces the whole contents of a row, for edits that rewrite it in one go.
+void editorRowSetString(int y, const char *s, size_t len) {
+    editorRowSplice(y, 0, editorRowAt(y)->size, s, len);
+}
+
+// Cuts the row off at position "at".
+void editorRowTruncate(int y, int at) {
+    editorRowSplice(y, at, editorRowAt(y)->size - at, NULL, 0);
+}
+
+/*---------- Editor Operations ----------*/
+// This section will contain functions that we'll call from 
+// editorProcessKeypress() when mapping keypresses to text
+// editing operations.
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(E.cy, E.cx, c);
+    E.cx++;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+
+    if (E.cx > 0) {
+        int at = editorRowPrevGrapheme(editorRowAt(E.cy), E.cx);
+        editorRowSplice(E.cy, at, E.cx - at, NULL, 0);
+        E.cx = at;
+    }
+    else {
+        editorGapClose();
+        erow *row = editorRowAt(E.cy);
+        E.cx = editorRowAt(E.cy - 1)->size;
+        editorRowAppendString(E.cy - 1, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+void editorInsertNewline() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else {
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        editorRowTruncate(E.cy, E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+// Inserts a block of text at the cursor, splitting it into rows on
+// "\r\n", "\r" or "\n". Used for pastes, so a large block costs one row
+// insert per line instead of a full keypress cycle per character.
+void editorInsertText(const char *s, size_t len) {
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    // The rest of the current line is set aside and put back after the
+    // last pasted line.
+    erow *row = editorRowAt(E.cy);
+    size_t taillen = row->size - E.cx;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &row->chars[E.cx], taillen);
+    editorRowTruncate(E.cy, E.cx);
+
+    const char *p = s;
+    const char *end = s + len;
+    int first = 1;
+    while (1) {
+        const char *eol = p;
+        while (eol < end && *eol != '\r' && *eol != '\n') eol++;
+
+        if (first) {
+            editorRowAppendString(E.cy, p, eol - p);
+            first = 0;
+        }
+        else {
+            E.cy++;
+            editorInsertRow(E.cy, (char *) p, eol - p);
+        }
+        E.cx = editorRowAt(E.cy)->size;
+
+        if (eol == end) break;
+        p = (eol[0] == '\r' && eol + 1 < end && eol[1] == '\n') ? eol + 2 : eol + 1;
+    }
+
+    editorRowAppendString(E.cy, tail, taillen);
+    free(tail);
+}
+
+// Where the cursor is, as a byte offset into the file as it would be saved.
+long long editorCursorOffset() {
+    if (E.view.on) return E.cy < E.numrows ? viewFind(E.cy) + E.cx : E.view.size;
+    int eol = E.crlf ? 2 : 1;
+    long long off = rowTreeOffset(E.cy) + (long long) E.cy * eol;
+    if (E.cy < E.numrows) off += E.cx;
+    return off;
+}
+
+/*---------- Undo ----------*/
+// Every change to the rows is recorded in E.undo by editorRowSplice(),
+// editorInsertRow() and editorDelRow(). Records are appended to a single
+// arena, so the log costs one allocation however many edits it holds,
+// and a run of typed or deleted characters grows one record instead of
+// adding one per character.
+
+undoRec *undoAt(size_t off) {
+    return (undoRec *) (E.undo.buf + off);
+}
+
+char *undoText(undoRec *r) {
+    return (char *) (r + 1);
+}
+
+// Bytes taken by a record with this much text: the header, the text
+// padded to a multiple of 4 and the trailing copy of the size.
+int undoRecSize(int dellen, int inslen) {
+    return sizeof(undoRec) + ((dellen + inslen + 3) & ~3) + sizeof(int);
+}
+
+void undoSetSize(undoRec *r, int size) {
+    r->size = size;
+    memcpy((char *) r + size - sizeof(int), &size, sizeof(int));
+}
+
+void undoReserve(size_t extra) {
+    struct undoLog *u = &E.undo;
+    if (u->len + extra <= u->cap) return;
+    while (u->len + extra > u->cap) u->cap = u->cap ? u->cap * 2 : 4096;
+    u->buf = realloc(u->buf, u->cap);
+}
+
+// Drops the oldest steps once the log is over YIM_UNDO_BYTES, down to
+// three quarters of it so this doesn't happen on every edit. The step
+// being recorded is always kept, so even a paste larger than the budget
+// can be undone.
+void undoTrim() {
+    struct undoLog *u = &E.undo;
+    if (u->len <= YIM_UNDO_BYTES) return;
+    size_t goal = u->len - YIM_UNDO_BYTES / 4 * 3;
+    size_t off = 0;
+    size_t cut = 0;
+    while (off < u->step && cut < goal) {
+        off += undoAt(off)->size;
+        if (undoAt(off)->first) cut = off;
+    }
+    if (cut == 0) return;
+
+    memmove(u->buf, u->buf + cut, u->len - cut);
+    u->len -= cut;
+    u->cur -= cut;
+    u->step -= cut;
+    u->last -= cut;
+    if (u->saved != -1) u->saved = u->saved >= (long long) cut ? u->saved - (long long) cut : -1;
+}
+
+// Tries to add one typed or deleted character to the last record.
+int undoCoalesce(int type, int row, int col, const char *del, int dellen, const char *ins, int inslen) {
+    struct undoLog *u = &E.undo;
+    if (!u->coalesce || !u->typing || u->open || type != UNDO_TEXT || dellen + inslen != 1 || u->cur != u->len) return 0;
+    undoRec *r = undoAt(u->last);
+    if (!r->first || r->type != UNDO_TEXT || r->row != row) return 0;
+
+    int front = 0;
+    char c;
+    if (u->typing == 1 && inslen == 1 && r->dellen == 0 && col == r->col + r->inslen) {
+        c = ins[0];
+    }
+    else if (u->typing == 2 && dellen == 1 && r->inslen == 0 && (col == r->col || col == r->col - 1)) {
+        c = del[0];
+        front = col == r->col - 1; // Backspace.
+    }
+    else {
+        return 0;
+    }
+
+    int size = undoRecSize(r->dellen + r->inslen + 1, 0);
+    undoReserve(size - r->size);
+    r = undoAt(u->last);
+    char *text = undoText(r);
+    int n = r->dellen + r->inslen;
+    if (front) {
+        memmove(text + 1, text, n);
+        text[0] = c;
+        r->col--;
+    }
+    else {
+        text[n] = c;
+    }
+    if (inslen) r->inslen++;
+    else r->dellen++;
+    undoSetSize(r, size);
+    u->len = u->cur = u->last + size;
+
+    // The step this record started is carried on by the current key.
+    u->step = u->last;
+    u->open = 1;
+    return 1;
+}
+
+void undoRecord(int type, int row, int col, const char *del, int dellen, const char *ins, int inslen) {
+    struct undoLog *u = &E.undo;
+    if (u->applying) return;
+    // Anything that was undone can't be redone after a new change.
+    if (u->len > u->cur) {
+        u->len = u->cur;
+        if (u->saved > (long long) u->cur) u->saved = -1;
+    }
+
+    int single = type == UNDO_TEXT && dellen + inslen == 1;
+    if (undoCoalesce(type, row, col, del, dellen, ins, inslen)) return;
+    u->coalesce = single;
+
+    int size = undoRecSize(dellen, inslen);
+    undoReserve(size);
+    undoRec *r = undoAt(u->len);
+    r->type = type;
+    r->first = !u->open;
+    r->row = row;
+    r->col = col;
+    r->dellen = dellen;
+    r->inslen = inslen;
+    r->cx = u->keycx;
+    r->cy = u->keycy;
+    r->aftercx = r->aftercy = 0;
+    if (dellen) memcpy(undoText(r), del, dellen);
+    if (inslen) memcpy(undoText(r) + dellen, ins, inslen);
+    undoSetSize(r, size);
+
+    if (r->first) {
+        u->step = u->len;
+        u->open = 1;
+    }
+    u->last = u->len;
+    u->len = u->cur = u->len + size;
+    undoTrim();
+}
+
+// Called before and after each key is handled, so each key's changes
+// form one step.
+void undoBeginKey(int c) {
+    struct undoLog *u = &E.undo;
+    u->open = 0;
+    u->keycx = E.cx;
+    u->keycy = E.cy;
+    // Only typing and deleting single characters make a run.
+    if (c == BACKSPACE || c == DEL_KEY || c == CTRL_KEY('h')) u->typing = 2;
+    else u->typing = c == '\t' || (c >= ' ' && c < 256 && c != BACKSPACE);
+    if (!u->typing) u->coalesce = 0;
+}
+
+void undoEndKey() {
+    struct undoLog *u = &E.undo;
+    if (!u->open) return;
+    undoRec *r = undoAt(u->step);
+    r->aftercx = E.cx;
+    r->aftercy = E.cy;
+}
+
+void undoMarkSaved() {
+    E.undo.saved = E.undo.cur;
+    E.undo.coalesce = 0;
+}
+
+void undoApply(undoRec *r, int redo) {
+    char *text = undoText(r);
+    switch (r->type) {
+        case UNDO_TEXT:
+            if (redo) editorRowSplice(r->row, r->col, r->dellen, text + r->dellen, r->inslen);
+            else editorRowSplice(r->row, r->col, r->inslen, text, r->dellen);
+            break;
+        case UNDO_INSROW:
+            if (redo) editorInsertRow(r->row, text, r->inslen);
+            else editorDelRow(r->row);
+            break;
+        case UNDO_DELROW:
+            if (redo) editorDelRow(r->row);
+            else editorInsertRow(r->row, text, r->dellen);
+            break;
+    }
+}
+
+void undoFinish(int cx, int cy) {
+    struct undoLog *u = &E.undo;
+    u->applying = 0;
+    u->coalesce = 0;
+    E.cy = cy <= E.numrows ? cy : E.numrows;
+    erow *row = editorRowAt(E.cy);
+    int size = row ? row->size : 0;
+    E.cx = cx <= size ? cx : size;
+    // Back where the file was saved.
+    if ((long long) u->cur == u->saved) E.dirty = 0;
+}
+
+void editorUndo() {
+    struct undoLog *u = &E.undo;
+    if (u->cur == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    u->applying = 1;
+    undoRec *r;
+    do {
+        int size;
+        memcpy(&size, u->buf + u->cur - sizeof(int), sizeof(int));
+        u->cur -= size;
+        r = undoAt(u->cur);
+        undoApply(r, 0);
+    } while (!r->first);
+    undoFinish(r->cx, r->cy);
+}
+
+void editorRedo() {
+    struct undoLog *u = &E.undo;
+    if (u->cur == u->len) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    u->applying = 1;
+    undoRec *first = undoAt(u->cur);
+    do {
+        undoRec *r = undoAt(u->cur);
+        undoApply(r, 1);
+        u->cur += r->size;
+    } while (u->cur < u->len && !undoAt(u->cur)->first);
+    undoFinish(first->aftercx, first->aftercy);
+}
+
+/*---------- File I/O ----------*/
+
+// Writes out all of the iovecs, retrying after short writes. The iovecs
+// are used up in the process. Returns 0 or -1 on error.
+int writevAll(int fd, struct iovec *iov, int niov) {
+    while (niov > 0) {
+        ssize_t n = writev(fd, iov, niov > IOV_MAX ? IOV_MAX : niov);
+        STAT_ADD(syscalls, 1);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        // Skip whatever was fully written and trim a partial iovec.
+        while (niov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+char *editorRowsToString(int *buflen) {
+    int totlen = 0;
+    rowIter it;
+    erow *row;
+    rowIterSeek(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL)
+        totlen += row->size + 1;
+    *buflen = totlen;
+
+    char *buf = malloc(totlen);
+    char *p = buf;
+    rowIterSeek(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        memcpy(p, row->chars, row->size);
+        p += row->size;
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+// Maps the whole file into memory, or reads it in when it can't be
+// mapped (pipes, character devices). Returns NULL and sets *len to 0
+// for an empty file.
+char *editorLoadFile(int fd, size_t *len, int *mapped) {
+    struct stat st;
+    *mapped = 0;
+    *len = 0;
+    if (fstat(fd, &st) == -1) die("fstat");
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) return NULL;
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            // The file is scanned front to back exactly once.
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            *mapped = 1;
+            *len = st.st_size;
+            return data;
+        }
+    }
+
+    size_t cap = 1 << 20;
+    char *data = malloc(cap);
+    ssize_t nread;
+    while ((nread = read(fd, &data[*len], cap - *len)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            die("read");
+        }
+        *len += nread;
+        if (*len == cap) {
+            cap *= 2;
+            data = realloc(data, cap);
+        }
+    }
+    return data;
+}
+
+// How many threads to load len bytes with.
+int loadThreads(size_t len) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    char *env = getenv("YIM_LOAD_THREADS");
+    if (env && atoi(env) > 0) n = atoi(env);
+    if (n > YIM_LOAD_THREADS_MAX) n = YIM_LOAD_THREADS_MAX;
+    if ((size_t) n > len / YIM_LOAD_CHUNK) n = len / YIM_LOAD_CHUNK;
+    return n < 1 ? 1 : n;
+}
+
+// The first pass over a chunk copies it into the row buffer and counts
+// its lines.
+void *loadCount(void *arg) {
+    loadChunk *c = arg;
+    if (c->len && c->src != c->data) memcpy(c->data, c->src, c->len);
+    char *p = c->data;
+    char *end = c->data + c->len;
+    char *nl;
+    c->numrows = 0;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        c->numrows++;
+        p = nl + 1;
+    }
+    if (p < end) c->numrows++;
+    return NULL;
+}
+
+// The second pass ends each line with a '\0' in place of its line break
+// and makes a row for it.
+void *loadRows(void *arg) {
+    loadChunk *c = arg;
+    char *p = c->data;
+    char *end = c->data + c->len;
+    int at = 0;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        char *eol = nl ? nl : end;
+        char *next = nl ? nl + 1 : end;
+        // In a CRLF file the one '\r' before a line break belongs to it,
+        // and a line that ends without one is marked so that it's saved
+        // the same way. Any other '\r' is text. E.crlf is decided before
+        // the threads start.
+        int lf = 0;
+        if (nl && E.crlf) {
+            if (eol > p && eol[-1] == '\r') eol--;
+            else lf = 1;
+        }
+        if (eol < end) *eol = '\0';
+
+        editorRowInit(&c->rows[at], p, eol - p, c->gen);
+        c->rows[at].loadgen = c->loadgen;
+        c->rows[at].lf = lf;
+        c->table[at] = &c->rows[at];
+        at++;
+
+        p = next;
+    }
+    // The two bottom levels of the row tree can be built here as well.
+    if (c->nodes) c->nnodes = rowTreeParents(c->nodes, rowTreeLeaves(c->table, c->numrows, c->nodes));
+    return NULL;
+}
+
+// Runs fn on every chunk, each on a thread of its own but the first, which
+// the calling thread takes.
+void loadRun(loadChunk *chunks, int n, void *(*fn)(void *)) {
+    pthread_t threads[YIM_LOAD_THREADS_MAX];
+    int started[YIM_LOAD_THREADS_MAX];
+    int j;
+    for (j = 1; j < n; j++)
+        started[j] = pthread_create(&threads[j], NULL, fn, &chunks[j]) == 0;
+    fn(&chunks[0]);
+    for (j = 1; j < n; j++) {
+        if (started[j]) pthread_join(threads[j], NULL);
+        else fn(&chunks[j]);
+    }
+}
+
+// For opening and reading a file from disk.
+// The file is pulled in with one mmap() (or a few large reads) and split
+// into chunks at line breaks. Threads copy the chunks, count their lines
+// and then make their rows side by side, and the row tree is built in one
+// go instead of growing by one row per line.
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+    E.compress = zipDetect(fd);
+    if (E.compress) {
+        zipOpen(fd, E.compress);
+        close(fd);
+        E.dirty = 0;
+        return;
+    }
+
+    size_t len;
+    int mapped;
+    char *loaded = editorLoadFile(fd, &len, &mapped);
+    close(fd);
+
+    // The rows keep pointing into one copy of the file, with each line
+    // ending turned into a '\0', until they are edited.
+    char *data = memLoadBlock(len + 1);
+    data[len] = '\0';
+
+    loadChunk chunks[YIM_LOAD_THREADS_MAX];
+    int nchunks = loadThreads(len);
+    size_t from = 0;
+    int j;
+    for (j = 0; j < nchunks; j++) {
+        // Each chunk ends at the first line break past its share.
+        size_t to = len;
+        if (j < nchunks - 1) {
+            size_t at = len * (j + 1) / nchunks;
+            if (at < from) at = from;
+            char *nl = memchr(&loaded[at], '\n', len - at);
+            if (nl) to = nl - loaded + 1;
+        }
+        chunks[j].src = &loaded[from];
+        chunks[j].data = &data[from];
+        chunks[j].len = to - from;
+        from = to;
+    }
+    loadRun(chunks, nchunks, loadCount);
+    if (mapped) munmap(loaded, len);
+    else free(loaded);
+
+    // Remember how lines were terminated so that saving writes them back
+    // the same way. The first line break decides between LF and CRLF.
+    char *firstnl = len ? memchr(data, '\n', len) : NULL;
+    E.crlf = firstnl && firstnl > data && firstnl[-1] == '\r';
+    E.noeol = len && data[len - 1] != '\n';
+
+    // Counting the lines first lets the rows and the row table be sized
+    // exactly. All the rows are one block.
+    int numrows = 0;
+    for (j = 0; j < nchunks; j++) numrows += chunks[j].numrows;
+    erow **rows = malloc(sizeof(erow *) * (numrows ? numrows : 1));
+    erow *block = memLoadBlock(sizeof(erow) * numrows);
+    unsigned int gen = ++E.gen;
+    int loadgen = memLoadRows(numrows);
+    int at = 0;
+    for (j = 0; j < nchunks; j++) {
+        chunks[j].rows = &block[at];
+        chunks[j].table = &rows[at];
+        chunks[j].gen = gen;
+        chunks[j].loadgen = loadgen;
+        chunks[j].nodes = E.numrows ? NULL :
+            malloc(sizeof(rowNode *) * (chunks[j].numrows / ROWTREE_BUILD_FILL + 1));
+        at += chunks[j].numrows;
+    }
+    loadRun(chunks, nchunks, loadRows);
+
+    if (E.numrows == 0) {
+        // Put what the chunks built side by side and build the tree up
+        // from there.
+        int n = 0;
+        for (j = 0; j < nchunks; j++) n += chunks[j].nnodes;
+        rowNode **level = malloc(sizeof(rowNode *) * (n + 1));
+        n = 0;
+        for (j = 0; j < nchunks; j++) {
+            memcpy(&level[n], chunks[j].nodes, sizeof(rowNode *) * chunks[j].nnodes);
+            n += chunks[j].nnodes;
+#ifdef YIM_STATS
+            int k;
+            for (k = 0; k < chunks[j].nnodes; k++) STAT_ADD(nodes, chunks[j].nodes[k]->n + 1);
+#endif
+            free(chunks[j].nodes);
+        }
+        rowTreeRaise(level, n);
+        E.numrows = numrows;
+    }
+    else {
+        for (at = 0; at < numrows; at++) {
+            rowTreeInsert(E.numrows, rows[at]);
+            E.numrows++;
+        }
+    }
+    free(rows);
+    // Following the file (-F) picks up from here.
+    E.follow.off = len;
+    // Loading the file is not a modification, so the buffer starts out clean.
+    E.dirty = 0;
+}
+
+// Streams the rows to fd, a batch of rows per writev() call, with the
+// line endings the file was loaded with. Returns the number of bytes
+// written or -1 on error.
+long long editorWriteRows(int fd) {
+    struct iovec iov[YIM_SAVE_IOV];
+    const char *eol = E.crlf ? "\r\n" : "\n";
+    int eollen = E.crlf ? 2 : 1;
+    long long total = 0;
+    int niov = 0;
+
+    rowIter it;
+    erow *row;
+    int at = 0;
+    rowIterSeek(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        if (row->size) {
+            iov[niov].iov_base = row->chars;
+            iov[niov].iov_len = row->size;
+            niov++;
+        }
+        // A file that didn't end in a newline is saved without one. A
+        // line marked lf gets the '\n' of the "\r\n".
+        if (!(E.noeol && at == E.numrows - 1)) {
+            iov[niov].iov_base = (char *) eol + row->lf;
+            iov[niov].iov_len = eollen - row->lf;
+            niov++;
+            total += eollen - row->lf;
+        }
+        total += row->size;
+        at++;
+
+        if (niov > YIM_SAVE_IOV - 2) {
+            if (writevAll(fd, iov, niov) == -1) return -1;
+            niov = 0;
+        }
+    }
+    if (niov && writevAll(fd, iov, niov) == -1) return -1;
+    return total;
+}
+
+void editorSave() {
+    // If the file name is not given.
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted!");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    // The rows are written to a temporary file next to the target, which
+    // is then renamed over it. A failed save leaves the original alone.
+    // Symlinks are followed so the link itself isn't replaced.
+    char *path = realpath(E.filename, NULL);
+    if (path == NULL) path = strdup(E.filename);
+    char *slash = strrchr(path, '/');
+    int dirlen = slash ? slash - path + 1 : 0;
+    char *tmp = malloc(strlen(path) + 16);
+    sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, path, slash ? slash + 1 : path);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long long len = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1) {
+        // Keep the original file's permissions. A new file gets 0644
+        // minus the umask, like open() with O_CREAT would give it.
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+            // This only works for root. Anyone else keeps owning the file.
+            fchown(fd, st.st_uid, st.st_gid);
+        }
+        else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0644 & ~mask);
+        }
+
+        len = E.compress ? zipWriteRows(fd, E.compress) : editorWriteRows(fd);
+        if (len != -1 && fsync(fd) == -1) len = -1;
+        if (close(fd) == -1) len = -1;
+        if (len != -1 && rename(tmp, path) == -1) len = -1;
+        if (len == -1) {
+            int saved = errno;
+            unlink(tmp);
+            errno = saved;
+        }
+    }
+
+    if (len != -1) {
+        // Make the rename itself durable.
+        char *dir = dirlen ? strndup(path, dirlen) : strdup(".");
+        int dirfd = open(dir, O_RDONLY);
+        if (dirfd != -1) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+        free(dir);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        E.dirty = 0;
+        undoMarkSaved();
+        swapRemove();
+        // The file is a new one now, holding just what was written.
+        if (E.follow.on) {
+            followStop();
+            E.follow.off = len;
+            followStart();
+        }
+        editorSetStatusMessage("%lld bytes written to disk%s%s (%.1f MB/s)", len,
+                E.compress ? " as " : "", zipName(E.compress),
+                secs > 0 ? len / secs / (1 << 20) : 0.0);
+    }
+    else {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    }
+    free(tmp);
+    free(path);
+}
+
+/*---------- Compressed Files ----------*/
+// gzip and zstd files are told apart from plain text by their first
+// bytes. They're opened by a thread that reads and decompresses them a
+// piece at a time and hands whole lines over to the main thread a block
+// at a time, so rows are made from one block while the next one is being
+// decompressed, and the compressed file is never in memory as a whole.
+// They're saved compressed the same way. zstd needs libzstd and is only
+// built in with "make ZSTD=1".
+
+#define ZIP_GZIP 1
+#define ZIP_ZSTD 2
+
+// Returns the format of the file open at fd, or 0 if it isn't compressed.
+int zipDetect(int fd) {
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return ZIP_GZIP;
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return ZIP_ZSTD;
+    return 0;
+}
+
+const char *zipName(int format) {
+    return format == ZIP_GZIP ? "gzip" : format == ZIP_ZSTD ? "zstd" : "";
+}
+
+// Sets z up to decompress, or with pack set to compress, format. Returns
+// 0 if that format isn't built in.
+int zipInit(zipStream *z, int format, int pack) {
+    memset(z, 0, sizeof(*z));
+    z->format = format;
+    if (format == ZIP_GZIP) {
+        // 16 more window bits ask zlib for a gzip header, not a zlib one.
+        if (pack)
+            return deflateInit2(&z->gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) == Z_OK;
+        return inflateInit2(&z->gz, 15 + 16) == Z_OK;
+    }
+#ifdef YIM_ZSTD
+    if (format == ZIP_ZSTD) {
+        if (pack) return (z->zc = ZSTD_createCStream()) != NULL;
+        return (z->zd = ZSTD_createDStream()) != NULL;
+    }
+#endif
+    return 0;
+}
+
+void zipEnd(zipStream *z, int pack) {
+    if (z->format == ZIP_GZIP) {
+        if (pack) deflateEnd(&z->gz);
+        else inflateEnd(&z->gz);
+    }
+#ifdef YIM_ZSTD
+    if (z->format == ZIP_ZSTD) {
+        ZSTD_freeCStream(z->zc);
+        ZSTD_freeDStream(z->zd);
+    }
+#endif
+}
+
+// Decompresses what it can of the *inlen bytes at *in into out, moving
+// *in on past what was used. Sets *produced to the bytes written to out.
+// Returns -1 if the data is bad.
+int zipInflate(zipStream *z, const char **in, size_t *inlen, char *out, size_t outlen, size_t *produced) {
+    *produced = 0;
+    if (z->trailing) {
+        *inlen = 0;
+        return 0;
+    }
+    if (z->format == ZIP_GZIP) {
+        // Another member can follow, as in "cat a.gz b.gz".
+        int fresh = z->ended && *inlen;
+        if (fresh) {
+            inflateReset(&z->gz);
+            z->ended = 0;
+        }
+        z->gz.next_in = (Bytef *) *in;
+        z->gz.avail_in = *inlen;
+        z->gz.next_out = (Bytef *) out;
+        z->gz.avail_out = outlen;
+        int r = inflate(&z->gz, Z_NO_FLUSH);
+        *produced = outlen - z->gz.avail_out;
+        *in += *inlen - z->gz.avail_in;
+        *inlen = z->gz.avail_in;
+        if (r == Z_STREAM_END) {
+            z->ended = 1;
+        }
+        else if (r == Z_DATA_ERROR && fresh) {
+            // Like gzip, ignore padding after the last member.
+            z->ended = 1;
+            z->trailing = 1;
+            *inlen = 0;
+        }
+        else if (r != Z_OK && r != Z_BUF_ERROR) {
+            return -1;
+        }
+        return 0;
+    }
+#ifdef YIM_ZSTD
+    if (z->format == ZIP_ZSTD) {
+        ZSTD_inBuffer ib = {*in, *inlen, 0};
+        ZSTD_outBuffer ob = {out, outlen, 0};
+        size_t r = ZSTD_decompressStream(z->zd, &ob, &ib);
+        if (ZSTD_isError(r)) return -1;
+        *produced = ob.pos;
+        *in += ib.pos;
+        *inlen -= ib.pos;
+        // 0 means a frame was just finished. Calls that do nothing say
+        // nothing about that.
+        if (ib.pos || ob.pos) z->ended = r == 0;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// The other way around. With finish set, everything is flushed out once
+// the input is used up, and 1 is returned when it all has been.
+int zipDeflate(zipStream *z, const char **in, size_t *inlen, char *out, size_t outlen, size_t *produced, int finish) {
+    *produced = 0;
+    if (z->format == ZIP_GZIP) {
+        z->gz.next_in = (Bytef *) *in;
+        z->gz.avail_in = *inlen;
+        z->gz.next_out = (Bytef *) out;
+        z->gz.avail_out = outlen;
+        int r = deflate(&z->gz, finish ? Z_FINISH : Z_NO_FLUSH);
+        *produced = outlen - z->gz.avail_out;
+        *in += *inlen - z->gz.avail_in;
+        *inlen = z->gz.avail_in;
+        if (r == Z_STREAM_ERROR) return -1;
+        return r == Z_STREAM_END;
+    }
+#ifdef YIM_ZSTD
+    if (z->format == ZIP_ZSTD) {
+        ZSTD_inBuffer ib = {*in, *inlen, 0};
+        ZSTD_outBuffer ob = {out, outlen, 0};
+        size_t r = ZSTD_compressStream2(z->zc, &ob, &ib, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(r)) return -1;
+        *produced = ob.pos;
+        *in += ib.pos;
+        *inlen -= ib.pos;
+        return finish && r == 0;
+    }
+#endif
+    return -1;
+}
+
+// Hands a block over to the main thread.
+void zipLoadPut(zipLoad *zl, char *data, size_t len) {
+    pthread_mutex_lock(&zl->lock);
+    if (zl->nblocks == zl->capblocks) {
+        zl->capblocks = zl->capblocks ? zl->capblocks * 2 : 16;
+        zl->blocks = realloc(zl->blocks, sizeof(zipBlock) * zl->capblocks);
+        if (zl->blocks == NULL) die("realloc");
+    }
+    zl->blocks[zl->nblocks].data = data;
+    zl->blocks[zl->nblocks].len = len;
+    zl->nblocks++;
+    pthread_cond_signal(&zl->cond);
+    pthread_mutex_unlock(&zl->lock);
+}
+
+// The loading thread. Each block ends at the last line break that fits
+// in it and the rest starts the next one. A line too long for a block
+// makes the block grow instead. The last block is '\0' terminated.
+void *zipLoader(void *arg) {
+    zipLoad *zl = arg;
+    char *in = malloc(YIM_ZIP_BUF);
+    if (in == NULL) die("malloc");
+    const char *next = in;
+    size_t avail = 0;
+    int eof = 0;
+    int error = 0;
+    size_t cap = YIM_ZIP_BLOCK;
+    size_t len = 0;
+    char *block = memBlockNew(cap + 1);
+
+    for (;;) {
+        if (avail == 0 && !eof) {
+            ssize_t n = read(zl->fd, in, YIM_ZIP_BUF);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) error = errno;
+            if (n <= 0) eof = 1;
+            next = in;
+            avail = n > 0 ? n : 0;
+        }
+        size_t produced = 0;
+        if (len < cap && zipInflate(&zl->z, &next, &avail, &block[len], cap - len, &produced) == -1) {
+            error = -1;
+            break;
+        }
+        len += produced;
+        if (len < cap) {
+            if (eof && avail == 0 && produced == 0) break;
+            continue;
+        }
+
+        char *nl = memrchr(block, '\n', len);
+        if (nl == NULL) {
+            cap *= 2;
+            block = memBlockResize(block, cap + 1);
+            continue;
+        }
+        size_t keep = nl - block + 1;
+        size_t rest = len - keep;
+        cap = rest * 2 > YIM_ZIP_BLOCK ? rest * 2 : YIM_ZIP_BLOCK;
+        char *fresh = memBlockNew(cap + 1);
+        memcpy(fresh, &block[keep], rest);
+        zipLoadPut(zl, memBlockResize(block, keep), keep);
+        block = fresh;
+        len = rest;
+    }
+    if (!error && !zl->z.ended) error = -1;
+    block[len] = '\0';
+    zipLoadPut(zl, memBlockResize(block, len + 1), len);
+    free(in);
+
+    pthread_mutex_lock(&zl->lock);
+    zl->done = 1;
+    zl->error = error;
+    pthread_cond_signal(&zl->cond);
+    pthread_mutex_unlock(&zl->lock);
+    return NULL;
+}
+
+// Opens the compressed file at fd into the buffer. Rows are made from
+// each block as soon as the thread hands it over.
+void zipOpen(int fd, int format) {
+    zipLoad *zl = calloc(1, sizeof(zipLoad));
+    if (zl == NULL) die("calloc");
+    zl->fd = fd;
+    if (!zipInit(&zl->z, format, 0)) {
+        errno = ENOTSUP;
+        die(format == ZIP_ZSTD ? "zstd (build with make ZSTD=1)" : zipName(format));
+    }
+    pthread_mutex_init(&zl->lock, NULL);
+    pthread_cond_init(&zl->cond, NULL);
+    pthread_t thread;
+    int threaded = pthread_create(&thread, NULL, zipLoader, zl) == 0;
+    if (!threaded) zipLoader(zl);
+
+    erow **rows = NULL;
+    int numrows = 0;
+    int caprows = 0;
+    unsigned int gen = ++E.gen;
+    int seennl = 0;
+    int taken = 0;
+    for (;;) {
+        pthread_mutex_lock(&zl->lock);
+        while (taken == zl->nblocks && !zl->done) pthread_cond_wait(&zl->cond, &zl->lock);
+        if (taken == zl->nblocks) {
+            pthread_mutex_unlock(&zl->lock);
+            break;
+        }
+        zipBlock b = zl->blocks[taken++];
+        pthread_mutex_unlock(&zl->lock);
+
+        memLoadKeep(b.data);
+        // The first line break decides between LF and CRLF, and the last
+        // block whether the file ends in one.
+        if (!seennl) {
+            char *nl = memchr(b.data, '\n', b.len);
+            if (nl) {
+                E.crlf = nl > b.data && nl[-1] == '\r';
+                seennl = 1;
+            }
+        }
+        if (b.len) E.noeol = b.data[b.len - 1] != '\n';
+
+        loadChunk c;
+        memset(&c, 0, sizeof(c));
+        c.src = c.data = b.data;
+        c.len = b.len;
+        loadCount(&c);
+        if (numrows + c.numrows > caprows) {
+            while (numrows + c.numrows > caprows) caprows = caprows ? caprows * 2 : 1024;
+            rows = realloc(rows, sizeof(erow *) * caprows);
+            if (rows == NULL) die("realloc");
+        }
+        c.rows = memLoadBlock(sizeof(erow) * c.numrows);
+        c.table = &rows[numrows];
+        c.gen = gen;
+        c.loadgen = memLoadRows(c.numrows);
+        loadRows(&c);
+        numrows += c.numrows;
+    }
+    if (threaded) pthread_join(thread, NULL);
+    zipEnd(&zl->z, 0);
+
+    if (zl->error) {
+        errno = zl->error == -1 ? EINVAL : zl->error;
+        die(zl->error == -1 ? "damaged or cut short compressed file" : "read");
+    }
+    if (E.numrows == 0) {
+        rowTreeBuild(rows, numrows);
+        E.numrows = numrows;
+    }
+    else {
+        int at;
+        for (at = 0; at < numrows; at++) {
+            rowTreeInsert(E.numrows, rows[at]);
+            E.numrows++;
+        }
+    }
+    free(rows);
+    pthread_mutex_destroy(&zl->lock);
+    pthread_cond_destroy(&zl->cond);
+    free(zl->blocks);
+    free(zl);
+}
+
+// Compresses whatever is waiting in w->in and writes out what comes of
+// it. With finish set, the stream is ended too. Returns 0, or -1 with
+// errno set.
+int zipWriterFlush(zipWriter *w, int finish) {
+    const char *in = w->in;
+    size_t inlen = w->inlen;
+    int done = 0;
+    while (inlen || (finish && !done)) {
+        size_t produced;
+        done = zipDeflate(&w->z, &in, &inlen, w->out, YIM_ZIP_BUF, &produced, finish);
+        if (done == -1) {
+            errno = EIO;
+            return -1;
+        }
+        struct iovec iov = {w->out, produced};
+        if (produced && writevAll(w->fd, &iov, 1) == -1) return -1;
+    }
+    w->inlen = 0;
+    return 0;
+}
+
+int zipWriterPut(zipWriter *w, const char *s, size_t len) {
+    while (len) {
+        size_t n = YIM_ZIP_BUF - w->inlen;
+        if (n > len) n = len;
+        memcpy(&w->in[w->inlen], s, n);
+        w->inlen += n;
+        s += n;
+        len -= n;
+        if (w->inlen == YIM_ZIP_BUF && zipWriterFlush(w, 0) == -1) return -1;
+    }
+    return 0;
+}
+
+// Like editorWriteRows(), but compressed. Returns the number of bytes
+// before compression, or -1 with errno set.
+long long zipWriteRows(int fd, int format) {
+    zipWriter w;
+    if (!zipInit(&w.z, format, 1)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    w.fd = fd;
+    w.in = malloc(YIM_ZIP_BUF);
+    w.inlen = 0;
+    w.out = malloc(YIM_ZIP_BUF);
+    const char *eol = E.crlf ? "\r\n" : "\n";
+    int eollen = E.crlf ? 2 : 1;
+    long long total = 0;
+    int ok = w.in && w.out;
+    if (!ok) errno = ENOMEM;
+
+    rowIter it;
+    erow *row;
+    int at = 0;
+    rowIterSeek(&it, 0);
+    while (ok && (row = rowIterNext(&it)) != NULL) {
+        ok = zipWriterPut(&w, row->chars, row->size) == 0;
+        total += row->size;
+        // A file that didn't end in a newline is saved without one.
+        if (ok && !(E.noeol && at == E.numrows - 1)) {
+            ok = zipWriterPut(&w, eol + row->lf, eollen - row->lf) == 0;
+            total += eollen - row->lf;
+        }
+        at++;
+    }
+    if (ok) ok = zipWriterFlush(&w, 1) == 0;
+
+    int saved = errno;
+    zipEnd(&w.z, 1);
+    free(w.in);
+    free(w.out);
+    errno = saved;
+    return ok ? total : -1;
+}
+
+/*---------- Swap File ----------*/
+// While the buffer has unsaved changes a copy of it is kept next to the
+// file, in ".name.swp", so that a crash or a dropped connection doesn't
+// lose them. A thread writes it from a snapshot of the row tree, so the
+// editor never waits for the disk.
+//
+// The file is a header and a series of checkpoints. The first checkpoint
+// holds every row. Later ones only say which rows of the checkpoint before
+// them are kept and hold the rows that are new: nodes and rows nobody
+// touched are shared by the two snapshots, so they are found by pointer
+// without looking at their text. On recovery the last checkpoint that was
+// written completely wins.
+//
+//   header      "YIMSWAP1" pid(u32) 0(u32)
+//   checkpoint  "ckpt" numrows(u32) flags(u32) op... 'E' length(u64) "done"
+//   op          'C' start(u32) count(u32)        rows of the last checkpoint
+//               'L' count(u32) (len(u32) text)... new rows
+
+#define SWAP_CRLF 1
+#define SWAP_NOEOL 2
+
+// ".name.swp" in the file's directory.
+char *swapPath(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 8);
+    sprintf(path, "%.*s.%s.swp", dirlen, filename, filename + dirlen);
+    return path;
+}
+
+void swapMapInit(swapMap *m) {
+    m->n = 0;
+    m->cap = 64;
+    m->keys = calloc(m->cap, sizeof(void *));
+    m->vals = malloc(sizeof(int) * m->cap);
+    m->kept = calloc(m->cap, 1);
+}
+
+void swapMapFree(swapMap *m) {
+    free(m->keys);
+    free(m->vals);
+    free(m->kept);
+}
+
+// Returns the slot key is in, or the free one it would go in.
+int swapMapSlot(swapMap *m, const void *key) {
+    uint64_t h = (uintptr_t) key * 0x9e3779b97f4a7c15ull;
+    int i = (h >> 32) & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & (m->cap - 1);
+    return i;
+}
+
+void swapMapPut(swapMap *m, const void *key, int val) {
+    if (2 * (m->n + 1) > m->cap) {
+        swapMap old = *m;
+        m->cap *= 2;
+        m->keys = calloc(m->cap, sizeof(void *));
+        m->vals = malloc(sizeof(int) * m->cap);
+        m->kept = calloc(m->cap, 1);
+        int j;
+        for (j = 0; j < old.cap; j++) {
+            if (old.keys[j] == NULL) continue;
+            int i = swapMapSlot(m, old.keys[j]);
+            m->keys[i] = old.keys[j];
+            m->vals[i] = old.vals[j];
+        }
+        swapMapFree(&old);
+    }
+    int i = swapMapSlot(m, key);
+    if (m->keys[i] == NULL) m->n++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+// Adds count rows of the last checkpoint, starting at line start, or new
+// rows if start is -1. Runs that continue each other are merged.
+void swapAddOp(swapJob *job, int start, int count, rowNode *leaf) {
+    swapOp *last = job->nops ? &job->ops[job->nops - 1] : NULL;
+    if (last && !leaf && !last->leaf && start != -1 && last->start != -1 &&
+            last->start + last->count == start) {
+        last->count += count;
+        return;
+    }
+    if (last && !leaf && !last->leaf && start == -1 && last->start == -1) {
+        last->count += count;
+        return;
+    }
+    if (job->nops == job->capops) {
+        job->capops = job->capops ? job->capops * 2 : 64;
+        job->ops = realloc(job->ops, sizeof(swapOp) * job->capops);
+    }
+    swapOp *op = &job->ops[job->nops++];
+    op->start = start;
+    op->count = count;
+    op->at = job->nlit;
+    op->leaf = leaf;
+}
+
+void swapAddRow(swapJob *job, erow *row) {
+    swapAddOp(job, -1, 1, NULL);
+    if (job->nlit == job->caplit) {
+        job->caplit = job->caplit ? job->caplit * 2 : 64;
+        job->lit = realloc(job->lit, sizeof(erow *) * job->caplit);
+    }
+    job->lit[job->nlit++] = row;
+}
+
+// Notes where every node of the last checkpoint started.
+void swapMapNodes(swapMap *m, rowNode *node, int start) {
+    swapMapPut(m, node, start);
+    if (node->leaf) return;
+    int j;
+    for (j = 0; j < node->n; j++) {
+        swapMapNodes(m, node->u.child[j], start);
+        start += node->count[j];
+    }
+}
+
+// Walks the new tree. Whole subtrees that were in the last checkpoint
+// become one op; leaves that weren't are looked at row by row later.
+void swapDiffNode(swapJob *job, rowNode *node) {
+    int slot = swapMapSlot(&job->nodes, node);
+    if (job->nodes.keys[slot]) {
+        job->nodes.kept[slot] = 1;
+        swapAddOp(job, job->nodes.vals[slot], rowNodeCount(node), NULL);
+        return;
+    }
+    if (node->leaf) {
+        swapAddOp(job, 0, node->n, node);
+        return;
+    }
+    int j;
+    for (j = 0; j < node->n; j++) swapDiffNode(job, node->u.child[j]);
+}
+
+// Notes where the rows of the last checkpoint were, except for those in
+// subtrees that were kept whole.
+void swapMapRows(swapJob *job, rowNode *node, int start) {
+    if (job->nodes.kept[swapMapSlot(&job->nodes, node)]) return;
+    int j;
+    for (j = 0; j < node->n; j++) {
+        if (node->leaf) {
+            swapMapPut(&job->rows, node->u.row[j], start + j);
+        }
+        else {
+            swapMapRows(job, node->u.child[j], start);
+            start += node->count[j];
+        }
+    }
+}
+
+// Works out the ops that turn the last checkpoint into the snapshot.
+void swapDiff(swapJob *job) {
+    if (job->prev == NULL) {
+        rowIter it;
+        erow *row;
+        rowIterSeekIn(&it, job->snap, rowNodeCount(job->snap), 0);
+        while ((row = rowIterNext(&it)) != NULL) swapAddRow(job, row);
+        return;
+    }
+    swapMapInit(&job->nodes);
+    swapMapInit(&job->rows);
+    swapMapNodes(&job->nodes, job->prev, 0);
+    swapDiffNode(job, job->snap);
+    swapMapRows(job, job->prev, 0);
+
+    // Resolve the leaves that changed, row by row.
+    swapOp *ops = job->ops;
+    int nops = job->nops;
+    job->ops = NULL;
+    job->nops = job->capops = 0;
+    int k;
+    for (k = 0; k < nops; k++) {
+        if (ops[k].leaf == NULL) {
+            swapAddOp(job, ops[k].start, ops[k].count, NULL);
+            continue;
+        }
+        int j;
+        for (j = 0; j < ops[k].leaf->n; j++) {
+            erow *row = ops[k].leaf->u.row[j];
+            int slot = swapMapSlot(&job->rows, row);
+            if (job->rows.keys[slot]) swapAddOp(job, job->rows.vals[slot], 1, NULL);
+            else swapAddRow(job, row);
+        }
+    }
+    free(ops);
+    swapMapFree(&job->nodes);
+    swapMapFree(&job->rows);
+}
+
+int swapFlush(swapOut *out) {
+    if (out->niov && writevAll(out->fd, out->iov, out->niov) == -1) return -1;
+    out->niov = 0;
+    out->metalen = 0;
+    return 0;
+}
+
+// Copies len bytes into the batch.
+void swapPut(swapOut *out, const void *p, int len) {
+    char *dst = &out->meta[out->metalen];
+    memcpy(dst, p, len);
+    out->metalen += len;
+    out->total += len;
+    struct iovec *last = out->niov ? &out->iov[out->niov - 1] : NULL;
+    if (last && (char *) last->iov_base + last->iov_len == dst) {
+        last->iov_len += len;
+        return;
+    }
+    out->iov[out->niov].iov_base = dst;
+    out->iov[out->niov].iov_len = len;
+    out->niov++;
+}
+
+void swapPutU32(swapOut *out, uint32_t n) {
+    swapPut(out, &n, sizeof(n));
+}
+
+// Writes the ops out as a checkpoint. Returns 0 or -1 with errno set.
+int swapWriteCheckpoint(swapJob *job, int fd) {
+    swapOut *out = malloc(sizeof(swapOut));
+    out->fd = fd;
+    out->niov = 0;
+    out->metalen = 0;
+    out->total = 0;
+    swapPut(out, "ckpt", 4);
+    swapPutU32(out, rowNodeCount(job->snap));
+    swapPutU32(out, job->flags);
+
+    int ret = 0;
+    int k;
+    for (k = 0; k < job->nops && ret == 0; k++) {
+        swapOp *op = &job->ops[k];
+        if (op->start != -1) {
+            swapPut(out, "C", 1);
+            swapPutU32(out, op->start);
+            swapPutU32(out, op->count);
+            continue;
+        }
+        swapPut(out, "L", 1);
+        swapPutU32(out, op->count);
+        int j;
+        for (j = op->at; j < op->at + op->count; j++) {
+            erow *row = job->lit[j];
+            swapPutU32(out, row->size);
+            if (row->size) {
+                out->iov[out->niov].iov_base = row->chars;
+                out->iov[out->niov].iov_len = row->size;
+                out->niov++;
+                out->total += row->size;
+            }
+            if (out->niov > YIM_SAVE_IOV - 4 ||
+                    out->metalen > (int) sizeof(out->meta) - 32) {
+                pthread_mutex_lock(&job->lock);
+                int cancel = job->cancel;
+                pthread_mutex_unlock(&job->lock);
+                if (cancel) {
+                    errno = ECANCELED;
+                    ret = -1;
+                    break;
+                }
+                if (swapFlush(out) == -1) {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+    }
+    if (ret == 0) {
+        uint64_t len = out->total + 1 + sizeof(uint64_t) + 4;
+        swapPut(out, "E", 1);
+        swapPut(out, &len, sizeof(len));
+        swapPut(out, "done", 4);
+        ret = swapFlush(out);
+        job->size += len;
+    }
+    free(out);
+    return ret;
+}
+
+void *swapWorker(void *arg) {
+    swapJob *job = arg;
+    swapDiff(job);
+
+    int fd = job->fd;
+    char *tmp = NULL;
+    if (job->prev == NULL) {
+        // A first checkpoint goes to a new file that then replaces the
+        // old one, so there is always a whole one on disk.
+        tmp = malloc(strlen(job->path) + 8);
+        sprintf(tmp, "%s.XXXXXX", job->path);
+        fd = mkstemp(tmp);
+        if (fd == -1) {
+            job->error = errno;
+            free(tmp);
+            write(job->notify, "s", 1);
+            return NULL;
+        }
+        char header[16] = "YIMSWAP1";
+        uint32_t pid = getpid();
+        memcpy(&header[8], &pid, sizeof(pid));
+        struct iovec iov = { header, sizeof(header) };
+        job->size = writevAll(fd, &iov, 1) == -1 ? -1 : (long long) sizeof(header);
+    }
+    if (job->size == -1 || swapWriteCheckpoint(job, fd) == -1 || fdatasync(fd) == -1 ||
+            (tmp && rename(tmp, job->path) == -1)) {
+        job->error = errno;
+    }
+    if (tmp) {
+        if (job->error) {
+            close(fd);
+            unlink(tmp);
+        }
+        else {
+            job->newfd = fd;
+        }
+        free(tmp);
+    }
+    write(job->notify, "s", 1);
+    return NULL;
+}
+
+// Stops the swap thread, waiting for it. Returns the finished job, which
+// the caller has to hand to swapJobEnd().
+swapJob *swapJobJoin(int cancel) {
+    swapJob *job = E.swap.job;
+    if (job == NULL) return NULL;
+    pthread_mutex_lock(&job->lock);
+    job->cancel |= cancel;
+    pthread_mutex_unlock(&job->lock);
+    pthread_join(job->thread, NULL);
+    E.swap.job = NULL;
+    char buf[64];
+    while (read(E.swap.notify[0], buf, sizeof(buf)) > 0);
+    return job;
+}
+
+// Takes in what a finished job did: its snapshot becomes the last
+// checkpoint, or, if writing failed, the next checkpoint starts over.
+void swapJobEnd(swapJob *job) {
+    struct swapState *sw = &E.swap;
+    rowNodeRelease(sw->prev);
+    sw->prev = NULL;
+    if (job->error) {
+        rowNodeRelease(job->snap);
+        if (job->error != ECANCELED) {
+            // Say so once rather than every few seconds.
+            sw->off = 1;
+            editorSetStatusMessage("Can't write swap file %s: %s", sw->path, strerror(job->error));
+        }
+    }
+    else {
+        sw->prev = job->snap;
+        sw->size = job->size;
+        if (job->prev == NULL) {
+            if (sw->fd != -1) close(sw->fd);
+            sw->fd = job->newfd;
+        }
+    }
+    free(job->ops);
+    free(job->lit);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+void swapStart() {
+    struct swapState *sw = &E.swap;
+    if (sw->notify[0] == -1) {
+        if (pipe(sw->notify) == -1) die("pipe");
+        fcntl(sw->notify[0], F_SETFL, O_NONBLOCK);
+    }
+    if (sw->path == NULL) sw->path = swapPath(E.filename);
+
+    swapJob *job = calloc(1, sizeof(swapJob));
+    pthread_mutex_init(&job->lock, NULL);
+    job->snap = rowTreeSnapshot();
+    // Start over when the file has grown to twice the buffer.
+    long long bytes = rowNodeBytes(job->snap) + E.numrows;
+    if (sw->prev && sw->size <= 2 * bytes + (1 << 20)) {
+        job->prev = sw->prev;
+        job->fd = sw->fd;
+        job->size = sw->size;
+    }
+    job->flags = (E.crlf ? SWAP_CRLF : 0) | (E.noeol ? SWAP_NOEOL : 0);
+    job->path = sw->path;
+    job->notify = sw->notify[1];
+    if (pthread_create(&job->thread, NULL, swapWorker, job) != 0) {
+        rowNodeRelease(job->snap);
+        pthread_mutex_destroy(&job->lock);
+        free(job);
+        return;
+    }
+    sw->job = job;
+}
+
+// Called when the swap thread is done.
+void swapPoll() {
+    swapJob *job = swapJobJoin(0);
+    if (job) swapJobEnd(job);
+}
+
+// Drops the swap file, when the buffer is saved or thrown away.
+void swapRemove() {
+    struct swapState *sw = &E.swap;
+    swapJob *job = swapJobJoin(1);
+    if (job) swapJobEnd(job);
+    rowNodeRelease(sw->prev);
+    sw->prev = NULL;
+    if (sw->fd != -1) close(sw->fd);
+    sw->fd = -1;
+    if (sw->path) unlink(sw->path);
+    free(sw->path);
+    sw->path = NULL;
+    sw->since = 0;
+}
+
+// Starts a checkpoint once the buffer has had changes for YIM_SWAP_MS.
+// Returns the milliseconds until one is due, or -1.
+int swapTick() {
+    struct swapState *sw = &E.swap;
+    if (sw->off || E.view.on || E.filename == NULL || sw->job) return -1;
+    if (!E.dirty) {
+        // Back to what is on disk, e.g. by undoing.
+        if (sw->path) swapRemove();
+        return -1;
+    }
+    // Anything edited since the last checkpoint was copied first, so the
+    // root is a different node.
+    if (sw->prev && sw->prev == E.rows) return -1;
+    long long now = editorNow();
+    if (sw->since == 0) sw->since = now;
+    if (now - sw->since < YIM_SWAP_MS) return sw->since + YIM_SWAP_MS - now;
+    sw->since = 0;
+    swapStart();
+    return -1;
+}
+
+// Reads the rows of the last whole checkpoint in a swap file. Returns
+// the number of rows, or -1 if there isn't one, with *rows holding an
+// offset and a length into data for each row.
+int swapParse(const char *data, long long size, long long **rows, int *flags) {
+    long long *cur = NULL;
+    long long *last = NULL;
+    int nlast = -1;
+    long long p = 16;
+    while (p + 12 <= size && !memcmp(&data[p], "ckpt", 4)) {
+        long long start = p;
+        uint32_t numrows, u;
+        memcpy(&numrows, &data[p + 4], 4);
+        memcpy(&u, &data[p + 8], 4);
+        p += 12;
+        if (numrows > INT_MAX / 2) break;
+        long long *grown = realloc(cur, sizeof(long long) * 2 * (numrows ? numrows : 1));
+        if (grown == NULL) break;
+        cur = grown;
+        uint32_t n = 0;
+        int ok = 0;
+        while (p < size) {
+            char op = data[p++];
+            if (op == 'E') {
+                uint64_t len;
+                if (p + 12 > size) break;
+                memcpy(&len, &data[p], 8);
+                ok = n == numrows && len == (uint64_t) (p + 12 - start) &&
+                    !memcmp(&data[p + 8], "done", 4);
+                p += 12;
+                break;
+            }
+            uint32_t a, b;
+            if (p + 4 > size) break;
+            memcpy(&a, &data[p], 4);
+            p += 4;
+            if (op == 'C') {
+                if (p + 4 > size) break;
+                memcpy(&b, &data[p], 4);
+                p += 4;
+                if ((long long) a + b > nlast || n + (long long) b > numrows) break;
+                memcpy(&cur[2 * n], &last[2 * a], sizeof(long long) * 2 * b);
+                n += b;
+            }
+            else if (op == 'L') {
+                if (n + (long long) a > numrows) break;
+                uint32_t j;
+                for (j = 0; j < a; j++) {
+                    if (p + 4 > size) break;
+                    memcpy(&b, &data[p], 4);
+                    p += 4;
+                    if (p + b > size) break;
+                    cur[2 * n] = p;
+                    cur[2 * n + 1] = b;
+                    n++;
+                    p += b;
+                }
+                if (j < a) break;
+            }
+            else {
+                break;
+            }
+        }
+        if (!ok) break;
+        long long *t = last;
+        last = cur;
+        cur = t;
+        nlast = numrows;
+        *flags = u;
+    }
+    free(cur);
+    *rows = last;
+    return nlast;
+}
+
+// Looks for a swap file left behind for the file that was just opened,
+// and offers to recover it.
+void swapRecover() {
+    struct swapState *sw = &E.swap;
+    if (E.filename == NULL) return;
+    char *path = swapPath(E.filename);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < 16) {
+        if (fd != -1) close(fd);
+        free(path);
+        return;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        free(path);
+        return;
+    }
+
+    uint32_t pid;
+    memcpy(&pid, &data[8], sizeof(pid));
+    long long *rows = NULL;
+    int flags = 0;
+    int numrows = memcmp(data, "YIMSWAP1", 8) ? -1 : swapParse(data, st.st_size, &rows, &flags);
+    if (numrows != -1 && pid != (uint32_t) getpid() && (kill(pid, 0) == 0 || errno == EPERM)) {
+        // Leave it to the yim that is writing it.
+        sw->off = 1;
+        editorSetStatusMessage("%s is being edited by process %u, so there is no swap file",
+                E.filename, pid);
+        numrows = -1;
+    }
+    if (numrows != -1) {
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&st.st_mtime));
+        editorSetStatusMessage("Found unsaved changes from %s (%d lines). "
+                "R recover, D delete, any other key to ignore", when, numrows);
+        editorRefreshScreen();
+        int c = editorReadKey();
+        if (c == 'r' || c == 'R') {
+            erow **recovered = malloc(sizeof(erow *) * (numrows ? numrows : 1));
+            int j;
+            for (j = 0; j < numrows; j++)
+                recovered[j] = editorRowNew(&data[rows[2 * j]], rows[2 * j + 1]);
+            rowNodeRelease(E.rows);
+            E.rows = NULL;
+            rowTreeBuild(recovered, numrows);
+            free(recovered);
+            E.numrows = numrows;
+            E.crlf = (flags & SWAP_CRLF) != 0;
+            E.noeol = (flags & SWAP_NOEOL) != 0;
+            E.cx = E.cy = 0;
+            // Unsaved until it is saved; the swap file is ours now and
+            // stays until then.
+            E.dirty = 1;
+            sw->path = strdup(path);
+            editorSetStatusMessage("Recovered %d lines from %s", numrows, path);
+        }
+        else if (c == 'd' || c == 'D') {
+            unlink(path);
+            editorSetStatusMessage("Deleted %s", path);
+        }
+        else {
+            editorSetStatusMessage("Left %s alone until the buffer changes", path);
+        }
+    }
+    free(rows);
+    munmap(data, st.st_size);
+    free(path);
+}
+
+/*---------- Viewer ----------*/
+// "yim -R file" views a file without loading it. The file is mapped and
+// a thread reads through it once, noting where every YIM_VIEW_STRIDE-th
+// line starts. Rows are only made for the lines that are looked at, and
+// at most YIM_VIEW_ROWS of them are kept. editorRowAt() and the row
+// iterator come here instead of going to the row tree, and the keys that
+// would change the buffer are refused.
+//
+// The end of the file can be looked at before the index gets there. Its
+// lines are then numbered back from the last line, whose number is a
+// guess at first (see viewEnd()). Lines from v->floor on are found from
+// the last line and everything before it from the index, and the cursor
+// stays at or below floor until the guess has been corrected.
+
+void *viewIndexer(void *arg) {
+    struct viewState *v = arg;
+    char *buf = malloc(YIM_VIEW_CHUNK);
+    long long *found = malloc(sizeof(long long) * (YIM_VIEW_CHUNK / YIM_VIEW_STRIDE + 1));
+    long long off = 0;
+    long long lines = 0;
+    long long notified = 0;
+    while (off < v->size) {
+        ssize_t n = pread(v->fd, buf, YIM_VIEW_CHUNK, off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        int nfound = 0;
+        char *p = buf;
+        char *end = buf + n;
+        char *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            lines++;
+            if (lines % YIM_VIEW_STRIDE == 0) found[nfound++] = off + (nl - buf) + 1;
+            p = nl + 1;
+        }
+        off += n;
+
+        pthread_mutex_lock(&v->lock);
+        if (v->nindex + nfound > v->capindex) {
+            while (v->nindex + nfound > v->capindex) v->capindex *= 2;
+            v->index = realloc(v->index, sizeof(long long) * v->capindex);
+        }
+        memcpy(&v->index[v->nindex], found, sizeof(long long) * nfound);
+        v->nindex += nfound;
+        v->lines = lines;
+        v->bytes = off;
+        pthread_mutex_unlock(&v->lock);
+
+        // Wake the editor up now and then, not on every chunk.
+        long long now = editorNow();
+        if (now - notified >= YIM_VIEW_NOTIFY_MS) {
+            notified = now;
+            write(v->notify[1], "v", 1);
+        }
+    }
+    pthread_mutex_lock(&v->lock);
+    v->bytes = v->size;
+    v->done = 1;
+    pthread_mutex_unlock(&v->lock);
+    write(v->notify[1], "v", 1);
+    free(buf);
+    free(found);
+    return NULL;
+}
+
+// Lines from the floor on are numbered from the last line, as long as
+// that number is only a guess.
+int viewGuessed(int line) {
+    struct viewState *v = &E.view;
+    return v->anchored && !v->exact && line >= v->floor;
+}
+
+long long viewDistance(long long a, long long b) {
+    return a > b ? a - b : b - a;
+}
+
+// Returns where a line starts. It scans from the closest line whose start
+// is known: one in the index, a row that was read in, or the last line.
+long long viewFind(int line) {
+    struct viewState *v = &E.view;
+    int guessed = viewGuessed(line);
+    long long known = 0;
+    long long off = 0;
+    if (!guessed) {
+        pthread_mutex_lock(&v->lock);
+        int k = line / YIM_VIEW_STRIDE;
+        if (k >= v->nindex) k = v->nindex - 1;
+        off = v->index[k];
+        pthread_mutex_unlock(&v->lock);
+        known = (long long) k * YIM_VIEW_STRIDE;
+    }
+    if (v->anchored && (guessed || v->exact) &&
+            (guessed || viewDistance(v->aline, line) < viewDistance(known, line))) {
+        known = v->aline;
+        off = v->aoff;
+    }
+    int j;
+    for (j = 0; j < YIM_VIEW_ROWS; j++) {
+        viewSlot *s = &v->slots[j];
+        if (s->row == NULL || viewGuessed(s->line) != guessed) continue;
+        if (guessed && v->top != -1 && s->line < v->top) continue;
+        if (viewDistance(s->line, line) < viewDistance(known, line)) {
+            known = s->line;
+            off = s->off;
+        }
+        if (s->next < v->size && viewDistance(s->line + 1, line) < viewDistance(known, line)) {
+            known = s->line + 1;
+            off = s->next;
+        }
+    }
+
+    while (known < line && off < v->size) {
+        char *nl = memchr(&v->map[off], '\n', v->size - off);
+        off = nl ? nl - v->map + 1 : v->size;
+        known++;
+    }
+    while (known > line && off > 0) {
+        // The line before ends at off - 1 and starts after the line break
+        // before that.
+        char *nl = off >= 2 ? memrchr(v->map, '\n', off - 1) : NULL;
+        off = nl ? nl - v->map + 1 : 0;
+        known--;
+    }
+    // The guess was too high: counting back got to the top of the file
+    // before it got to the line.
+    if (guessed && known > line && (v->top == -1 || known < v->top)) v->top = known;
+    return off;
+}
+
+// Returns a row for a line, reading it in if it isn't kept already. Very
+// long lines are cut off at YIM_VIEW_LINE_MAX bytes.
+erow *viewRowAt(int line) {
+    if (line < 0 || line >= E.numrows) return NULL;
+    struct viewState *v = &E.view;
+    viewSlot *lru = &v->slots[0];
+    int j;
+    for (j = 0; j < YIM_VIEW_ROWS; j++) {
+        viewSlot *s = &v->slots[j];
+        if (s->row && s->line == line) {
+            s->used = ++v->clock;
+            return s->row;
+        }
+        if (lru->row && (s->row == NULL || s->used < lru->used)) lru = s;
+    }
+
+    long long off = viewFind(line);
+    char *nl = memchr(&v->map[off], '\n', v->size - off);
+    long long end = nl ? nl - v->map : v->size;
+    lru->next = nl ? end + 1 : v->size;
+    if (nl && E.crlf && end > off && v->map[end - 1] == '\r') end--;
+    if (end - off > YIM_VIEW_LINE_MAX) end = off + YIM_VIEW_LINE_MAX;
+
+    if (lru->row) editorRowRelease(lru->row);
+    lru->row = editorRowNew(&v->map[off], end - off);
+    lru->line = line;
+    lru->off = off;
+    lru->used = ++v->clock;
+    return lru->row;
+}
+
+// Drops the rows kept for lines from "from" on.
+void viewForget(int from) {
+    int j;
+    for (j = 0; j < YIM_VIEW_ROWS; j++) {
+        viewSlot *s = &E.view.slots[j];
+        if (s->row && s->line >= from) {
+            editorRowRelease(s->row);
+            s->row = NULL;
+        }
+    }
+}
+
+// The number of the line that holds byte "off", which has to be indexed.
+int viewLineAt(long long off) {
+    struct viewState *v = &E.view;
+    pthread_mutex_lock(&v->lock);
+    int lo = 0;
+    int hi = v->nindex - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (v->index[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    long long p = v->index[lo];
+    pthread_mutex_unlock(&v->lock);
+
+    long long line = (long long) lo * YIM_VIEW_STRIDE;
+    char *nl;
+    while (p < off && (nl = memchr(&v->map[p], '\n', off - p)) != NULL) {
+        line++;
+        p = nl - v->map + 1;
+    }
+    return line;
+}
+
+// Renumbers the lines counted from the last line by delta.
+void viewShift(int delta) {
+    struct viewState *v = &E.view;
+    int j;
+    for (j = 0; j < YIM_VIEW_ROWS; j++) {
+        viewSlot *s = &v->slots[j];
+        if (s->row && s->line >= v->floor) s->line += delta;
+    }
+    v->aline += delta;
+    E.cy += delta;
+    E.rowoff += delta;
+    E.drawntop += delta;
+    if (E.cy < 0) E.cy = 0;
+    if (E.rowoff < 0) E.rowoff = 0;
+    E.numrows = v->aline + 1;
+}
+
+// The line count the index has got to, counting a last line without a
+// line break once it is done.
+int viewIndexedLines() {
+    struct viewState *v = &E.view;
+    pthread_mutex_lock(&v->lock);
+    long long lines = v->lines;
+    if (v->done && v->size > 0 && v->map[v->size - 1] != '\n') lines++;
+    pthread_mutex_unlock(&v->lock);
+    return lines < INT_MAX ? lines : INT_MAX - 1;
+}
+
+// How much of the file has been indexed, in percent.
+int viewProgress() {
+    struct viewState *v = &E.view;
+    pthread_mutex_lock(&v->lock);
+    int percent = v->done ? 100 : v->bytes * 100 / v->size;
+    pthread_mutex_unlock(&v->lock);
+    return percent;
+}
+
+// Called when the indexer has news. Returns 1 since the progress in the
+// status bar changed.
+int viewPoll() {
+    struct viewState *v = &E.view;
+    char buf[64];
+    while (read(v->notify[0], buf, sizeof(buf)) > 0);
+
+    if (v->anchored && !v->exact) {
+        // Once the index has reached a row that was found from the last
+        // line, the real line numbers are known.
+        pthread_mutex_lock(&v->lock);
+        long long bytes = v->bytes;
+        pthread_mutex_unlock(&v->lock);
+        if (v->top != -1) {
+            viewForget(v->floor);
+            viewShift(-v->top);
+            v->exact = 1;
+        }
+        int j;
+        for (j = 0; j < YIM_VIEW_ROWS && !v->exact; j++) {
+            viewSlot *s = &v->slots[j];
+            if (s->row && s->line >= v->floor && s->off <= bytes) {
+                viewShift(viewLineAt(s->off) - s->line);
+                v->exact = 1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&v->lock);
+    int done = v->done;
+    pthread_mutex_unlock(&v->lock);
+    if (v->anchored && done) {
+        // The index has the last line now.
+        if (!v->exact) viewShift(viewLineAt(v->aoff) - v->aline);
+        v->anchored = 0;
+    }
+    if (!v->anchored) E.numrows = viewIndexedLines();
+    return 1;
+}
+
+// Moves to the last line. If the index hasn't got there yet the last line
+// is found from the end of the file and its number is guessed from the
+// lines seen so far: on the high side, so that there are enough numbers
+// for the lines between the index and the end.
+void viewEnd() {
+    struct viewState *v = &E.view;
+    pthread_mutex_lock(&v->lock);
+    int done = v->done;
+    long long bytes = v->bytes;
+    long long lines = v->lines;
+    pthread_mutex_unlock(&v->lock);
+    if (done || v->anchored) {
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+        return;
+    }
+
+    long long end = v->size;
+    if (end > 0 && v->map[end - 1] == '\n') end--;
+    char *nl = end > 0 ? memrchr(v->map, '\n', end) : NULL;
+    v->aoff = nl ? nl - v->map + 1 : 0;
+    v->floor = lines;
+    double avg = lines ? (double) bytes / lines : 80;
+    long long guess = lines + 2 * (long long) ((v->size - bytes) / avg) + 1000;
+    v->aline = guess < INT_MAX - 1 ? guess : INT_MAX - 2;
+    v->anchored = 1;
+    v->exact = 0;
+    v->top = -1;
+    viewForget(v->floor);
+    E.numrows = v->aline + 1;
+    E.cy = v->aline;
+    E.cx = 0;
+}
+
+// Goes to a line number or a byte offset the index already knows about.
+// Returns 0 if it doesn't yet.
+int viewGoto(long long n, int bytes) {
+    struct viewState *v = &E.view;
+    pthread_mutex_lock(&v->lock);
+    int done = v->done;
+    long long indexed = v->bytes;
+    pthread_mutex_unlock(&v->lock);
+
+    int line;
+    long long off = 0;
+    if (bytes) {
+        if (n > indexed && !done) return 0;
+        if (n >= v->size) n = v->size ? v->size - 1 : 0;
+        line = viewLineAt(n);
+        off = n;
+    }
+    else {
+        int known = !v->anchored ? viewIndexedLines() : v->exact ? E.numrows : v->floor;
+        if (n > known && !done) return 0;
+        line = n < 1 ? 0 : n - 1;
+    }
+    // The line numbers past the floor don't mean the same any more.
+    if (v->anchored && !v->exact && line < v->floor) {
+        viewForget(v->floor);
+        v->anchored = 0;
+        E.numrows = viewIndexedLines();
+    }
+    if (line >= E.numrows) line = E.numrows ? E.numrows - 1 : 0;
+    E.cy = line;
+    E.cx = 0;
+    if (bytes && line < E.numrows) {
+        erow *row = viewRowAt(line);
+        int col = off - viewFind(line);
+        E.cx = col < row->size ? col : row->size;
+    }
+    return 1;
+}
+
+// Keys that would change the buffer do nothing in the viewer. Returns 0
+// for those.
+int viewAllowsKey(int c) {
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('t'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('p'):
+        case '\x1b':
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case PASTE_END:
+            return 1;
+        case PASTE_START:
+            {
+                size_t len;
+                free(editorReadPaste(&len));
+            }
+            break;
+    }
+    editorSetStatusMessage("Read-only view: ^T goto ($ for the end) ^Q quit");
+    return 0;
+}
+
+void viewOpen(char *filename) {
+    struct viewState *v = &E.view;
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    v->fd = open(filename, O_RDONLY);
+    if (v->fd == -1) die("open");
+    // There is no mapping a compressed file, so it is loaded instead.
+    if (zipDetect(v->fd)) {
+        close(v->fd);
+        v->fd = -1;
+        editorOpen(filename);
+        return;
+    }
+    struct stat st;
+    if (fstat(v->fd, &st) == -1) die("fstat");
+    v->size = st.st_size;
+    if (v->size > 0) {
+        v->map = mmap(NULL, v->size, PROT_READ, MAP_PRIVATE, v->fd, 0);
+        if (v->map == MAP_FAILED) die("mmap");
+        madvise(v->map, v->size, MADV_RANDOM);
+        char *firstnl = memchr(v->map, '\n', v->size);
+        E.crlf = firstnl && firstnl > v->map && firstnl[-1] == '\r';
+    }
+
+    v->capindex = 1024;
+    v->index = malloc(sizeof(long long) * v->capindex);
+    v->index[0] = 0;
+    v->nindex = 1;
+    pthread_mutex_init(&v->lock, NULL);
+    if (pipe(v->notify) == -1) die("pipe");
+    fcntl(v->notify[0], F_SETFL, O_NONBLOCK);
+    v->on = 1;
+    if (pthread_create(&v->thread, NULL, viewIndexer, v) != 0) die("pthread_create");
+
+    // The first chunk is indexed right away, which is plenty to show the
+    // first screen.
+    struct pollfd pfd;
+    pfd.fd = v->notify[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, -1);
+    viewPoll();
+    E.dirty = 0;
+}
+
+/*---------- Follow ----------*/
+// "yim -F file", or Ctrl-E, follows a file that is being appended to,
+// like "tail -f" or "less +F". inotify says when the file has changed,
+// and only what was added since it was last read is read and made into
+// rows at the end. A last line that was cut off in the middle grows once
+// the rest of it is there. However often the file is written to, it is
+// read at most every YIM_FOLLOW_MS, so a busy log is taken in a large
+// piece at a time and costs a frame every now and then, not one per
+// write. With the cursor on the last line the screen keeps up with the
+// end; moving off it stops that, and going back to it starts it again.
+// A file that shrinks or is replaced (rotated) is read again from the
+// start, unless there are unsaved changes, which stops following instead.
+
+// Points the inotify watch at the file under its name.
+void followWatch() {
+#ifdef __linux__
+    struct followState *f = &E.follow;
+    if (f->inotify == -1) return;
+    if (f->wd != -1) inotify_rm_watch(f->inotify, f->wd);
+    f->wd = inotify_add_watch(f->inotify, E.filename,
+            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+}
+
+void followStart() {
+    struct followState *f = &E.follow;
+    if (E.filename == NULL || E.view.on || E.compress) {
+        editorSetStatusMessage("Can't follow %s", E.view.on ? "a file in the viewer" :
+                E.compress ? "a compressed file" : "a buffer with no file");
+        return;
+    }
+    f->fd = open(E.filename, O_RDONLY);
+    if (f->fd == -1) {
+        editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+        return;
+    }
+#ifdef __linux__
+    f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    followWatch();
+#endif
+    f->on = 1;
+    f->pending = 1;
+    f->lost = 0;
+    f->last = 0;
+    editorSetStatusMessage("Following %s (Ctrl-E to stop)", E.filename);
+}
+
+void followStop() {
+    struct followState *f = &E.follow;
+    if (!f->on) return;
+    close(f->fd);
+    if (f->inotify != -1) close(f->inotify);
+    f->fd = f->inotify = f->wd = -1;
+    f->on = 0;
+    editorSetStatusMessage("Stopped following %s", E.filename);
+}
+
+// Adds the len bytes at data, a block of the current load generation
+// with a '\0' after them, to the end of the buffer. This isn't an edit: it can't be
+// undone and doesn't make the buffer modified.
+void followAppend(char *data, size_t len) {
+    int scroll = E.cy >= E.numrows - 1;
+    char *p = data;
+    char *end = data + len;
+    // Before loadRows() puts a '\0' in place of it.
+    int noeol = end[-1] != '\n';
+    // The first line break decides between LF and CRLF, as in editorOpen(),
+    // and its '\r' may have come in the last time.
+    char *firstnl = memchr(data, '\n', len);
+    if (firstnl && (E.numrows == 0 || (E.numrows == 1 && E.noeol))) {
+        erow *row = editorRowAt(0);
+        if (firstnl > data) E.crlf = firstnl[-1] == '\r';
+        else E.crlf = row && row->size && editorRowByte(row, row->size - 1) == '\r';
+    }
+    if (E.numrows && E.noeol) {
+        // The rest of the last line, which was cut off. Once its line
+        // break is there, in a CRLF file the one '\r' before it belongs
+        // to the break, even if it came in the last time, and without one
+        // the line is marked as in loadRows().
+        char *nl = memchr(p, '\n', len);
+        int dirty = E.dirty;
+        E.undo.applying = 1;
+        editorRowAppendString(E.numrows - 1, p, (nl ? nl : end) - p);
+        if (nl && E.crlf) {
+            erow *row = editorRowAt(E.numrows - 1);
+            if (row->size && editorRowByte(row, row->size - 1) == '\r') {
+                editorRowTruncate(E.numrows - 1, row->size - 1);
+            }
+            else {
+                row = editorRowAtMut(E.numrows - 1);
+                row->lf = 1;
+                rowTreeAddBytes(E.numrows - 1, -1);
+            }
+        }
+        E.undo.applying = 0;
+        E.dirty = dirty;
+        p = nl ? nl + 1 : end;
+    }
+    if (p < end) {
+        loadChunk c;
+        memset(&c, 0, sizeof(c));
+        c.src = c.data = p;
+        c.len = end - p;
+        loadCount(&c);
+        erow **rows = malloc(sizeof(erow *) * c.numrows);
+        if (rows == NULL) die("malloc");
+        c.rows = memLoadBlock(sizeof(erow) * c.numrows);
+        c.table = rows;
+        c.gen = ++E.gen;
+        c.loadgen = memLoadRows(c.numrows);
+        loadRows(&c);
+        int first = E.numrows;
+        int j;
+        for (j = 0; j < c.numrows; j++) {
+            rowTreeInsert(E.numrows, rows[j]);
+            E.numrows++;
+        }
+        editorSyntaxInvalidate(first);
+        free(rows);
+    }
+    E.noeol = noeol;
+    if (scroll) {
+        E.cy = E.numrows ? E.numrows - 1 : 0;
+        E.cx = 0;
+    }
+}
+
+// Starts the buffer over from the start of the file open at fd, which
+// takes the place of the one followed so far. Returns 1 if it did.
+int followReset(int fd, const char *why) {
+    struct followState *f = &E.follow;
+    if (E.dirty) {
+        if (fd != f->fd) close(fd);
+        followStop();
+        editorSetStatusMessage("%s %s, stopped following to keep the unsaved changes",
+                E.filename, why);
+        return 0;
+    }
+    if (fd != f->fd) {
+        close(f->fd);
+        f->fd = fd;
+        followWatch();
+    }
+    rowNodeRelease(E.rows);
+    E.rows = NULL;
+    memLoadNext();
+    E.numrows = 0;
+    E.noeol = 0;
+    E.cx = E.cy = 0;
+    E.rowoff = E.coloff = E.wrapoff = 0;
+    editorSyntaxInvalidate(0);
+    // The undo log is about rows that are gone.
+    E.undo.len = E.undo.cur = E.undo.last = E.undo.step = 0;
+    E.undo.open = E.undo.coalesce = 0;
+    E.undo.saved = 0;
+    f->off = 0;
+    f->pending = 1;
+    editorSetStatusMessage("%s %s, reading it again", E.filename, why);
+    return 1;
+}
+
+// Reads in what the file has grown by, or starts over if it shrank or
+// was replaced. Returns 1 if the buffer changed.
+int followRead() {
+    struct followState *f = &E.follow;
+    struct stat st, named;
+    if (fstat(f->fd, &st) == -1) return 0;
+    if (st.st_size < f->off) return followReset(f->fd, "was truncated");
+
+    if (st.st_size > f->off) {
+        size_t want = st.st_size - f->off;
+        if (want > YIM_FOLLOW_MAX) {
+            want = YIM_FOLLOW_MAX;
+            f->pending = 1;
+        }
+        // The rows keep pointing into this, like into a loaded file.
+        char *data = memLoadBlock(want + 1);
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(f->fd, &data[got], want - got, f->off + got);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+        data[got] = '\0';
+        f->off += got;
+        if (got) {
+            followAppend(data, got);
+            return 1;
+        }
+    }
+
+    // Everything the old file had has been read, so move on to whatever
+    // has its name now. Until something does, keep looking.
+    f->lost = 0;
+    if (stat(E.filename, &named) == -1) {
+        f->lost = 1;
+        return 0;
+    }
+    if (named.st_dev == st.st_dev && named.st_ino == st.st_ino) return 0;
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) {
+        f->lost = 1;
+        return 0;
+    }
+    return followReset(fd, "was replaced");
+}
+
+// inotify has news about the file. It's read on the next followTick().
+void followPoll() {
+    struct followState *f = &E.follow;
+    char buf[4096];
+    while (read(f->inotify, buf, sizeof(buf)) > 0);
+    f->pending = 1;
+}
+
+// Reads the file if it changed and YIM_FOLLOW_MS have passed since it was
+// last read, or if it is polled for and its time has come. Sets E.redraw
+// if the buffer changed. Returns the milliseconds until it is due next,
+// or -1 if that's up to inotify.
+int followTick() {
+    struct followState *f = &E.follow;
+    if (!f->on) return -1;
+    int polled = f->wd == -1 || f->lost;
+    long long now = editorNow();
+    long long due;
+    if (f->pending) due = f->last + YIM_FOLLOW_MS;
+    else if (polled) due = f->last + YIM_FOLLOW_POLL_MS;
+    else return -1;
+    if (due > now) return due - now;
+
+    f->last = now;
+    f->pending = 0;
+    if (followRead()) E.redraw = 1;
+    if (!f->on) return -1;
+    if (f->pending) return YIM_FOLLOW_MS;
+    return f->wd == -1 || f->lost ? YIM_FOLLOW_POLL_MS : -1;
+}
+
+/*---------- Regex ----------*/
+// Regular expressions for search and replace. The syntax is the extended
+// one: . [...] [^...] * + ? {m,n} | ( ) ^ $ and the \d \w \s escapes
+// (\D \W \S for their complements). Patterns are compiled to an NFA and
+// run as a DFA whose states are built the first time they are reached,
+// so a scan never backtracks and costs one table lookup per byte.
+
+typedef struct regexParser {
+    regex *re;
+    const char *s;
+    int len;
+    int pos;
+    const char *error;
+    int reverse; // Build the NFA for the pattern read right to left.
+} regexParser;
+
+// A piece of NFA under construction. end is an RX_EMPTY state whose out
+// is filled in when the piece is joined to the next one.
+typedef struct regexFrag {
+    int start;
+    int end;
+} regexFrag;
+
+void regexSetAdd(unsigned char *set, int c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+int regexSetHas(const unsigned char *set, int c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+int regexNewState(regexParser *ps, int op) {
+    regex *re = ps->re;
+    if (re->n == YIM_REGEX_MAX_STATES) {
+        // Keep going on a dummy state; the error is reported at the end.
+        ps->error = "pattern too large";
+        return 0;
+    }
+    if (re->n == re->cap) {
+        re->cap = re->cap ? re->cap * 2 : 64;
+        re->nfa = realloc(re->nfa, sizeof(regexState) * re->cap);
+    }
+    regexState *st = &re->nfa[re->n];
+    st->op = op;
+    st->out = -1;
+    st->out1 = -1;
+    memset(st->set, 0, sizeof(st->set));
+    return re->n++;
+}
+
+regexFrag regexFragment(regexParser *ps, int op) {
+    regexFrag f;
+    f.start = regexNewState(ps, op);
+    f.end = op == RX_EMPTY ? f.start : regexNewState(ps, RX_EMPTY);
+    if (f.start != f.end) ps->re->nfa[f.start].out = f.end;
+    return f;
+}
+
+regexFrag regexConcat(regexParser *ps, regexFrag a, regexFrag b) {
+    if (ps->reverse) {
+        regexFrag t = a;
+        a = b;
+        b = t;
+    }
+    ps->re->nfa[a.end].out = b.start;
+    a.end = b.end;
+    return a;
+}
+
+regexFrag regexAlt(regexParser *ps, regexFrag a, regexFrag b) {
+    regexFrag f = regexFragment(ps, RX_SPLIT);
+    regex *re = ps->re;
+    re->nfa[f.start].out = a.start;
+    re->nfa[f.start].out1 = b.start;
+    re->nfa[a.end].out = f.end;
+    re->nfa[b.end].out = f.end;
+    return f;
+}
+
+// kind is '*', '+' or '?'.
+regexFrag regexRepeat(regexParser *ps, regexFrag a, int kind) {
+    regexFrag f = regexFragment(ps, RX_SPLIT);
+    regex *re = ps->re;
+    re->nfa[f.start].out = a.start;
+    re->nfa[f.start].out1 = f.end;
+    if (kind == '?') {
+        re->nfa[a.end].out = f.end;
+        return f;
+    }
+    re->nfa[a.end].out = f.start;
+    if (kind == '+') f.start = a.start;
+    return f;
+}
+
+int regexEscapeByte(int c) {
+    switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default: return c;
+    }
+}
+
+// Adds the bytes of \d, \w, \s or their upper case complements to set.
+// Returns 0 if c isn't one of those.
+int regexClassEscape(unsigned char *set, int c) {
+    int lower = tolower(c);
+    if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+    int j;
+    for (j = 0; j < 256; j++) {
+        int in = lower == 'd' ? isdigit(j) : lower == 'w' ? isalnum(j) || j == '_' : isspace(j);
+        if ((in != 0) == (islower(c) != 0)) regexSetAdd(set, j);
+    }
+    return 1;
+}
+
+// Parses a bracket expression; the '[' has already been consumed.
+regexFrag regexParseClass(regexParser *ps) {
+    unsigned char set[32] = {0};
+    int negate = 0;
+    if (ps->pos < ps->len && ps->s[ps->pos] == '^') {
+        negate = 1;
+        ps->pos++;
+    }
+
+    int first = 1;
+    while (1) {
+        if (ps->pos == ps->len) {
+            ps->error = "missing ]";
+            break;
+        }
+        int c = (unsigned char) ps->s[ps->pos++];
+        // A ']' right after the '[' is taken literally.
+        if (c == ']' && !first) break;
+        first = 0;
+        if (c == '\\' && ps->pos < ps->len) {
+            c = (unsigned char) ps->s[ps->pos++];
+            if (regexClassEscape(set, c)) continue;
+            c = regexEscapeByte(c);
+        }
+
+        int hi = c;
+        if (ps->pos + 1 < ps->len && ps->s[ps->pos] == '-' && ps->s[ps->pos + 1] != ']') {
+            hi = (unsigned char) ps->s[ps->pos + 1];
+            ps->pos += 2;
+            if (hi == '\\' && ps->pos < ps->len) hi = regexEscapeByte((unsigned char) ps->s[ps->pos++]);
+            if (hi < c) {
+                ps->error = "bad range";
+                break;
+            }
+        }
+        for (; c <= hi; c++) regexSetAdd(set, c);
+    }
+
+    int j;
+    if (negate)
+        for (j = 0; j < 32; j++) set[j] = ~set[j];
+    regexFrag f = regexFragment(ps, RX_CHAR);
+    memcpy(ps->re->nfa[f.start].set, set, sizeof(set));
+    return f;
+}
+
+regexFrag regexParseAlt(regexParser *ps);
+
+regexFrag regexParseAtom(regexParser *ps) {
+    int c = (unsigned char) ps->s[ps->pos++];
+    regexFrag f;
+    switch (c) {
+        case '(':
+            f = regexParseAlt(ps);
+            if (ps->pos < ps->len && ps->s[ps->pos] == ')') ps->pos++;
+            else if (!ps->error) ps->error = "missing )";
+            return f;
+        case '[':
+            return regexParseClass(ps);
+        case '^':
+            return regexFragment(ps, ps->reverse ? RX_EOL : RX_BOL);
+        case '$':
+            return regexFragment(ps, ps->reverse ? RX_BOL : RX_EOL);
+        case '.':
+            f = regexFragment(ps, RX_CHAR);
+            memset(ps->re->nfa[f.start].set, 0xff, 32);
+            return f;
+        case '\\':
+            if (ps->pos == ps->len) {
+                ps->error = "trailing \\";
+                return regexFragment(ps, RX_EMPTY);
+            }
+            c = (unsigned char) ps->s[ps->pos++];
+            f = regexFragment(ps, RX_CHAR);
+            if (!regexClassEscape(ps->re->nfa[f.start].set, c))
+                regexSetAdd(ps->re->nfa[f.start].set, regexEscapeByte(c));
+            return f;
+        default:
+            f = regexFragment(ps, RX_CHAR);
+            regexSetAdd(ps->re->nfa[f.start].set, c);
+            return f;
+    }
+}
+
+// Parses "{m}", "{m,}" or "{m,n}" at ps->pos. max is -1 for no upper
+// bound. Returns 0, and consumes nothing, if the brace isn't a count.
+int regexParseBraces(regexParser *ps, int *min, int *max) {
+    const char *s = ps->s;
+    int pos = ps->pos + 1;
+    int val[2] = {0, -1};
+    int k;
+    for (k = 0; k < 2; k++) {
+        int digits = 0;
+        int v = 0;
+        while (pos < ps->len && isdigit((unsigned char) s[pos])) {
+            if (v <= YIM_REGEX_MAX_REPEAT) v = v * 10 + s[pos] - '0';
+            pos++;
+            digits++;
+        }
+        if (k == 0) {
+            if (!digits) return 0;
+            val[0] = val[1] = v;
+            if (pos < ps->len && s[pos] == ',') {
+                pos++;
+                val[1] = -1;
+                continue;
+            }
+            break;
+        }
+        if (digits) val[1] = v;
+    }
+    if (pos == ps->len || s[pos] != '}') return 0;
+    ps->pos = pos + 1;
+
+    if (val[0] > YIM_REGEX_MAX_REPEAT || val[1] > YIM_REGEX_MAX_REPEAT ||
+            (val[1] != -1 && val[1] < val[0]))
+        ps->error = "bad repeat count";
+    *min = val[0];
+    *max = val[1];
+    return 1;
+}
+
+regexFrag regexParseRepeat(regexParser *ps);
+
+// Builds x{min,max} by chaining copies of x. x is the text in
+// ps->s[from..to) and f is the copy of it that has already been built;
+// the others are made by parsing that text again.
+regexFrag regexCopies(regexParser *ps, int from, int to, regexFrag f, int min, int max) {
+    regexFrag out = regexFragment(ps, RX_EMPTY);
+    int total = max == -1 ? min + 1 : max;
+    int k;
+    for (k = 0; k < total && !ps->error; k++) {
+        regexFrag x = f;
+        if (k > 0) {
+            regexParser sub = *ps;
+            sub.pos = from;
+            sub.len = to;
+            x = regexParseRepeat(&sub);
+            ps->error = sub.error;
+        }
+        if (k >= min) x = regexRepeat(ps, x, max == -1 ? '*' : '?');
+        out = regexConcat(ps, out, x);
+    }
+    return out;
+}
+
+regexFrag regexParseRepeat(regexParser *ps) {
+    int from = ps->pos;
+    regexFrag f = regexParseAtom(ps);
+    while (ps->pos < ps->len && !ps->error) {
+        int c = ps->s[ps->pos];
+        int to = ps->pos;
+        int min, max;
+        if (c == '*' || c == '+' || c == '?') {
+            ps->pos++;
+            f = regexRepeat(ps, f, c);
+        }
+        else if (c == '{' && regexParseBraces(ps, &min, &max)) {
+            if (!ps->error) f = regexCopies(ps, from, to, f, min, max);
+        }
+        else {
+            break;
+        }
+    }
+    return f;
+}
+
+regexFrag regexParseConcat(regexParser *ps) {
+    regexFrag f = regexFragment(ps, RX_EMPTY);
+    while (ps->pos < ps->len && !ps->error && ps->s[ps->pos] != '|' && ps->s[ps->pos] != ')') {
+        int c = ps->s[ps->pos];
+        if (c == '*' || c == '+' || c == '?') {
+            ps->error = "nothing to repeat";
+            break;
+        }
+        f = regexConcat(ps, f, regexParseRepeat(ps));
+    }
+    return f;
+}
+
+regexFrag regexParseAlt(regexParser *ps) {
+    regexFrag f = regexParseConcat(ps);
+    while (ps->pos < ps->len && !ps->error && ps->s[ps->pos] == '|') {
+        ps->pos++;
+        f = regexAlt(ps, f, regexParseConcat(ps));
+    }
+    return f;
+}
+
+void regexNextMark(regex *re) {
+    if (++re->markgen == 0) {
+        memset(re->mark, 0, sizeof(unsigned int) * re->n);
+        re->markgen = 1;
+    }
+}
+
+// Adds every state reachable from state i without consuming a byte to
+// out (if it isn't NULL), skipping states already marked since the last
+// regexNextMark(). "^" is passed only when bol is set and "$" only when
+// eol is; otherwise "$" stays in the set to be checked at the end of the
+// row. Returns 1 if the match state was reached.
+int regexClosure(regex *re, int i, int bol, int eol, int *out, int *n) {
+    int matched = 0;
+    int sp = 0;
+    re->stack[sp++] = i;
+    while (sp) {
+        i = re->stack[--sp];
+        if (re->mark[i] == re->markgen) continue;
+        re->mark[i] = re->markgen;
+
+        regexState *st = &re->nfa[i];
+        if (st->op == RX_SPLIT) {
+            re->stack[sp++] = st->out1;
+            re->stack[sp++] = st->out;
+        }
+        else if (st->op == RX_EMPTY || (st->op == RX_BOL && bol) || (st->op == RX_EOL && eol)) {
+            re->stack[sp++] = st->out;
+        }
+        else if (st->op != RX_BOL) {
+            if (st->op == RX_MATCH) matched = 1;
+            if (out) out[(*n)++] = i;
+        }
+    }
+    return matched;
+}
+
+int regexCmpInt(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+void regexDfaInit(regexDfa *d, int leftmost) {
+    d->states = malloc(sizeof(regexDState *) * YIM_REGEX_DFA_STATES);
+    d->n = 0;
+    d->hashcap = 1;
+    while (d->hashcap < 2 * YIM_REGEX_DFA_STATES) d->hashcap *= 2;
+    d->hash = malloc(sizeof(int) * d->hashcap);
+    memset(d->hash, -1, sizeof(int) * d->hashcap);
+    d->start[0] = d->start[1] = -1;
+    d->leftmost = leftmost;
+}
+
+void regexDfaFlush(regexDfa *d) {
+    int j;
+    for (j = 0; j < d->n; j++) {
+        free(d->states[j]->set);
+        free(d->states[j]);
+    }
+    d->n = 0;
+    if (d->hash) memset(d->hash, -1, sizeof(int) * d->hashcap);
+    d->start[0] = d->start[1] = -1;
+    d->flushes++;
+}
+
+// Returns the DFA state for a set of NFA states, creating it if needed,
+// or -1 if the cache is full.
+int regexDfaLookup(regex *re, regexDfa *d, int *set, int n) {
+    unsigned int h = 2166136261u;
+    int j;
+    for (j = 0; j < n; j++) h = (h ^ set[j]) * 16777619u;
+    h &= d->hashcap - 1;
+    while (d->hash[h] != -1) {
+        regexDState *ds = d->states[d->hash[h]];
+        if (ds->n == n && memcmp(ds->set, set, sizeof(int) * n) == 0) return d->hash[h];
+        h = (h + 1) & (d->hashcap - 1);
+    }
+    if (d->n == YIM_REGEX_DFA_STATES) return -1;
+
+    regexDState *ds = malloc(sizeof(regexDState));
+    ds->set = malloc(sizeof(int) * (n ? n : 1));
+    memcpy(ds->set, set, sizeof(int) * n);
+    ds->n = n;
+    ds->accept = 0;
+    regexNextMark(re);
+    ds->accepteol = 0;
+    for (j = 0; j < n; j++) {
+        if (set[j] < 0) continue;
+        if (re->nfa[set[j]].op == RX_MATCH) ds->accept = 1;
+        if (regexClosure(re, set[j], 0, 1, NULL, NULL)) ds->accepteol = 1;
+    }
+    memset(ds->next, -1, sizeof(ds->next));
+    d->hash[h] = d->n;
+    d->states[d->n] = ds;
+    return d->n++;
+}
+
+// Looks up the set in re->scratch, starting over with an empty cache
+// when it's full.
+int regexDfaIntern(regex *re, regexDfa *d, int n) {
+    int idx = regexDfaLookup(re, d, re->scratch, n);
+    if (idx == -1) {
+        regexDfaFlush(d);
+        idx = regexDfaLookup(re, d, re->scratch, n);
+    }
+    return idx;
+}
+
+// Appends the group of a match beginning here to re->scratch. Only byte
+// states are kept; the others could only end an empty match.
+void regexDfaBegin(regex *re, int bol, int *n) {
+    int group = *n;
+    int k = group;
+    int j;
+    regexClosure(re, re->start, bol, 0, re->scratch, n);
+    for (j = group; j < *n; j++)
+        if (re->nfa[re->scratch[j]].op == RX_CHAR) re->scratch[k++] = re->scratch[j];
+    *n = k;
+    if (k == group) return;
+    qsort(re->scratch + group, k - group, sizeof(int), regexCmpInt);
+    re->scratch[(*n)++] = RX_GROUP;
+}
+
+int regexDfaStart(regex *re, regexDfa *d, int bol) {
+    if (d->start[bol] == -1) {
+        int n = 0;
+        regexNextMark(re);
+        if (d->leftmost) {
+            re->scratch[n++] = RX_OPEN;
+            regexDfaBegin(re, bol, &n);
+        }
+        else {
+            regexClosure(re, re->start, bol, 0, re->scratch, &n);
+            qsort(re->scratch, n, sizeof(int), regexCmpInt);
+        }
+        int idx = regexDfaIntern(re, d, n);
+        d->start[bol] = idx;
+    }
+    return d->start[bol];
+}
+
+// The slow path of a DFA step: works out the transition on byte c and
+// remembers it. In a leftmost DFA a state already reached from an
+// earlier start is left out of later groups, and the first group to
+// reach a match drops the groups after it.
+int regexDfaNext(regex *re, regexDfa *d, int cur, int c) {
+    regexDState *ds = d->states[cur];
+    int n = 0;
+    int j;
+    regexNextMark(re);
+    if (!d->leftmost) {
+        for (j = 0; j < ds->n; j++) {
+            regexState *st = &re->nfa[ds->set[j]];
+            if (st->op == RX_CHAR && regexSetHas(st->set, c))
+                regexClosure(re, st->out, 0, 0, re->scratch, &n);
+        }
+        qsort(re->scratch, n, sizeof(int), regexCmpInt);
+    }
+    else {
+        int open = ds->set[0] == RX_OPEN;
+        int group = ++n;
+        int matched = 0;
+        for (j = 1; j < ds->n; j++) {
+            int i = ds->set[j];
+            if (i != RX_GROUP) {
+                regexState *st = &re->nfa[i];
+                if (st->op == RX_CHAR && regexSetHas(st->set, c))
+                    matched |= regexClosure(re, st->out, 0, 0, re->scratch, &n);
+                continue;
+            }
+            if (n == group) continue;
+            qsort(re->scratch + group, n - group, sizeof(int), regexCmpInt);
+            re->scratch[n++] = RX_GROUP;
+            group = n;
+            if (matched) {
+                open = 0;
+                break;
+            }
+        }
+        re->scratch[0] = open ? RX_OPEN : RX_CLOSED;
+        if (open) regexDfaBegin(re, 0, &n);
+    }
+
+    int before = d->n;
+    int idx = regexDfaIntern(re, d, n);
+    // Unless the cache was just flushed, which frees ds.
+    if (d->n >= before) ds->next[c] = idx;
+    return idx;
+}
+
+// Returns where the leftmost non-empty match in s[from..len) ends, taking
+// the longest one that starts there, or -1 if there's no match.
+//
+// The DFA is deterministic, so a scan that comes to a checkpoint in the
+// state an earlier scan of the same text was in there goes on exactly as
+// that one did, and takes its last match end instead of going over the
+// rest of the row again. With resume unset the checkpoints start over.
+int regexLeftmostEnd(regex *re, const char *s, int len, int from, int resume) {
+    regexDfa *d = &re->dfa;
+    int k;
+    if (!resume || re->trails != s || re->traillen != len || re->trailflushes != d->flushes) {
+        int n = len / RX_TRAIL + 1;
+        if (n > re->trailcap) {
+            re->trailcap = n;
+            re->trail = realloc(re->trail, sizeof(int) * 2 * n);
+        }
+        for (k = 0; k < n; k++) re->trail[2 * k] = -1;
+        re->trails = s;
+        re->traillen = len;
+        re->trailflushes = d->flushes;
+    }
+
+    int cur = regexDfaStart(re, d, from == 0);
+    int best = -1;
+    int i;
+    for (i = from; ; i++) {
+        // A full cache renumbers the states, which leaves the checkpoints
+        // no good.
+        if (i % RX_TRAIL == 0 && re->trailflushes == d->flushes) {
+            int *cp = &re->trail[2 * (i / RX_TRAIL)];
+            if (cp[0] == cur) {
+                if (cp[1] >= i) best = cp[1];
+                break;
+            }
+            cp[0] = cur;
+        }
+        regexDState *ds = d->states[cur];
+        if (ds->accept || (i == len && ds->accepteol)) best = i;
+        // Nothing is left running and no new match may begin.
+        if (i == len || (ds->n == 1 && ds->set[0] == RX_CLOSED)) break;
+        unsigned char c = s[i];
+        cur = ds->next[c] != -1 ? ds->next[c] : regexDfaNext(re, d, cur, c);
+    }
+
+    // Otherwise the checkpoints passed learn where the scan ended.
+    if (re->trailflushes != d->flushes) {
+        re->trails = NULL;
+        return best;
+    }
+    for (k = (from + RX_TRAIL - 1) / RX_TRAIL; k <= i / RX_TRAIL; k++)
+        re->trail[2 * k + 1] = best >= k * RX_TRAIL ? best : -1;
+    return best;
+}
+
+// Runs the reversed pattern back from end and returns the earliest
+// position at or after from where a non-empty match ending at end
+// begins, or -1.
+int regexMatchStart(regex *rev, const char *s, int len, int from, int end) {
+    regexDfa *d = &rev->dfa;
+    int cur = regexDfaStart(rev, d, end == len);
+    int best = -1;
+    int i;
+    for (i = end; ; i--) {
+        regexDState *ds = d->states[cur];
+        if (i < end && (ds->accept || (i == 0 && ds->accepteol))) best = i;
+        if (i == from || ds->n == 0) break;
+        unsigned char c = s[i - 1];
+        cur = ds->next[c] != -1 ? ds->next[c] : regexDfaNext(rev, d, cur, c);
+    }
+    return best;
+}
+
+// See regexFind() and regexFindNext().
+int regexFindFrom(regex *re, const char *s, int len, int from, int *end, int resume) {
+    if (from > len) return -1;
+    if (re->prefixlen) {
+        const char *hit = memmem(s + from, len - from, re->prefix, re->prefixlen);
+        if (hit == NULL) return -1;
+        from = hit - s;
+    }
+
+    int e = regexLeftmostEnd(re, s, len, from, resume);
+    if (e == -1) return -1;
+    *end = e;
+    return regexMatchStart(re->reverse, s, len, from, e);
+}
+
+// Finds the leftmost non-empty match in s[from..len), taking the longest
+// one that starts there. Returns its offset and sets *end, or returns -1.
+// One pass forward finds where it ends and one back finds where it
+// begins, so no byte is looked at more than twice.
+//
+// Finding a longest match may mean reading on to the end of the row to
+// see that it can't get any longer: "a|a*b" does on a row of a's. Going
+// from match to match with regexFindNext() that is done once, not for
+// each match. The worst case left is a pattern whose scans keep coming
+// to the checkpoints in states other than the last scan's, which still
+// takes as long as the matches times the row.
+int regexFind(regex *re, const char *s, int len, int from, int *end) {
+    return regexFindFrom(re, s, len, from, end, 0);
+}
+
+// Like regexFind(), for the next match in the same s, which mustn't have
+// changed since the last regexFind() or regexFindNext() on it.
+int regexFindNext(regex *re, const char *s, int len, int from, int *end) {
+    return regexFindFrom(re, s, len, from, end, 1);
+}
+
+void regexFree(regex *re) {
+    if (re == NULL) return;
+    regexDfaFlush(&re->dfa);
+    free(re->dfa.states);
+    free(re->dfa.hash);
+    regexFree(re->reverse);
+    free(re->nfa);
+    free(re->prefix);
+    free(re->stack);
+    free(re->mark);
+    free(re->scratch);
+    free(re->trail);
+    free(re);
+}
+
+regex *regexBuild(const char *pattern, int len, int reverse, const char **error) {
+    regex *re = calloc(1, sizeof(regex));
+    regexParser ps = { re, pattern, len, 0, NULL, reverse };
+    regexFrag f = regexParseAlt(&ps);
+    if (!ps.error && ps.pos < len) ps.error = "unmatched )";
+    int match = regexNewState(&ps, RX_MATCH);
+    if (ps.error) {
+        *error = ps.error;
+        regexFree(re);
+        return NULL;
+    }
+    re->nfa[f.end].out = match;
+    re->start = f.start;
+
+    re->stack = malloc(sizeof(int) * (2 * re->n + 1));
+    re->mark = calloc(re->n, sizeof(unsigned int));
+    // A leftmost DFA state also holds its flag and the group ends.
+    re->scratch = malloc(sizeof(int) * (2 * re->n + 1));
+    regexDfaInit(&re->dfa, !reverse);
+    return re;
+}
+
+// Returns NULL and sets *error if the pattern doesn't parse.
+regex *regexCompile(const char *pattern, int len, const char **error) {
+    regex *re = regexBuild(pattern, len, 0, error);
+    if (re == NULL) return NULL;
+    re->reverse = regexBuild(pattern, len, 1, error);
+    if (re->reverse == NULL) {
+        regexFree(re);
+        return NULL;
+    }
+
+    // Follow the NFA from the start for as long as there is exactly one
+    // byte it can go on with. Those bytes begin every match, so memmem()
+    // can skip straight to them.
+    re->prefix = malloc(256);
+    int i = re->start;
+    int bol = 1;
+    int n, c;
+    while (re->prefixlen < 255) {
+        n = 0;
+        regexNextMark(re);
+        if (regexClosure(re, i, bol, 0, re->scratch, &n) || n != 1) break;
+        regexState *st = &re->nfa[re->scratch[0]];
+        if (st->op != RX_CHAR) break;
+        int only = -1;
+        for (c = 0; c < 256; c++) {
+            if (!regexSetHas(st->set, c)) continue;
+            if (only != -1) break;
+            only = c;
+        }
+        if (only == -1 || c < 256) break;
+        re->prefix[re->prefixlen++] = only;
+        i = st->out;
+        bol = 0;
+    }
+    return re;
+}
+
+/*---------- Search ----------*/
+
+// Rough ranking of how common each byte is in text and code. Lower is
+// rarer. Used to pick which needle byte memchr() should look for.
+int searchByteRank(unsigned char c) {
+    if (c == ' ' || c == 'e' || c == 't' || c == 'a' || c == 'o' || c == 'i' || c == 'n') return 5;
+    if (islower(c)) return 4;
+    if (isdigit(c) || c == '\t' || c == '_' || c == '.' || c == ',') return 3;
+    if (isupper(c) || ispunct(c)) return 2;
+    return 1;
+}
+
+void searchPatternFree(searchPattern *p) {
+    free(p->needle);
+    regexFree(p->re);
+    p->needle = NULL;
+    p->re = NULL;
+}
+
+// Compiles needle as a literal string, or as a regular expression if
+// isregex is set. A regular expression that doesn't compile matches
+// nothing and leaves the reason in p->error.
+void searchCompile(searchPattern *p, const char *needle, int len, int isregex) {
+    searchPatternFree(p);
+    p->needle = malloc(len + 1);
+    memcpy(p->needle, needle, len);
+    p->needle[len] = '\0';
+    p->len = len;
+    p->rare = 0;
+    p->error = NULL;
+    if (isregex && len > 0) {
+        p->re = regexCompile(needle, len, &p->error);
+        return;
+    }
+    int j;
+    for (j = 1; j < len; j++) {
+        if (searchByteRank(needle[j]) < searchByteRank(needle[p->rare])) p->rare = j;
+    }
+}
+
+// Returns the offset of the first match in s[from..len), or -1. *matchend
+// is set to where the match ends.
+int searchFind(searchPattern *p, const char *s, int len, int from, int *matchend) {
+    if (p->re) return regexFind(p->re, s, len, from, matchend);
+    if (p->error) return -1;
+
+    int n = p->len;
+    if (n == 0 || len - from < n) return -1;
+
+    const char *needle = p->needle;
+    char rarec = needle[p->rare];
+    char lastc = needle[n - 1];
+    // Candidate positions for the rare byte, so that a full match still fits.
+    const char *cur = s + from + p->rare;
+    const char *end = s + len - (n - 1 - p->rare);
+    while (cur < end) {
+        const char *hit = memchr(cur, rarec, end - cur);
+        if (hit == NULL) return -1;
+        const char *start = hit - p->rare;
+        if (start[n - 1] == lastc && memcmp(start, needle, n) == 0) {
+            *matchend = start - s + n;
+            return start - s;
+        }
+        cur = hit + 1;
+    }
+    return -1;
+}
+
+// Like searchFind(), for the next match in the same s, which mustn't have
+// changed since, see regexFindNext().
+int searchFindNext(searchPattern *p, const char *s, int len, int from, int *matchend) {
+    if (p->re) return regexFindNext(p->re, s, len, from, matchend);
+    return searchFind(p, s, len, from, matchend);
+}
+
+// Returns the offset of the last match that starts before "before", or -1.
+// Like searchCount(), this only counts matches that don't overlap.
+int searchFindLast(searchPattern *p, const char *s, int len, int before) {
+    int last = -1;
+    int end;
+    int at = searchFind(p, s, len, 0, &end);
+    while (at != -1 && at < before) {
+        last = at;
+        at = searchFindNext(p, s, len, end, &end);
+    }
+    return last;
+}
+
+long long searchCount(searchPattern *p, const char *s, int len) {
+    long long n = 0;
+    int end;
+    int at = searchFind(p, s, len, 0, &end);
+    while (at != -1) {
+        n++;
+        at = searchFindNext(p, s, len, end, &end);
+    }
+    return n;
+}
+
+void searchAddRow(int at) {
+    struct searchState *st = &E.search;
+    if (st->nrows == YIM_SEARCH_MAX_ROWS) {
+        st->complete = 0;
+        return;
+    }
+    if (st->nrows == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 256;
+        st->rows = realloc(st->rows, sizeof(int) * st->cap);
+    }
+    st->rows[st->nrows++] = at;
+}
+
+// Recomputes the list of rows that contain a match. When the previous
+// query is a prefix of the new one, every match of the new query starts
+// at a match of the old one, so only the rows already on the list are
+// checked again.
+void searchUpdateRows(int extended) {
+    struct searchState *st = &E.search;
+    searchPattern *p = &st->pat;
+
+    st->matches = 0;
+    if (extended && st->complete) {
+        int kept = 0;
+        int j;
+        for (j = 0; j < st->nrows; j++) {
+            erow *row = editorRowAt(st->rows[j]);
+            long long n = searchCount(p, row->chars, row->size);
+            if (n) {
+                st->rows[kept++] = st->rows[j];
+                st->matches += n;
+            }
+        }
+        st->nrows = kept;
+        return;
+    }
+
+    st->nrows = 0;
+    st->complete = 1;
+    rowIter it;
+    erow *row;
+    int at = 0;
+    rowIterSeek(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        long long n = searchCount(p, row->chars, row->size);
+        if (n) {
+            searchAddRow(at);
+            st->matches += n;
+        }
+        at++;
+    }
+}
+
+// Moves to the next match after (or the previous one before) the given
+// position, wrapping around the end of the buffer. Returns 0 if there
+// is no match anywhere.
+int searchStep(int fromrow, int fromcol, int dir) {
+    struct searchState *st = &E.search;
+    searchPattern *p = &st->pat;
+    int end;
+    if (E.numrows == 0) return 0;
+    if (fromrow >= E.numrows) {
+        fromrow = E.numrows - 1;
+        fromcol = editorRowAt(fromrow)->size;
+    }
+
+    // Another match on the same row?
+    erow *row = editorRowAt(fromrow);
+    int col = dir > 0 ? searchFind(p, row->chars, row->size, fromcol, &end)
+                      : searchFindLast(p, row->chars, row->size, fromcol);
+    if (col != -1) {
+        st->matchrow = fromrow;
+        st->matchcol = col;
+        return 1;
+    }
+
+    int target = -1;
+    if (st->complete) {
+        // Binary search the row list for the neighbouring row.
+        if (st->nrows == 0) return 0;
+        int lo = 0, hi = st->nrows;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (st->rows[mid] <= fromrow) lo = mid + 1;
+            else hi = mid;
+        }
+        if (dir > 0) {
+            target = lo < st->nrows ? st->rows[lo] : st->rows[0];
+        }
+        else {
+            int k = lo - 1;
+            if (k >= 0 && st->rows[k] == fromrow) k--;
+            target = k >= 0 ? st->rows[k] : st->rows[st->nrows - 1];
+        }
+    }
+    else {
+        // Too many matching rows to list, so they must be close by.
+        int at = fromrow;
+        int n;
+        for (n = 0; n < E.numrows; n++) {
+            at = (at + dir + E.numrows) % E.numrows;
+            row = editorRowAt(at);
+            if (searchFind(p, row->chars, row->size, 0, &end) != -1) {
+                target = at;
+                break;
+            }
+        }
+        if (target == -1) return 0;
+    }
+
+    row = editorRowAt(target);
+    col = dir > 0 ? searchFind(p, row->chars, row->size, 0, &end)
+                  : searchFindLast(p, row->chars, row->size, row->size);
+    if (col == -1) return 0;
+    st->matchrow = target;
+    st->matchcol = col;
+    return 1;
+}
+
+// Large buffers are searched in the background, see searchJob.
+
+void searchShardAdd(searchShard *sh, int at) {
+    if (sh->nrows == sh->cap) {
+        sh->cap = sh->cap ? sh->cap * 2 : 256;
+        sh->rows = realloc(sh->rows, sizeof(int) * sh->cap);
+    }
+    sh->rows[sh->nrows++] = at;
+}
+
+void *searchWorker(void *arg) {
+    searchJob *job = arg;
+    // A regex builds its DFA as it goes, so each worker needs its own.
+    searchPattern local = {0};
+    searchPattern *p = &job->pat;
+    if (job->pat.re) {
+        searchCompile(&local, job->pat.needle, job->pat.len, 1);
+        p = &local;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int k = job->cancel ? job->nshards : job->nextshard++;
+        int record = !job->overflow;
+        pthread_mutex_unlock(&job->lock);
+        if (k >= job->nshards) break;
+
+        searchShard *sh = &job->shards[k];
+        int from = k * YIM_SEARCH_SHARD;
+        int to = from + YIM_SEARCH_SHARD < job->numrows ? from + YIM_SEARCH_SHARD : job->numrows;
+        int at = (job->origin + from) % job->numrows;
+        rowIter it;
+        rowIterSeekIn(&it, job->snap, job->numrows, at);
+
+        int cancelled = 0;
+        int n;
+        for (n = from; n < to; n++) {
+            if (at == job->numrows) {
+                at = 0;
+                rowIterSeekIn(&it, job->snap, job->numrows, 0);
+            }
+            erow *row = rowIterNext(&it);
+            long long count = searchCount(p, row->chars, row->size);
+            if (count) {
+                sh->matches += count;
+                if (record) searchShardAdd(sh, at);
+                // Matches left of the cursor on its own row come last.
+                int end;
+                if (sh->first == -1 && (n != 0 ||
+                        searchFind(p, row->chars, row->size, job->origincol, &end) != -1))
+                    sh->first = at;
+            }
+            at++;
+
+            if ((n & 4095) == 4095) {
+                pthread_mutex_lock(&job->lock);
+                cancelled = job->cancel;
+                pthread_mutex_unlock(&job->lock);
+                if (cancelled) break;
+            }
+        }
+        if (cancelled) break;
+
+        pthread_mutex_lock(&job->lock);
+        sh->done = 1;
+        job->shardsdone++;
+        job->listed += sh->nrows;
+        if (job->listed > YIM_SEARCH_MAX_ROWS) job->overflow = 1;
+        pthread_mutex_unlock(&job->lock);
+        write(job->notify, "s", 1);
+    }
+    searchPatternFree(&local);
+    return NULL;
+}
+
+// Cancels the background search, if there is one, and waits for its
+// workers to notice. They check every few thousand rows, so this is quick.
+void searchJobStop() {
+    struct searchState *st = &E.search;
+    searchJob *job = st->job;
+    if (job == NULL) return;
+
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    pthread_mutex_unlock(&job->lock);
+    int j;
+    for (j = 0; j < job->nthreads; j++) pthread_join(job->threads[j], NULL);
+
+    rowNodeRelease(job->snap);
+    for (j = 0; j < job->nshards; j++) free(job->shards[j].rows);
+    free(job->shards);
+    free(job->threads);
+    searchPatternFree(&job->pat);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    st->job = NULL;
+
+    char buf[64];
+    while (read(st->notify[0], buf, sizeof(buf)) > 0);
+}
+
+// Returns 0 if no worker thread could be started.
+int searchJobStart() {
+    struct searchState *st = &E.search;
+    searchJobStop();
+    if (st->notify[0] == -1) {
+        if (pipe(st->notify) == -1) die("pipe");
+        fcntl(st->notify[0], F_SETFL, O_NONBLOCK);
+        fcntl(st->notify[1], F_SETFL, O_NONBLOCK);
+    }
+
+    searchJob *job = calloc(1, sizeof(searchJob));
+    pthread_mutex_init(&job->lock, NULL);
+    job->snap = rowTreeSnapshot();
+    job->numrows = E.numrows;
+    job->origin = st->saved_cy < E.numrows ? st->saved_cy : 0;
+    job->origincol = st->saved_cy < E.numrows ? st->saved_cx : 0;
+    searchCompile(&job->pat, st->pat.needle, st->pat.len, st->regex);
+    job->nshards = (E.numrows + YIM_SEARCH_SHARD - 1) / YIM_SEARCH_SHARD;
+    job->shards = calloc(job->nshards, sizeof(searchShard));
+    int j;
+    for (j = 0; j < job->nshards; j++) job->shards[j].first = -1;
+    job->notify = st->notify[1];
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    job->nthreads = ncpu < 1 ? 1 : ncpu;
+    if (job->nthreads > YIM_SEARCH_THREADS_MAX) job->nthreads = YIM_SEARCH_THREADS_MAX;
+    if (job->nthreads > job->nshards) job->nthreads = job->nshards;
+    job->threads = malloc(sizeof(pthread_t) * job->nthreads);
+    for (j = 0; j < job->nthreads; j++) {
+        if (pthread_create(&job->threads[j], NULL, searchWorker, job) != 0) {
+            job->nthreads = j;
+            break;
+        }
+    }
+    st->job = job;
+    if (job->nthreads == 0) {
+        searchJobStop();
+        return 0;
+    }
+    return 1;
+}
+
+// Picks up whatever the workers have found since the last call: the
+// running count, the nearest match once the shards before it are done,
+// and the full list of matching rows once every shard is. Returns 1 if
+// the screen needs to be redrawn.
+int editorSearchPoll() {
+    struct searchState *st = &E.search;
+    searchJob *job = st->job;
+    if (job == NULL) return 0;
+
+    char buf[64];
+    while (read(st->notify[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&job->lock);
+    int finished = job->shardsdone == job->nshards;
+    long long matches = 0;
+    int nearest = -1;
+    int nearestknown = 1;
+    int k;
+    for (k = 0; k < job->nshards; k++) {
+        searchShard *sh = &job->shards[k];
+        if (!sh->done) {
+            nearestknown = 0;
+            continue;
+        }
+        matches += sh->matches;
+        if (nearestknown && nearest == -1 && sh->first != -1) nearest = sh->first;
+    }
+    if (nearest != -1) nearestknown = 1;
+    pthread_mutex_unlock(&job->lock);
+    st->matches = matches;
+
+    if (st->matchrow == -1 && nearestknown && (nearest != -1 || matches)) {
+        // Nothing after the cursor means the only matches are on the
+        // cursor's row, to the left of it.
+        int col, end;
+        erow *row;
+        if (nearest == -1) {
+            nearest = job->origin;
+            row = editorRowAt(nearest);
+            col = searchFind(&st->pat, row->chars, row->size, 0, &end);
+        }
+        else {
+            row = editorRowAt(nearest);
+            col = searchFind(&st->pat, row->chars, row->size,
+                    nearest == job->origin ? job->origincol : 0, &end);
+        }
+        if (col != -1) {
+            st->matchrow = E.cy = nearest;
+            st->matchcol = E.cx = col;
+            E.rowoff = E.numrows;
+        }
+    }
+
+    if (finished) {
+        // The shards hold their rows in order starting at the cursor;
+        // rotate them back into buffer order.
+        st->nrows = 0;
+        st->complete = !job->overflow;
+        if (st->complete) {
+            for (k = 0; k < job->nshards; k++) {
+                searchShard *sh = &job->shards[k];
+                int j;
+                for (j = 0; j < sh->nrows; j++) searchAddRow(sh->rows[j]);
+            }
+            int split = 0;
+            while (split < st->nrows && st->rows[split] >= job->origin) split++;
+            if (split > 0 && split < st->nrows) {
+                int *sorted = malloc(sizeof(int) * st->nrows);
+                memcpy(sorted, &st->rows[split], sizeof(int) * (st->nrows - split));
+                memcpy(&sorted[st->nrows - split], st->rows, sizeof(int) * split);
+                free(st->rows);
+                st->rows = sorted;
+                st->cap = st->nrows;
+            }
+        }
+        searchJobStop();
+    }
+    return 1;
+}
+
+// Marks the cells of every match in a row that is being drawn.
+void editorHighlightMatches(screenLine *line, erow *row, int coloff) {
+    searchPattern *p = &E.search.pat;
+    int end;
+    int at = searchFind(p, row->chars, row->size, 0, &end);
+    while (at != -1) {
+        int from = editorRowCxToRx(row, at) - coloff;
+        int to = editorRowCxToRx(row, end) - coloff;
+        if (from < 0) from = 0;
+        if (to > line->len) to = line->len;
+        if (from < to) memset(&line->hl[from], HL_MATCH, to - from);
+        at = searchFindNext(p, row->chars, row->size, end, &end);
+    }
+}
+
+void editorFindCallback(char *query, int key) {
+    struct searchState *st = &E.search;
+
+    if (key == '\r' || key == '\x1b') {
+        searchJobStop();
+        st->active = 0;
+        E.hlgen++;
+        return;
+    }
+
+    int qlen = strlen(query);
+    int dir;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        dir = 1;
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP) {
+        dir = -1;
+    }
+    else {
+        if (st->pat.needle && qlen == st->pat.len && memcmp(query, st->pat.needle, qlen) == 0) return;
+        // Adding to a regex can make it match more ("ab" to "ab|c"), so
+        // only plain strings get to reuse the previous rows.
+        int extended = !st->regex && st->pat.needle && st->pat.len > 0 && qlen > st->pat.len &&
+                       memcmp(query, st->pat.needle, st->pat.len) == 0;
+        // Whatever is still running was for the old query.
+        searchJobStop();
+        searchCompile(&st->pat, query, qlen, st->regex);
+        E.hlgen++;
+        st->matchrow = -1;
+        if (qlen == 0) {
+            st->active = 0;
+            st->nrows = 0;
+            st->matches = 0;
+            return;
+        }
+        st->active = 1;
+
+        // Small buffers, and short lists of rows left over from the
+        // previous query, are searched right here. Everything else goes to
+        // the worker threads and the results come in through
+        // editorSearchPoll().
+        if (E.numrows >= 2 * YIM_SEARCH_SHARD &&
+                !(extended && st->complete && st->nrows <= YIM_SEARCH_SHARD)) {
+            st->complete = 0;
+            st->nrows = 0;
+            st->matches = 0;
+            if (searchJobStart()) return;
+            extended = 0;
+        }
+        searchUpdateRows(extended);
+
+        // A changed query looks again from where the search started.
+        if (searchStep(st->saved_cy, st->saved_cx, 1)) {
+            E.cy = st->matchrow;
+            E.cx = st->matchcol;
+            E.rowoff = E.numrows;
+        }
+        return;
+    }
+
+    if (!st->active || st->matchrow == -1) return;
+    if (searchStep(st->matchrow, st->matchcol + (dir > 0 ? 1 : 0), dir)) {
+        E.cy = st->matchrow;
+        E.cx = st->matchcol;
+        // Scrolls the match to the top of the screen.
+        E.rowoff = E.numrows;
+    }
+}
+
+void editorFind(int regex) {
+    struct searchState *st = &E.search;
+    st->regex = regex;
+    st->saved_cx = E.cx;
+    st->saved_cy = E.cy;
+    st->saved_coloff = E.coloff;
+    st->saved_rowoff = E.rowoff;
+    st->saved_wrapoff = E.wrapoff;
+    st->matchrow = -1;
+    st->nrows = 0;
+    st->complete = 0;
+    st->matches = 0;
+    if (st->pat.needle) searchCompile(&st->pat, "", 0, 0);
+
+    char *query = editorPrompt(regex ? "Regex search: %s (Use ESC/Arrows/Enter)"
+                                     : "Search: %s (Use ESC/Arrows/Enter)", editorFindCallback, 0);
+    if (query) {
+        free(query);
+    }
+    else {
+        E.cx = st->saved_cx;
+        E.cy = st->saved_cy;
+        E.coloff = st->saved_coloff;
+        E.rowoff = st->saved_rowoff;
+        E.wrapoff = st->saved_wrapoff;
+    }
+}
+
+// Appends to a growable buffer used to build rows.
+void editorBufAppend(char **buf, size_t *len, size_t *cap, const char *s, size_t n) {
+    // Empty pieces may come with a NULL s, which memcpy() doesn't allow.
+    if (n == 0) return;
+    if (*len + n > *cap) {
+        while (*len + n > *cap) *cap = *cap ? *cap * 2 : 256;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+}
+
+// Replaces every match of a regular expression in the buffer. In the
+// replacement, "&" stands for the matched text and \& for a plain "&".
+// Each row is rebuilt once with all of its replacements and then handed
+// to editorRowSetString(), so the row update and the dirty count happen
+// once per changed row however many matches it has.
+void editorReplace() {
+    char *query = editorPrompt("Replace regex: %s (ESC to cancel)", NULL, 0);
+    if (query == NULL) return;
+    searchPattern pat = {0};
+    searchCompile(&pat, query, strlen(query), 1);
+    free(query);
+    if (pat.error) {
+        editorSetStatusMessage("Bad regex: %s", pat.error);
+        searchPatternFree(&pat);
+        return;
+    }
+    char *with = editorPrompt("Replace with: %s (& is the match, ESC to cancel)", NULL, 1);
+    if (with == NULL) {
+        searchPatternFree(&pat);
+        return;
+    }
+    size_t withlen = strlen(with);
+
+    char *buf = NULL;
+    size_t len, cap = 0;
+    long long replaced = 0;
+    int rows = 0;
+    int at = 0;
+    rowIter it;
+    erow *row;
+    rowIterSeek(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        int end;
+        int col = searchFind(&pat, row->chars, row->size, 0, &end);
+        if (col == -1) {
+            at++;
+            continue;
+        }
+
+        len = 0;
+        int done = 0;
+        while (col != -1) {
+            editorBufAppend(&buf, &len, &cap, &row->chars[done], col - done);
+            size_t j;
+            for (j = 0; j < withlen; j++) {
+                if (with[j] == '&') {
+                    editorBufAppend(&buf, &len, &cap, &row->chars[col], end - col);
+                }
+                else {
+                    if (with[j] == '\\' && j + 1 < withlen && (with[j + 1] == '&' || with[j + 1] == '\\')) j++;
+                    editorBufAppend(&buf, &len, &cap, &with[j], 1);
+                }
+            }
+            replaced++;
+            done = end;
+            col = searchFindNext(&pat, row->chars, row->size, end, &end);
+        }
+        editorBufAppend(&buf, &len, &cap, &row->chars[done], row->size - done);
+
+        editorRowSetString(at, buf, len);
+        rows++;
+        at++;
+        // editorRowAtMut() may have copied the nodes the iterator is on.
+        rowIterSeek(&it, at);
+    }
+    free(buf);
+    free(with);
+    searchPatternFree(&pat);
+
+    if (E.cy < E.numrows) {
+        row = editorRowAt(E.cy);
+        if (E.cx > row->size) E.cx = row->size;
+    }
+    editorSetStatusMessage("Replaced %lld matches on %d lines", replaced, rows);
+}
+
+/*---------- Append Buffer ----------*/
 // The append buffer gets rid of the need to call a bunch of small write()s.
 // This is important because this allows the program to update the whole screen at once.
 // Otherwise, there could be several small unpredicatable pauses between write()s, causing
 // an annoying flicker effect.
+// The buffer is meant to be kept around and abReset() between frames, so
+// once it has grown to the size of a typical frame no more memory is
+// allocated. Longer runs of text are not copied in at all: abAppendRef()
+// records a pointer to them and abWrite() hands everything to writev().
+typedef struct abSeg {
+    const char *ext; // NULL for bytes stored in b itself.
+    int off;
+    int len;
+} abSeg;
+
 struct abuf {
     char* b;
     int len;
+    int cap;
+    abSeg *seg;
+    int nseg;
+    int segcap;
+    struct iovec *iov;
+    int total; // Bytes queued, both copied and referenced.
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0, NULL, 0, 0, NULL, 0}
+// Text shorter than this is cheaper to copy than to give its own iovec.
+#define AB_REF_MIN 32
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    // Creating a block of memory that is the size of the current string
-    // plus the size of the string that we are appending.
-    char *new = realloc(ab->b, ab->len + len);
+abSeg *abNewSeg(struct abuf *ab) {
+    if (ab->nseg == ab->segcap) {
+        ab->segcap = ab->segcap ? ab->segcap * 2 : 64;
+        ab->seg = realloc(ab->seg, sizeof(abSeg) * ab->segcap);
+        ab->iov = realloc(ab->iov, sizeof(struct iovec) * ab->segcap);
+        if (ab->seg == NULL || ab->iov == NULL) die("realloc");
+    }
+    return &ab->seg[ab->nseg++];
+}
+
+// Makes room for len more bytes in b and returns where they go.
+char *abReserve(struct abuf *ab, int len) {
+    if (ab->len + len > ab->cap) {
+        int newcap = ab->cap ? ab->cap : 4096;
+        while (newcap < ab->len + len) newcap *= 2;
+        char *new = realloc(ab->b, newcap);
+        if (new == NULL) die("realloc");
+        ab->b = new;
+        ab->cap = newcap;
+    }
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    abSeg *last = ab->nseg ? &ab->seg[ab->nseg - 1] : NULL;
+    if (last && last->ext == NULL && last->off + last->len == ab->len) {
+        last->len += len;
+    }
+    else {
+        last = abNewSeg(ab);
+        last->ext = NULL;
+        last->off = ab->len;
+        last->len = len;
+    }
+    char *p = &ab->b[ab->len];
     ab->len += len;
+    ab->total += len;
+    return p;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (len <= 0) return;
+    STAT_ADD(bytes, len);
+    memcpy(abReserve(ab, len), s, len);
+}
+
+// Queues s without copying it. It has to stay valid until abWrite().
+void abAppendRef(struct abuf *ab, const char *s, int len) {
+    if (len < AB_REF_MIN) {
+        abAppend(ab, s, len);
+        return;
+    }
+    abSeg *seg = abNewSeg(ab);
+    seg->ext = s;
+    seg->off = 0;
+    seg->len = len;
+    ab->total += len;
+    STAT_ADD(bytes, len);
+}
+
+void abReset(struct abuf *ab) {
+    ab->len = 0;
+    ab->nseg = 0;
+    ab->total = 0;
+}
+
+// Writes out everything queued with as few writev() calls as possible.
+int abWrite(struct abuf *ab, int fd) {
+    int j;
+    for (j = 0; j < ab->nseg; j++) {
+        abSeg *seg = &ab->seg[j];
+        ab->iov[j].iov_base = (char *) (seg->ext ? seg->ext : &ab->b[seg->off]);
+        ab->iov[j].iov_len = seg->len;
+    }
+
+    if (writevAll(fd, ab->iov, ab->nseg) == -1) return -1;
+    return ab->total;
 }
 
 void abFree(struct abuf *ab) {
     free(ab->b);
+    free(ab->seg);
+    free(ab->iov);
+}
+
+/*---------- Screen Buffer ----------*/
+// Runs of at least this many blanks are erased instead of written out.
+#define SCREEN_BLANK_MIN 8
+// Frames are drawn line by line into E.scratch and compared against
+// E.screen. Only the span of cells that differs is sent, preceded by a
+// cursor move, so typing a character costs a few bytes instead of a
+// whole screen.
+
+void screenLineClear(screenLine *line) {
+    line->len = 0;
+    line->cell[0] = 0;
+    line->row = NULL;
+}
+
+void screenLineInit(screenLine *line) {
+    line->cap = E.screencols + 16;
+    line->chars = malloc(line->cap);
+    line->cell = malloc(sizeof(int) * (E.screencols + 1));
+    line->hl = malloc(E.screencols + 1);
+    screenLineClear(line);
+}
+
+void screenLineFree(screenLine *line) {
+    free(line->chars);
+    free(line->cell);
+    free(line->hl);
+}
+
+void editorScreenResize(int rows, int cols) {
+    int rewrap = E.wrap && cols != E.screencols;
+    int j;
+    if (E.screen) {
+        for (j = 0; j < E.screenlines; j++) screenLineFree(&E.screen[j]);
+        screenLineFree(&E.scratch);
+    }
+
+    E.screenrows = rows;
+    E.screencols = cols;
+    E.screenlines = rows + 2 + STAT_LINES;
+    E.screen = realloc(E.screen, sizeof(screenLine) * E.screenlines);
+    for (j = 0; j < E.screenlines; j++) screenLineInit(&E.screen[j]);
+    screenLineInit(&E.scratch);
+    E.screenvalid = 0;
+    if (rewrap && E.rows) rowTreeRewrap(E.rows);
+}
+
+// Makes room for n more bytes of cell text.
+void screenLineReserve(screenLine *line, int n) {
+    int need = line->cell[line->len] + n;
+    if (need <= line->cap) return;
+    while (line->cap < need) line->cap *= 2;
+    line->chars = realloc(line->chars, line->cap);
+    if (line->chars == NULL) die("realloc");
+}
+
+// Adds a cell holding the n bytes at s, which are w columns wide. A wide
+// character is followed by an empty cell for its right half. One that
+// doesn't fit at the right edge is shown as a blank.
+void screenLinePut(screenLine *line, const char *s, int n, int w, int hl) {
+    if (line->len + w > E.screencols) {
+        if (w == 2 && line->len < E.screencols) screenLinePut(line, " ", 1, 1, hl);
+        return;
+    }
+    screenLineReserve(line, n);
+    int at = line->cell[line->len];
+    memcpy(&line->chars[at], s, n);
+    line->hl[line->len++] = hl;
+    if (w == 2) {
+        line->cell[line->len] = at + n;
+        line->hl[line->len++] = hl;
+    }
+    line->cell[line->len] = at + n;
+}
+
+// Adds a zero width character to the last cell, or rather to the
+// character it shows.
+void screenLineJoin(screenLine *line, const char *s, int n) {
+    if (line->len == 0) return;
+    screenLineReserve(line, n);
+    int end = line->cell[line->len];
+    memcpy(&line->chars[end], s, n);
+    // Keep the right half of a wide character empty.
+    if (line->cell[line->len - 1] == end) line->cell[line->len - 1] += n;
+    line->cell[line->len] += n;
+}
+
+// Writes UTF-8 text at the end of a line, clipped to the screen width.
+void screenLineAppend(screenLine *line, const char *s, int len, int hl) {
+    int i = 0;
+    while (i < len && line->len < E.screencols) {
+        int cp;
+        int n = utf8Decode(&s[i], len - i, &cp);
+        int w = utf8Width(cp);
+        if (utf8IsControl(cp)) screenLinePut(line, "?", 1, 1, hl);
+        else if (w == 0) screenLineJoin(line, &s[i], n);
+        else screenLinePut(line, &s[i], n, w, hl);
+        i += n;
+    }
+}
+
+// Writes len bytes that are known to be one column each.
+void screenLineAppendPlain(screenLine *line, const char *s, int len, int hl) {
+    if (len > E.screencols - line->len) len = E.screencols - line->len;
+    if (len <= 0) return;
+    screenLineReserve(line, len);
+    int at = line->cell[line->len];
+    memcpy(&line->chars[at], s, len);
+    memset(&line->hl[line->len], hl, len);
+    int j;
+    for (j = 1; j <= len; j++) line->cell[line->len + j] = at + j;
+    line->len += len;
+}
+
+void screenLineFill(screenLine *line, char c, int len, int hl) {
+    if (len > E.screencols - line->len) len = E.screencols - line->len;
+    if (len <= 0) return;
+    screenLineReserve(line, len);
+    int at = line->cell[line->len];
+    memset(&line->chars[at], c, len);
+    memset(&line->hl[line->len], hl, len);
+    int j;
+    for (j = 1; j <= len; j++) line->cell[line->len + j] = at + j;
+    line->len += len;
+}
+
+// Cells past the end of a line are blank.
+int screenCellEqual(screenLine *a, screenLine *b, int x) {
+    const char *ac = " ";
+    const char *bc = " ";
+    int an = 1, bn = 1;
+    int ah = HL_NORMAL, bh = HL_NORMAL;
+    if (x < a->len) {
+        ac = &a->chars[a->cell[x]];
+        an = a->cell[x + 1] - a->cell[x];
+        ah = a->hl[x];
+    }
+    if (x < b->len) {
+        bc = &b->chars[b->cell[x]];
+        bn = b->cell[x + 1] - b->cell[x];
+        bh = b->hl[x];
+    }
+    return an == bn && ah == bh && memcmp(ac, bc, an) == 0;
+}
+
+int screenCellIsBlank(screenLine *line, int x) {
+    return line->cell[x + 1] - line->cell[x] == 1 && line->chars[line->cell[x]] == ' ' &&
+        line->hl[x] == HL_NORMAL;
+}
+
+// Counts the plain blanks starting at x, looking at no more than max cells.
+int screenBlankRun(screenLine *line, int x, int stop, int max) {
+    int n = 0;
+    while (x + n < stop && n < max && screenCellIsBlank(line, x + n)) n++;
+    return n;
+}
+
+int editorHighlightEscape(int hl, char *buf) {
+    switch (hl) {
+        // Every sequence starts with a reset so it doesn't matter which
+        // attribute was active before.
+        case HL_STATUS: memcpy(buf, "\x1b[0;7m", 6); return 6;
+        case HL_MATCH: memcpy(buf, "\x1b[0;34m", 7); return 7;
+        case HL_COMMENT: memcpy(buf, "\x1b[0;36m", 7); return 7;
+        case HL_KEYWORD1: memcpy(buf, "\x1b[0;33m", 7); return 7;
+        case HL_KEYWORD2: memcpy(buf, "\x1b[0;32m", 7); return 7;
+        case HL_STRING: memcpy(buf, "\x1b[0;35m", 7); return 7;
+        case HL_NUMBER: memcpy(buf, "\x1b[0;31m", 7); return 7;
+        case HL_PREPROC: memcpy(buf, "\x1b[0;1m", 6); return 6;
+        default: memcpy(buf, "\x1b[m", 3); return 3;
+    }
+}
+
+void editorTermMove(struct abuf *ab, int y, int x) {
+    if (E.termy == y && E.termx == x) return;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+    E.termy = y;
+    E.termx = x;
+}
+
+void editorTermAttr(struct abuf *ab, int hl) {
+    if (E.termhl == hl) return;
+    char buf[16];
+    abAppend(ab, buf, editorHighlightEscape(hl, buf));
+    E.termhl = hl;
+}
+
+// Sends whatever is needed to turn screen line y into the contents of
+// E.scratch, then makes E.scratch the new shadow copy of that line.
+void editorFlushLine(struct abuf *ab, int y) {
+    screenLine *nl = &E.scratch;
+    screenLine *ol = &E.screen[y];
+    int maxlen = nl->len > ol->len ? nl->len : ol->len;
+
+    int first = 0;
+    while (first < maxlen && screenCellEqual(nl, ol, first)) first++;
+    if (first < maxlen) {
+        int last = maxlen - 1;
+        while (last > first && screenCellEqual(nl, ol, last)) last--;
+
+        editorTermMove(ab, y, first);
+        int stop = last < nl->len ? last + 1 : nl->len;
+        // Never stop between the two halves of a wide character.
+        while (stop < nl->len && nl->cell[stop] == nl->cell[stop + 1]) stop++;
+        int x = first;
+        while (x < stop) {
+            // Long stretches of blanks are erased with ECH and skipped over
+            // with CUF rather than sent as spaces.
+            int blank = screenBlankRun(nl, x, stop, stop - x);
+            if (blank >= SCREEN_BLANK_MIN) {
+                char buf[32];
+                editorTermAttr(ab, HL_NORMAL);
+                abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%dX\x1b[%dC", blank, blank));
+                x += blank;
+                continue;
+            }
+
+            // Cells with the same attribute go out as one run. The line
+            // buffer becomes the shadow copy below and isn't touched again
+            // this frame, so the run can be referenced instead of copied.
+            int run = x;
+            while (run < stop && nl->hl[run] == nl->hl[x] &&
+                    screenBlankRun(nl, run, stop, SCREEN_BLANK_MIN) < SCREEN_BLANK_MIN) run++;
+            editorTermAttr(ab, nl->hl[x]);
+            abAppendRef(ab, &nl->chars[nl->cell[x]], nl->cell[run] - nl->cell[x]);
+            x = run;
+        }
+        E.termx = x > first ? x : first;
+        if (last >= nl->len) {
+            editorTermAttr(ab, HL_NORMAL);
+            abAppend(ab, "\x1b[K", 3);
+        }
+    }
+
+    // Swap the buffers instead of copying the line.
+    screenLine old = *ol;
+    *ol = *nl;
+    nl->chars = old.chars;
+    nl->cap = old.cap;
+    nl->cell = old.cell;
+    nl->hl = old.hl;
+}
+
+void screenLineReverse(int from, int to) {
+    while (from < --to) {
+        screenLine tmp = E.screen[from];
+        E.screen[from++] = E.screen[to];
+        E.screen[to] = tmp;
+    }
+}
+
+// Where the top of the screen is: a line of the file, or with wrapping a
+// screen line of the wrapped text.
+long long editorScreenTop() {
+    return E.wrap ? rowTreeWrapOffset(E.rowoff) + E.wrapoff : E.rowoff;
+}
+
+// When the view moved by only a few rows, let the terminal shift the
+// lines that are still visible instead of sending them again.
+void editorScrollScreen(struct abuf *ab) {
+    long long moved = editorScreenTop() - E.drawntop;
+    if (moved == 0 || moved >= E.screenrows / 2 || -moved >= E.screenrows / 2) return;
+    int d = moved;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+    editorTermAttr(ab, HL_NORMAL);
+    abAppend(ab, buf, len);
+    len = snprintf(buf, sizeof(buf), "\x1b[%d%c", d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    abAppend(ab, "\x1b[r", 3);
+    // Setting the scroll region homes the cursor.
+    E.termy = 0;
+    E.termx = 0;
+
+    // Shift the shadow lines the same way. The ones scrolled in are blank.
+    // Rotating by three reversals keeps this free of allocations.
+    int n = d > 0 ? d : -d;
+    int mid = d > 0 ? n : E.screenrows - n;
+    screenLineReverse(0, mid);
+    screenLineReverse(mid, E.screenrows);
+    screenLineReverse(0, E.screenrows);
+    int from = d > 0 ? E.screenrows - n : 0;
+    int j;
+    for (j = from; j < from + n; j++) screenLineClear(&E.screen[j]);
+}
+
+#ifdef YIM_STATS
+/*---------- Stats ----------*/
+// What the counters gathered in the hot paths add up to. Ctrl-P shows
+// them in a line below the message bar, and if YIM_STATS_FILE is set they
+// are written there at exit.
+
+void statsFrame(long long ns, int bytes) {
+    S.frames++;
+    S.frametime += ns;
+    S.lastframe = ns;
+    if (ns > S.framemax) S.framemax = ns;
+    S.lastbytes = bytes;
+}
+
+// Memory taken by the rows and the tree that holds them, leaving out the
+// caches hanging off rows.
+long long statsRowMemory() {
+    long long mem = E.rows ? rowNodeBytes(E.rows) : 0;
+    mem += (long long) E.numrows * (sizeof(erow) + 1);
+    mem += (long long) S.nodes * sizeof(rowNode);
+    if (E.gaprow) mem += E.gaprow->gaplen;
+    return mem;
+}
+
+double statsPerKey(long long n) {
+    return S.keys ? (double) n / S.keys : 0;
+}
+
+double statsHitRate() {
+    return S.lines ? 100.0 * S.linehits / S.lines : 0;
+}
+
+void editorDrawStatsBar(struct abuf *ab) {
+    screenLine *line = &E.scratch;
+    screenLineClear(line);
+    char buf[160];
+    int len = snprintf(buf, sizeof(buf),
+            "frame %.1fus max %.1fus %dB | %.1f syscalls/key | %lld mallocs | "
+            "rows %.1fMB | line cache %.0f%%",
+            S.lastframe / 1000.0, S.framemax / 1000.0, S.lastbytes,
+            statsPerKey(S.syscalls), S.mallocs,
+            statsRowMemory() / 1048576.0, statsHitRate());
+    if (len > (int) sizeof(buf) - 1) len = sizeof(buf) - 1;
+    screenLineAppend(line, buf, len, HL_STATUS);
+    screenLineFill(line, ' ', E.screencols - line->len, HL_STATUS);
+    editorFlushLine(ab, E.screenrows + 2);
+}
+
+void statsDump() {
+    char *path = getenv("YIM_STATS_FILE");
+    if (path == NULL) return;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return;
+    fprintf(fp, "keys %lld\n", S.keys);
+    fprintf(fp, "frames %lld\n", S.frames);
+    fprintf(fp, "frame_avg_us %.1f\n", S.frames ? S.frametime / 1000.0 / S.frames : 0);
+    fprintf(fp, "frame_max_us %.1f\n", S.framemax / 1000.0);
+    fprintf(fp, "bytes %lld\n", S.bytes);
+    fprintf(fp, "bytes_per_frame %.1f\n", S.frames ? (double) S.bytes / S.frames : 0);
+    fprintf(fp, "syscalls %lld\n", S.syscalls);
+    fprintf(fp, "syscalls_per_key %.2f\n", statsPerKey(S.syscalls));
+    fprintf(fp, "mallocs %lld\n", S.mallocs);
+    fprintf(fp, "row_updates %lld\n", S.rowupdates);
+    fprintf(fp, "row_memory %lld\n", statsRowMemory());
+    fprintf(fp, "row_nodes %d\n", S.nodes);
+    fprintf(fp, "line_cache_hits %lld\n", S.linehits);
+    fprintf(fp, "line_cache_lookups %lld\n", S.lines);
+    fprintf(fp, "line_cache_hit_rate %.1f\n", statsHitRate());
+    fclose(fp);
 }
+#endif
 
 /*---------- Output Functions -----------*/
 void editorScroll() {
+    // Lines above the floor of the viewer can't be reached from its end yet.
+    if (E.view.anchored && !E.view.exact) {
+        if (E.cy < E.view.floor) {
+            E.cy = E.view.floor;
+            E.cx = 0;
+        }
+        if (E.rowoff < E.view.floor) E.rowoff = E.view.floor;
+    }
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
+    if (E.wrap) {
+        // Scroll by screen lines of the wrapped text instead of by rows.
+        long long cur = rowTreeWrapOffset(E.cy) + E.rx / E.screencols;
+        long long top = editorScreenTop();
+        if (cur < top) top = cur;
+        if (cur >= top + E.screenrows) top = cur - E.screenrows + 1;
+        E.rowoff = rowTreeFindWrap(top, &E.wrapoff);
+        E.coloff = 0;
+        return;
+    }
     if (E.cy < E.rowoff) {
         E.rowoff = E.cy;
     }
     if (E.cy >= E.rowoff + E.screenrows) {
         E.rowoff = E.cy - E.screenrows + 1;
     }
-    if (E.cx < E.coloff) {
+    if (E.rx < E.coloff) {
         E.coloff = E.rx;
     }
-    if (E.cx >= E.coloff + E.screencols) {
+    if (E.rx >= E.coloff + E.screencols) {
         E.coloff = E.rx - E.screencols + 1;
     }
 }
 
+// Draws a row from column coloff on into a line. Only the characters
+// that show up on screen are looked at, however long the row is.
+void editorDrawRow(screenLine *line, erow *row, int coloff) {
+    unsigned char *hl = E.syntax ? row->hl : NULL;
+    if (editorRowIsPlain(row)) {
+        int len = row->size - coloff;
+        if (len <= 0) return;
+        if (len > E.screencols) len = E.screencols;
+        // The window may have the gap in the middle of it.
+        int head = row->gap - coloff;
+        if (row->gaplen == 0 || head <= 0 || head >= len) {
+            screenLineAppendPlain(line, &row->chars[coloff + (head <= 0 ? row->gaplen : 0)], len, HL_NORMAL);
+        } else {
+            screenLineAppendPlain(line, &row->chars[coloff], head, HL_NORMAL);
+            screenLineAppendPlain(line, &row->chars[row->gap + row->gaplen], len - head, HL_NORMAL);
+        }
+        if (hl) memcpy(line->hl, &hl[coloff], line->len);
+        return;
+    }
+
+    int rx;
+    int cx = editorRowRxToCx(row, coloff, &rx);
+    int end = coloff + E.screencols;
+    while (cx < row->size && rx <= end) {
+        int cp;
+        char buf[4];
+        int avail;
+        const char *c = editorRowPeek(row, cx, buf, &avail);
+        int n = utf8Decode(c, avail, &cp);
+        int w = cp == '\t' ? YIM_TAB_STOP - rx % YIM_TAB_STOP : utf8Width(cp);
+        int h = hl ? hl[cx] : HL_NORMAL;
+        // Tabs and wide characters can start left of the screen.
+        int visible = rx < coloff ? rx + w - coloff : w;
+        if (cp == '\t' || rx < coloff) screenLineFill(line, ' ', visible, h);
+        else if (w == 0) screenLineJoin(line, c, n);
+        else if (utf8IsControl(cp)) screenLinePut(line, "?", 1, 1, h);
+        else screenLinePut(line, c, n, w, h);
+        cx += n;
+        rx += w;
+    }
+}
+
 // This is the function to draw "~" like defualt vim does.
+// With wrapping a row goes on over as many screen lines as it needs, each
+// one drawn like a row scrolled sideways by a whole screen width.
 void editorDrawRows(struct abuf *ab) {
+    rowIter it;
+    rowIterSeek(&it, E.rowoff);
+    int state = E.syntax ? editorSyntaxStateAt(E.rowoff) : SYN_NORMAL;
+    int filerow = E.rowoff;
+    int seg = E.wrap ? E.wrapoff : 0;
+    erow *row = NULL;
+    int start = state;
     int y;
     for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
+        screenLine *line = &E.scratch;
+        screenLineClear(line);
+        if (row && (!E.wrap || ++seg >= it.wraps)) {
+            row = NULL;
+            filerow++;
+            seg = 0;
+        }
         if (filerow >= E.numrows) {
             if (E.numrows == 0 && y == E.screenrows / 3) {
                 // Displaying welcome message
@@ -507,90 +7026,148 @@ void editorDrawRows(struct abuf *ab) {
                 // Centering the welcome message
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    screenLineAppend(line, "~", 1, HL_NORMAL);
                     padding--;
                 }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                screenLineFill(line, ' ', padding, HL_NORMAL);
+                screenLineAppend(line, welcome, welcomelen, HL_NORMAL);
             }
             else {
-                abAppend(ab, "~", 1);
+                screenLineAppend(line, "~", 1, HL_NORMAL);
             }
         }
         else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff],len);
+            if (row == NULL) {
+                row = rowIterNext(&it);
+                start = state;
+                if (E.syntax) {
+                    state = editorSyntaxRow(row, start, 1);
+                    if (E.hlclean == filerow) E.hlclean = filerow + 1;
+                }
+            }
+            int coloff = E.wrap ? seg * E.screencols : E.coloff;
+            screenLine *shown = &E.screen[y];
+            STAT_ADD(lines, 1);
+            // Nothing to do if this exact version of the row is already on screen.
+            if (shown->row == row && shown->gen == row->gen && shown->coloff == coloff &&
+                    shown->hlgen == E.hlgen && shown->hlstate == start) {
+                STAT_ADD(linehits, 1);
+                continue;
+            }
+
+            editorDrawRow(line, row, coloff);
+            if (E.search.active) editorHighlightMatches(line, row, coloff);
+            line->row = row;
+            line->gen = row->gen;
+            line->coloff = coloff;
+            line->hlgen = E.hlgen;
+            line->hlstate = start;
         }
 
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+        editorFlushLine(ab, y);
     }
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
+    screenLine *line = &E.scratch;
+    screenLineClear(line);
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
             E.filename ? E.filename : "[No Name]", E.numrows,
-            E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-            E.cy + 1, E.numrows);
-    if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        }
-        else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+            E.view.on ? "(read-only)" : E.dirty ? "(modified)" : "",
+            E.follow.on ? " (following)" : "");
+    int rlen;
+    long long offset = editorCursorOffset();
+    if (E.search.active && E.search.pat.error)
+        rlen = snprintf(rstatus, sizeof(rstatus), "bad regex: %s | %d/%d",
+                E.search.pat.error, E.cy + 1, E.numrows);
+    else if (E.search.active)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%lld matches%s | %d/%d",
+                E.search.matches, E.search.job ? "..." : "", E.cy + 1, E.numrows);
+    else if (E.view.on && viewProgress() < 100)
+        rlen = snprintf(rstatus, sizeof(rstatus), "indexed %d%% | byte %lld | %s%d/%d",
+                viewProgress(), offset,
+                E.view.anchored && !E.view.exact ? "~" : "", E.cy + 1, E.numrows);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | byte %lld | %d/%d",
+                E.syntax ? E.syntax->filetype : "no ft", offset, E.cy + 1, E.numrows);
+    screenLineAppend(line, status, len, HL_STATUS);
+    if (E.screencols - line->len >= rlen) {
+        screenLineFill(line, ' ', E.screencols - line->len - rlen, HL_STATUS);
+        screenLineAppend(line, rstatus, rlen, HL_STATUS);
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    else {
+        screenLineFill(line, ' ', E.screencols - line->len, HL_STATUS);
+    }
+    editorFlushLine(ab, E.screenrows);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+    screenLine *line = &E.scratch;
+    screenLineClear(line);
     int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    if (msglen && time(NULL) - E.statusmsg_time < YIM_MSG_TIMEOUT)
+        screenLineAppend(line, E.statusmsg, msglen, HL_NORMAL);
+    editorFlushLine(ab, E.screenrows + 1);
 }
 
 void editorRefreshScreen() {
-    editorScroll();
+    // The frame buffer lives across refreshes and is only reset.
+    static struct abuf ab = ABUF_INIT;
+#ifdef YIM_STATS
+    long long start = editorNowNs();
+#endif
 
-    struct abuf ab = ABUF_INIT;
+    editorScroll();
+    abReset(&ab);
 
+    // The cursor is hidden while the frame is drawn so it doesn't flicker
+    // around the screen.
     abAppend(&ab, "\x1b[?25l", 6);
-    // The 4 means we are writing 4 bytes to the terminal.
-    // "\x1b" is equal to 27 and it is the escape character.
-    // We are using VT100 escape sequences, and J is the erase
-    // in display. 2 tells it to clear the entire screen.
-    //abAppend(&ab, "\x1b[2J", 4);
-    // H is the Cursor position command
-    // This repositions the cursor back to the top-left corner.
-    abAppend(&ab, "\x1b[H", 3);
+    E.termhl = -1;
+    E.termx = -1;
+    E.termy = -1;
+
+    if (!E.screenvalid) {
+        // "\x1b" is the escape character and J is erase in display. 2
+        // tells it to clear the entire screen. The shadow lines are
+        // emptied to match.
+        abAppend(&ab, "\x1b[2J", 4);
+        int j;
+        for (j = 0; j < E.screenlines; j++) screenLineClear(&E.screen[j]);
+        E.screenvalid = 1;
+    }
+    else {
+        editorScrollScreen(&ab);
+    }
+    E.drawntop = editorScreenTop();
 
     editorDrawRows(&ab);
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
+#ifdef YIM_STATS
+    if (S.overlay) editorDrawStatsBar(&ab);
+#endif
+    editorTermAttr(&ab, HL_NORMAL);
 
     // Positions the cursor
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1);
+    if (E.wrap)
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+                (int) (rowTreeWrapOffset(E.cy) - editorScreenTop()) + E.rx / E.screencols + 1,
+                E.rx % E.screencols + 1);
+    else
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+                                                  (E.rx - E.coloff) + 1);
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    // Freeing the memory used by abuf
-    abFree(&ab);
+    abWrite(&ab, STDOUT_FILENO);
+    E.frame_bytes = ab.total;
+#ifdef YIM_STATS
+    statsFrame(editorNowNs() - start, ab.total);
+#endif
 }
 
 // The ... makes the function into a variadic function. This means that
@@ -604,7 +7181,10 @@ void editorSetStatusMessage(const char *fmt, ...) {
 }
 
 /*---------- Input Functions ----------*/
-char *editorPrompt(char *prompt) {
+// Asks for a line of input in the message bar. If a callback is given,
+// it is called after every key with the current input and the key.
+// Enter on an empty line is ignored unless allowempty is set.
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowempty) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
 
@@ -617,20 +7197,40 @@ char *editorPrompt(char *prompt) {
 
         int c = editorReadKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
+            // Take the whole UTF-8 sequence off.
+            while (buflen != 0 && ((unsigned char) buf[--buflen] & 0xc0) == 0x80);
+            buf[buflen] = '\0';
         }
         else if (c == '\x1b') {
             editorSetStatusMessage("");
+            if (callback) callback(buf, c);
             free(buf);
             return NULL;
         }
+        else if (c == PASTE_START) {
+            // Only the printable part of a paste makes sense in a prompt.
+            size_t len;
+            char *paste = editorReadPaste(&len);
+            size_t j;
+            for (j = 0; j < len; j++) {
+                if (iscntrl((unsigned char) paste[j])) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = paste[j];
+            }
+            buf[buflen] = '\0';
+            free(paste);
+        }
         else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || allowempty) {
                 editorSetStatusMessage("");
+                if (callback) callback(buf, c);
                 return buf;
             }
         }
-        else if (!iscntrl(c) && c < 128) {
+        else if (!iscntrl(c) && c < 256) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -638,26 +7238,47 @@ char *editorPrompt(char *prompt) {
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+
+        if (callback) callback(buf, c);
     }
 }
 
+// Puts the cursor on screen line pos of the wrapped text, on the character
+// at column x of it or the last one before that.
+void editorMoveToWrap(long long pos, int x) {
+    long long total = rowTreeWrapOffset(E.numrows);
+    if (pos < 0) pos = 0;
+    if (pos > total) pos = total;
+    int seg;
+    E.cy = rowTreeFindWrap(pos, &seg);
+    E.cx = 0;
+    erow *row = editorRowAt(E.cy);
+    if (row == NULL) return;
+    int from = seg * E.screencols;
+    int rx;
+    E.cx = editorRowRxToCx(row, from + x, &rx);
+    // A wide character cut in two by the edge of the screen counts as
+    // being on the line above.
+    if (rx < from) E.cx = editorRowNextGrapheme(row, E.cx);
+}
+
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
 
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) 
-                E.cx--;
+                E.cx = editorRowPrevGrapheme(row, E.cx);
             else if (E.cy > 0) {
                 // This lets the user press <- at the beginning of the line
                 // to move to the beginning of the previous line.
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size)
-                E.cx++;
+                E.cx = editorRowNextGrapheme(row, E.cx);
             else if (row && E.cx == row->size) {
                 // This lets the user press -> at the end of the line
                 // to move to the beginning of the next line.
@@ -666,28 +7287,124 @@ void editorMoveCursor(int key) {
             }
             break;
         case ARROW_UP:
-            if (E.cy != 0) 
-                E.cy--;
-            break;
         case ARROW_DOWN:
-            if (E.cy != E.numrows) 
-                E.cy++;
+            {
+                // Stay in the same screen column rather than at the same byte.
+                int rx = row ? editorRowCxToRx(row, E.cx) : 0;
+                if (E.wrap) {
+                    // Move a screen line at a time within a wrapped row.
+                    editorMoveToWrap(rowTreeWrapOffset(E.cy) + rx / E.screencols +
+                            (key == ARROW_UP ? -1 : 1), rx % E.screencols);
+                    break;
+                }
+                if (key == ARROW_UP && E.cy != 0) E.cy--;
+                if (key == ARROW_DOWN && E.cy != E.numrows) E.cy++;
+                row = editorRowAt(E.cy);
+                if (row) E.cx = editorRowRxToCx(row, rx, &rx);
+            }
             break;
     }
 
     // This snaps the cursor to the end of the line
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
     }
 }
 
+// Jumps to a line number, or with a "b" in front to a byte offset into
+// the file. Both are looked up in the row tree in O(log n).
+void editorGoto() {
+    char *query = editorPrompt("Go to line: %s (b<offset> for a byte offset, $ for the end, ESC to cancel)", NULL, 0);
+    if (query == NULL) return;
+
+    if (!strcmp(query, "$")) {
+        free(query);
+        if (E.view.on) viewEnd();
+        else E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+        return;
+    }
+    char *p = query;
+    int bytes = *p == 'b' || *p == 'B';
+    if (bytes) p++;
+    char *end;
+    errno = 0;
+    long long n = strtoll(p, &end, 10);
+    if (end == p || *end != '\0' || errno || n < 0) {
+        editorSetStatusMessage("Not a %s: %s", bytes ? "byte offset" : "line number", query);
+        free(query);
+        return;
+    }
+    free(query);
+
+    if (E.view.on) {
+        if (!viewGoto(n, bytes)) {
+            editorSetStatusMessage("Not indexed that far yet");
+            return;
+        }
+    }
+    else if (bytes) {
+        int col;
+        int line = rowTreeFindOffset(n, E.crlf ? 2 : 1, &col);
+        if (line == -1) {
+            editorSetStatusMessage("Byte offset %lld is past the end of the file", n);
+            return;
+        }
+        // Land on the start of the character the byte belongs to.
+        erow *row = editorRowAt(line);
+        int back = 0;
+        while (col > 0 && col < row->size && back++ < 3 &&
+                ((unsigned char) row->chars[col] & 0xc0) == 0x80) col--;
+        E.cy = line;
+        E.cx = col;
+    }
+    else {
+        E.cy = n < 1 ? 0 : n > E.numrows ? E.numrows - 1 : n - 1;
+        if (E.cy < 0) E.cy = 0;
+        E.cx = 0;
+    }
+    // Scrolls the target to the top of the screen.
+    E.rowoff = E.numrows;
+}
+
+// Turns wrapping of long lines on or off. The number of screen lines
+// each row takes is only kept up to date while it is on, so it is worked
+// out afresh for the whole buffer here.
+void editorToggleWrap() {
+    E.wrap = !E.wrap;
+    E.wrapoff = 0;
+    E.coloff = 0;
+    if (E.wrap && E.rows) rowTreeRewrap(E.rows);
+    editorSetStatusMessage(E.wrap ? "Wrapping long lines" : "Not wrapping long lines");
+}
+
 // This function waits for a keypress and then handles it.
+// Keys that leave a long row's gap where it is: typing, deleting and
+// moving about. Anything else may read rows as plain strings.
+int editorKeyKeepsGap(int c) {
+    switch (c) {
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+        case PAGE_UP:
+        case PAGE_DOWN:
+            return 1;
+    }
+    return E.undo.typing != 0;
+}
+
 void editorProcessKeypress() {
     static int quit_times = YIM_QUIT_TIMES;
 
     int c = editorReadKey();
+    undoBeginKey(c);
+    if (!editorKeyKeepsGap(c)) editorGapClose();
+    if (E.view.on && !viewAllowsKey(c)) return;
 
     switch (c) {
         case '\r':
@@ -701,6 +7418,7 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            swapRemove();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -710,13 +7428,53 @@ void editorProcessKeypress() {
             editorSave();
             break;
 
+        case CTRL_KEY('f'):
+            editorFind(0);
+            break;
+
+        case CTRL_KEY('g'):
+            editorFind(1);
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('t'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            break;
+
+        case CTRL_KEY('e'):
+            if (E.follow.on) followStop();
+            else followStart();
+            break;
+
+#ifdef YIM_STATS
+        case CTRL_KEY('p'):
+            S.overlay = !S.overlay;
+            editorHandleResize();
+            break;
+#endif
+
         case HOME_KEY:
             E.cx = 0;
             break;
 
         case END_KEY:
             if (E.cy < E.numrows)
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             break;
 
         case BACKSPACE:
@@ -731,17 +7489,28 @@ void editorProcessKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             {
+                // Jump a screen from the top (or bottom) line in one go
+                // rather than with a screenful of single steps. Keys are
+                // handled in batches between frames, so bring E.rowoff up
+                // to date with the previous one first.
+                editorScroll();
+                if (E.wrap) {
+                    long long top = editorScreenTop();
+                    editorMoveToWrap(c == PAGE_UP ? top - E.screenrows : top + 2 * E.screenrows - 1,
+                            E.rx % E.screencols);
+                    break;
+                }
                 if (c == PAGE_UP) {
-                    E.cy = E.rowoff;
+                    E.cy = E.rowoff - E.screenrows;
+                    if (E.cy < 0) E.cy = 0;
                 }
                 else if (c == PAGE_DOWN) {
-                    E.cy = E.rowoff + E.screenrows - 1;
+                    E.cy = E.rowoff + 2 * E.screenrows - 1;
                     if (E.cy > E.numrows) E.cy = E.numrows;
                 }
-
-                int times = E.screenrows;
-                while (times--)
-                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+                erow *row = editorRowAt(E.cy);
+                int rowlen = row ? row->size : 0;
+                if (E.cx > rowlen) E.cx = rowlen;
             }
             break;
 
@@ -752,8 +7521,18 @@ void editorProcessKeypress() {
             editorMoveCursor(c);
             break;
 
+        case PASTE_START:
+            {
+                size_t len;
+                char *paste = editorReadPaste(&len);
+                editorInsertText(paste, len);
+                free(paste);
+            }
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
+        case PASTE_END:
             break;
 
         default:
@@ -761,9 +7540,939 @@ void editorProcessKeypress() {
             break;
     }
 
+    undoEndKey();
     quit_times = YIM_QUIT_TIMES;
 }
 
+/*---------- Event Loop ----------*/
+// main() sleeps in poll() until a key, a resize or a timer is due, handles
+// every key that has arrived and only then draws a frame, and never draws
+// more than one frame per YIM_FRAME_MS.
+
+long long editorNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The same clock in nanoseconds, for measuring.
+long long editorNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void editorHandleResize() {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) return;
+    editorScreenResize(rows - 2 - STAT_LINES, cols);
+    E.redraw = 1;
+}
+
+// Milliseconds until the status message should disappear, or -1.
+int editorMessageTimeout() {
+    if (E.statusmsg[0] == '\0') return -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long expire = ((long long) E.statusmsg_time + YIM_MSG_TIMEOUT) * 1000;
+    long long now = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (now >= expire) return -1;
+    // time() can trail the clock by a tick, so wake up a little late.
+    return expire - now + 20;
+}
+
+// Blocks until there is input, a resize or news from a background search,
+// or timeout milliseconds pass (-1 waits forever). Reads the input in when
+// there is some. Returns 1 if the screen has to be redrawn.
+int editorWaitEvents(int timeout) {
+#ifdef YIM_HEADLESS
+    // There is nothing to wait for, the next key is always there.
+    (void) timeout;
+    return headlessNextKey();
+#else
+    struct pollfd fds[6];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = E.sigpipe[0];
+    fds[1].events = POLLIN;
+    // poll() skips negative descriptors.
+    fds[2].fd = E.search.job ? E.search.notify[0] : -1;
+    fds[2].events = POLLIN;
+    fds[3].fd = E.view.on ? E.view.notify[0] : -1;
+    fds[3].events = POLLIN;
+    fds[4].fd = E.swap.job ? E.swap.notify[0] : -1;
+    fds[4].events = POLLIN;
+    // Once the followed file is known to have changed, more changes are
+    // news only when it's read again, so they don't wake us up meanwhile.
+    fds[5].fd = E.follow.on && !E.follow.pending ? E.follow.inotify : -1;
+    fds[5].events = POLLIN;
+
+    int ready = poll(fds, 6, timeout);
+    STAT_ADD(syscalls, 1);
+    if (ready <= 0) return 0;
+
+    int redraw = 0;
+    if (fds[1].revents & POLLIN) {
+        char buf[64];
+        while (read(E.sigpipe[0], buf, sizeof(buf)) > 0);
+        editorHandleResize();
+        redraw = 1;
+    }
+    if (fds[2].revents & POLLIN) redraw |= editorSearchPoll();
+    if (fds[3].revents & POLLIN) redraw |= viewPoll();
+    if (fds[4].revents & POLLIN) swapPoll();
+    if (fds[5].revents & POLLIN) followPoll();
+    if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && editorFillInput() == 0) {
+        // The terminal is gone, so there is nothing to restore and no one
+        // to ask. Unsaved changes are left in the swap file.
+        _exit(1);
+    }
+    return redraw;
+#endif
+}
+
+void editorMainLoop() {
+    int msgshown = 0;
+    E.redraw = 1;
+    while (1) {
+        // Handle every key that is already here before drawing anything.
+        while (E.in.start < E.in.end) {
+            editorProcessKeypress();
+            E.redraw = 1;
+        }
+        // Read in what the followed file has grown by, if it's time.
+        int followdue = followTick();
+
+        int timeout = -1;
+        if (E.redraw) {
+            long long wait = E.lastframe + YIM_FRAME_MS - editorNow();
+            if (wait <= 0) {
+                editorRefreshScreen();
+                E.lastframe = editorNow();
+                E.redraw = 0;
+                msgshown = editorMessageTimeout() != -1;
+            }
+            else {
+                timeout = wait;
+            }
+        }
+        // Wake up once more to take the status message down.
+        if (!E.redraw && msgshown) {
+            int expire = editorMessageTimeout();
+            if (expire == -1) {
+                E.redraw = 1;
+                msgshown = 0;
+                continue;
+            }
+            timeout = expire;
+        }
+        int swapdue = swapTick();
+        if (swapdue != -1 && (timeout == -1 || swapdue < timeout)) timeout = swapdue;
+        if (followdue != -1 && (timeout == -1 || followdue < timeout)) timeout = followdue;
+
+        if (editorWaitEvents(timeout)) E.redraw = 1;
+    }
+}
+
+#ifdef YIM_HEADLESS
+/*---------- Headless ----------*/
+// Built with -DYIM_HEADLESS ("make yim-headless") the editor runs without
+// a tty, against a virtual terminal of a given size. Frames go to
+// /dev/null, or to a file given with -o, and keys come from a script:
+//
+//     # A comment.
+//     type <text>      types the text, a character per key
+//     key <name> [n]   presses a key n times: up down left right home end
+//                      pgup pgdn del bs enter esc tab, or ^x for Ctrl-x
+//     paste <text>     pastes the text in one go
+//     mark <name>      starts a section, which is reported on its own
+//     noalloc          fails the run if the keys and frames of the section
+//                      allocate, which is only counted in a stats build
+//
+// In text, \n is Enter, \t a tab, \e Esc and \\ a backslash. Each key is
+// handled and then a frame is drawn, and the time both take is logged.
+// Keys typed into a prompt count towards the key that opened it. When the
+// script runs out the latencies are summed up and the editor exits.
+// "-b" runs a built-in suite of workloads on a generated file instead,
+// and times some jobs against other programs, or older ways, doing the same.
+// "-i" instead times Enter near the top of files of 1K, 100K and 10M
+// lines, or the sizes given, which should take as long in each.
+
+void latencyAdd(latencyLog *l, long long ns) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->ns = realloc(l->ns, sizeof(long long) * l->cap);
+        if (l->ns == NULL) die("realloc");
+    }
+    l->ns[l->n++] = ns;
+}
+
+int latencyCmp(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+// Prints a time given in nanoseconds in a readable unit.
+void latencyPrintTime(FILE *fp, const char *label, long long ns) {
+    if (ns < 10000000) fprintf(fp, "  %s %7.1fus", label, ns / 1000.0);
+    else fprintf(fp, "  %s %7.1fms", label, ns / 1000000.0);
+}
+
+// Prints the percentiles of a log and a histogram of it with power of two
+// buckets in microseconds.
+void latencyPrint(FILE *fp, const char *what, latencyLog *l) {
+    if (l->n == 0) return;
+    qsort(l->ns, l->n, sizeof(long long), latencyCmp);
+    fprintf(fp, "  %-8s", what);
+    latencyPrintTime(fp, "p50", l->ns[(l->n - 1) * 50 / 100]);
+    latencyPrintTime(fp, "p99", l->ns[(l->n - 1) * 99 / 100]);
+    latencyPrintTime(fp, "max", l->ns[l->n - 1]);
+    fprintf(fp, "\n          ");
+
+    int buckets[64] = {0};
+    int i;
+    for (i = 0; i < l->n; i++) {
+        long long us = l->ns[i] / 1000;
+        int b = 0;
+        while (us) {
+            b++;
+            us >>= 1;
+        }
+        buckets[b]++;
+    }
+    for (i = 0; i < 64; i++) {
+        if (buckets[i] == 0) continue;
+        if ((1LL << i) < 10000) fprintf(fp, " <%lldus:%d", 1LL << i, buckets[i]);
+        else fprintf(fp, " <%lldms:%d", (1LL << i) / 1000, buckets[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+void headlessSectionNew(const char *name, int len) {
+    H.sections = realloc(H.sections, sizeof(headlessSection) * (H.nsections + 1));
+    if (H.sections == NULL) die("realloc");
+    headlessSection *s = &H.sections[H.nsections++];
+    memset(s, 0, sizeof(*s));
+    if (len > (int) sizeof(s->name) - 1) len = sizeof(s->name) - 1;
+    memcpy(s->name, name, len);
+}
+
+// Makes a key of the bytes appended to H.bytes since start.
+void headlessEndKey(size_t start) {
+    if (H.nkeys == H.capkeys) {
+        H.capkeys = H.capkeys ? H.capkeys * 2 : 256;
+        H.keys = realloc(H.keys, sizeof(headlessKey) * H.capkeys);
+        if (H.keys == NULL) die("realloc");
+    }
+    headlessKey *k = &H.keys[H.nkeys++];
+    k->off = start;
+    k->len = H.nbytes - start;
+    k->section = H.nsections - 1;
+}
+
+void headlessAddKey(const char *s, int len) {
+    size_t start = H.nbytes;
+    editorBufAppend(&H.bytes, &H.nbytes, &H.capbytes, s, len);
+    headlessEndKey(start);
+}
+
+// Undoes the escapes of script text in place and returns its new length.
+int headlessUnescape(char *s, int len) {
+    int i, j = 0;
+    for (i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\\' && i + 1 < len) {
+            switch (s[++i]) {
+                case 'n': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'e': c = '\x1b'; break;
+                default: c = s[i]; break;
+            }
+        }
+        s[j++] = c;
+    }
+    return j;
+}
+
+// The bytes a terminal sends for a named key, or NULL.
+const char *headlessKeyName(const char *name, int len, char *ctrl) {
+    static const char *names[][2] = {
+        {"up", "\x1b[A"}, {"down", "\x1b[B"}, {"right", "\x1b[C"}, {"left", "\x1b[D"},
+        {"home", "\x1b[H"}, {"end", "\x1b[F"}, {"pgup", "\x1b[5~"}, {"pgdn", "\x1b[6~"},
+        {"del", "\x1b[3~"}, {"bs", "\x7f"}, {"enter", "\r"}, {"esc", "\x1b"}, {"tab", "\t"},
+    };
+    if (len == 2 && name[0] == '^') {
+        ctrl[0] = CTRL_KEY(name[1]);
+        ctrl[1] = '\0';
+        return ctrl;
+    }
+    unsigned int i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((int) strlen(names[i][0]) == len && !memcmp(names[i][0], name, len))
+            return names[i][1];
+    }
+    return NULL;
+}
+
+// Turns a script into keys. Everything before the first "mark" goes into
+// a section of its own.
+void headlessParse(char *script, size_t len) {
+    headlessSectionNew("script", 6);
+    char *p = script;
+    char *end = script + len;
+    int lineno = 0;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        char *eol = nl ? nl : end;
+        char *next = nl ? nl + 1 : end;
+        lineno++;
+        if (eol > p && eol[-1] == '\r') eol--;
+
+        char *cmd = p;
+        while (p < eol && *p != ' ') p++;
+        int cmdlen = p - cmd;
+        char *arg = p < eol ? p + 1 : eol;
+        int arglen = eol - arg;
+
+        if (cmdlen == 0 || cmd[0] == '#') {
+            // Blank lines and comments.
+        }
+        else if (cmdlen == 4 && !memcmp(cmd, "type", 4)) {
+            arglen = headlessUnescape(arg, arglen);
+            int i = 0;
+            while (i < arglen) {
+                int cp;
+                int n = utf8Decode(&arg[i], arglen - i, &cp);
+                headlessAddKey(&arg[i], n);
+                i += n;
+            }
+        }
+        else if (cmdlen == 3 && !memcmp(cmd, "key", 3)) {
+            char *name = arg;
+            while (arg < eol && *arg != ' ') arg++;
+            char ctrl[2];
+            const char *seq = headlessKeyName(name, arg - name, ctrl);
+            if (seq == NULL) {
+                fprintf(stderr, "line %d: unknown key \"%.*s\"\n", lineno, (int) (arg - name), name);
+                exit(1);
+            }
+            int count = arg < eol ? atoi(arg) : 1;
+            while (count-- > 0) headlessAddKey(seq, strlen(seq));
+        }
+        else if (cmdlen == 5 && !memcmp(cmd, "paste", 5)) {
+            arglen = headlessUnescape(arg, arglen);
+            size_t start = H.nbytes;
+            editorBufAppend(&H.bytes, &H.nbytes, &H.capbytes, "\x1b[200~", 6);
+            editorBufAppend(&H.bytes, &H.nbytes, &H.capbytes, arg, arglen);
+            editorBufAppend(&H.bytes, &H.nbytes, &H.capbytes, "\x1b[201~", 6);
+            headlessEndKey(start);
+        }
+        else if (cmdlen == 4 && !memcmp(cmd, "mark", 4)) {
+            headlessSectionNew(arg, arglen);
+        }
+        else if (cmdlen == 7 && !memcmp(cmd, "noalloc", 7)) {
+            H.sections[H.nsections - 1].noalloc = 1;
+        }
+        else {
+            fprintf(stderr, "line %d: unknown command \"%.*s\"\n", lineno, cmdlen, cmd);
+            exit(1);
+        }
+        p = next;
+    }
+}
+
+// Hands out the rest of the key being sent, like read() on the tty would.
+int headlessRead(char *buf, int len) {
+    if (len > H.keyleft) len = H.keyleft;
+    memcpy(buf, &H.bytes[H.keypos], len);
+    H.keypos += len;
+    H.keyleft -= len;
+    return len;
+}
+
+// Returns 1 if a noalloc section allocated.
+int headlessFailed() {
+    int i;
+    for (i = 0; i < H.nsections; i++)
+        if (H.sections[i].noalloc && H.sections[i].mallocs) return 1;
+    return H.roundtripsbad != 0;
+}
+
+// Sends the next key of the script, or exits once there are none left.
+// A background search gets to report what it found so far, but isn't
+// waited for, like with someone typing fast.
+int headlessNextKey() {
+    int redraw = 0;
+    if (E.search.job) {
+        struct pollfd pfd;
+        pfd.fd = E.search.notify[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) > 0) redraw = editorSearchPoll();
+    }
+    if (H.keyleft == 0) {
+        if (H.next == H.nkeys) exit(headlessFailed());
+        headlessKey *k = &H.keys[H.next++];
+        H.keypos = k->off;
+        H.keyleft = k->len;
+        H.section = k->section;
+    }
+    editorFillInput();
+    return redraw;
+}
+
+// Handles the script a key and a frame at a time and logs how long each
+// took.
+void headlessRun() {
+    while (1) {
+        editorWaitEvents(-1);
+#ifdef YIM_STATS
+        long long mallocs = S.mallocs;
+#endif
+        long long start = editorNowNs();
+        while (E.in.start < E.in.end) editorProcessKeypress();
+        long long keyed = editorNowNs();
+        editorRefreshScreen();
+        long long drawn = editorNowNs();
+
+        headlessSection *s = &H.sections[H.section];
+#ifdef YIM_STATS
+        s->mallocs += S.mallocs - mallocs;
+#endif
+        latencyAdd(&s->keypress, keyed - start);
+        latencyAdd(&s->refresh, drawn - keyed);
+        s->bytes += E.frame_bytes;
+    }
+}
+
+// Runs at exit, however the script ended.
+void headlessReport() {
+    FILE *fp = H.report;
+    fprintf(fp, "yim-headless: %dx%d terminal, %d rows\n", H.rows, H.cols, E.numrows);
+    if (H.opentime) {
+        fprintf(fp, "open\n");
+        latencyPrintTime(fp, "load ", H.opentime);
+        latencyPrintTime(fp, "first frame", H.firstframe);
+        fprintf(fp, "\n");
+    }
+    int i;
+    if (H.ncompare) fprintf(fp, "compare\n");
+    for (i = 0; i < H.ncompare; i++) {
+        headlessCompare *c = &H.compare[i];
+        fprintf(fp, "  %-12s", c->name);
+        latencyPrintTime(fp, "yim", c->ns);
+        if (c->otherns == -1) fprintf(fp, "  %s failed", c->other);
+        else latencyPrintTime(fp, c->other, c->otherns);
+        if (c->otherns != -1 && c->count != c->othercount)
+            fprintf(fp, "  (found %lld, %s %lld)", c->count, c->other, c->othercount);
+        if (c->bytes && c->ns > 0 && c->otherns > 0)
+            fprintf(fp, "  %.0f MB/s, %s %.0f MB/s", c->bytes * 1e9 / c->ns / (1 << 20), c->other,
+                    c->bytes * 1e9 / c->otherns / (1 << 20));
+        fprintf(fp, "\n");
+    }
+    if (H.ncompare) fprintf(fp, "\n");
+    if (H.roundtrips) {
+        fprintf(fp, "round trip: %d of %d files saved back unchanged%s\n\n", H.roundtrips - H.roundtripsbad,
+                H.roundtrips, H.roundtripsbad ? " (FAILED)" : "");
+    }
+    for (i = 0; i < H.nsections; i++) {
+        headlessSection *s = &H.sections[i];
+        if (s->keypress.n == 0) continue;
+        fprintf(fp, "%s: %d keys, %lld bytes drawn", s->name, s->keypress.n, s->bytes);
+#ifdef YIM_STATS
+        fprintf(fp, ", %lld allocations", s->mallocs);
+        if (s->noalloc && s->mallocs) fprintf(fp, " (FAILED: noalloc)");
+#endif
+        fprintf(fp, "\n");
+        latencyPrint(fp, "keypress", &s->keypress);
+        latencyPrint(fp, "refresh", &s->refresh);
+    }
+    fflush(fp);
+    if (H.tmpfile) unlink(H.tmpfile);
+}
+
+// Lines the file for -b is made of: a mix of lengths, tabs and C to
+// highlight.
+char *headlessBenchLines[] = {
+    "#include <stdio.h>",
+    "/* A block comment that goes on",
+    "   for a couple of lines. */",
+    "static int counter = 0x2a; // The answer.",
+    "int main(int argc, char **argv) {",
+    "\tfor (int i = 0; i < argc; i++) printf(\"%s\\n\", argv[i]);",
+    "\treturn counter + 3.5e-2 > 1 ? 0 : 1;",
+    "}",
+    "",
+    "    char *message = \"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor\";",
+};
+
+// Writes a C file of the given number of lines to /tmp, as H.tmpfile.
+void headlessBenchFile(int lines) {
+    char path[] = "/tmp/yim-bench-XXXXXX.c";
+    int fd = mkstemps(path, 2);
+    if (fd == -1) die("mkstemps");
+    H.tmpfile = strdup(path);
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) die("fdopen");
+    unsigned int seed = 1;
+    int nlines = sizeof(headlessBenchLines) / sizeof(headlessBenchLines[0]);
+    int i;
+    for (i = 0; i < lines; i++) {
+        seed = seed * 1103515245 + 12345;
+        // A rare line for the search to look for, with a byte in it that
+        // is nowhere else.
+        if (i % 4096 == 4095) fprintf(fp, "// FIXME: %d\n", i);
+        else fprintf(fp, "%s\n", headlessBenchLines[(seed >> 16) % nlines]);
+    }
+    if (fclose(fp) == EOF) die("fclose");
+}
+
+// Writes a file of the given number of lines and returns a script of the
+// workloads to run on it.
+char *headlessBench(int lines, size_t *len) {
+    headlessBenchFile(lines);
+    char *script = NULL;
+    size_t cap = 0;
+    char buf[64];
+    *len = 0;
+    int i;
+    // Jump to the middle, where the text is typed and pasted.
+    int n = snprintf(buf, sizeof(buf), "mark goto\nkey ^t\ntype %d\\n\n", lines / 2);
+    editorBufAppend(&script, len, &cap, buf, n);
+    // Moving about a screen that is already drawn mustn't allocate. The
+    // cursor is on the top line and stays on the screen.
+    const char *steady = "mark steady\nnoalloc\n";
+    editorBufAppend(&script, len, &cap, steady, strlen(steady));
+    int down = H.rows - 3 < 10 ? H.rows - 3 : 10;
+    for (i = 0; i < 2; i++) {
+        n = snprintf(buf, sizeof(buf), "key down %d\nkey end\nkey home\nkey up %d\n", down, down);
+        editorBufAppend(&script, len, &cap, buf, n);
+    }
+    const char *type = "mark type\n";
+    editorBufAppend(&script, len, &cap, type, strlen(type));
+    for (i = 0; i < 8; i++) {
+        const char *line = "type // The quick brown fox jumps over the lazy dog, \\tagain and again.\\n\n";
+        editorBufAppend(&script, len, &cap, line, strlen(line));
+    }
+    const char *paste = "mark paste\npaste ";
+    editorBufAppend(&script, len, &cap, paste, strlen(paste));
+    for (i = 0; i < 2000; i++) {
+        n = snprintf(buf, sizeof(buf), "int pasted%d = %d; /* pasted */\\n", i, i);
+        editorBufAppend(&script, len, &cap, buf, n);
+    }
+    const char *rest = "\nmark page\nkey pgdn 200\nkey pgup 200\nmark save\nkey ^s\n";
+    editorBufAppend(&script, len, &cap, rest, strlen(rest));
+    return script;
+}
+
+// Writes a file of the given number of lines and returns a script that
+// presses Enter near its top, which should take as long however big the
+// file is.
+char *headlessInsertBench(int lines, size_t *len) {
+    headlessBenchFile(lines);
+    const char *keys = "mark goto\nkey ^t\ntype 10\\n\nmark enter\nkey enter 1000\n";
+    *len = strlen(keys);
+    return strdup(keys);
+}
+
+// Runs a shell command and returns how long it took, or -1 if it failed.
+// *count is set to the number it prints, if any.
+long long headlessTimeCommand(const char *cmd, long long *count) {
+    long long start = editorNowNs();
+    FILE *fp = popen(cmd, "r");
+    if (fp == NULL) return -1;
+    if (fscanf(fp, "%lld", count) != 1) *count = 0;
+    while (fgetc(fp) != EOF);
+    if (pclose(fp) != 0) return -1;
+    return editorNowNs() - start;
+}
+
+headlessCompare *headlessCompareAdd(const char *name, long long ns, long long count) {
+    if (H.ncompare == (int) (sizeof(H.compare) / sizeof(H.compare[0]))) die("headlessCompareAdd");
+    headlessCompare *c = &H.compare[H.ncompare++];
+    c->name = name;
+    c->ns = ns;
+    c->count = count;
+    return c;
+}
+
+// Counts the lines of a file the pattern matches, and has grep -E do the
+// same. With all set it counts every match in them instead, with
+// searchCount() as the search does, and grep -o lists them.
+void headlessCompareRegex(const char *name, const char *pattern, const char *path, int all) {
+    long long start = editorNowNs();
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) die("open");
+    size_t len;
+    int mapped;
+    char *data = editorLoadFile(fd, &len, &mapped);
+    close(fd);
+    searchPattern pat;
+    memset(&pat, 0, sizeof(pat));
+    searchCompile(&pat, pattern, strlen(pattern), 1);
+    if (pat.error) die("regexCompile");
+    long long count = 0;
+    size_t p = 0;
+    while (p < len) {
+        char *nl = memchr(&data[p], '\n', len - p);
+        size_t eol = nl ? (size_t) (nl - data) : len;
+        int end;
+        if (all) count += searchCount(&pat, &data[p], eol - p);
+        else if (searchFind(&pat, &data[p], eol - p, 0, &end) != -1) count++;
+        p = eol + 1;
+    }
+    searchPatternFree(&pat);
+    if (mapped) munmap(data, len);
+    else free(data);
+
+    headlessCompare *c = headlessCompareAdd(name, editorNowNs() - start, count);
+    char cmd[256];
+    if (all) snprintf(cmd, sizeof(cmd), "grep -E -o '%s' %s | wc -l", pattern, path);
+    else snprintf(cmd, sizeof(cmd), "grep -E -c '%s' %s", pattern, path);
+    c->other = "grep -E";
+    c->otherns = headlessTimeCommand(cmd, &c->othercount);
+}
+
+// Counts a string that is rare in the file at path with searchCount(), as
+// the search does, and with a plain memmem() loop. Both go through the
+// whole file at once, in pieces ending at a line break if it is too big
+// for an int.
+void headlessCompareSearch(const char *name, const char *needle, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) die("open");
+    size_t len;
+    int mapped;
+    char *data = editorLoadFile(fd, &len, &mapped);
+    close(fd);
+    // Fault the file in first, so that neither pays for it.
+    volatile char sink = 0;
+    size_t k;
+    for (k = 0; k < len; k += 4096) sink ^= data[k];
+
+    searchPattern p;
+    memset(&p, 0, sizeof(p));
+    searchCompile(&p, needle, strlen(needle), 0);
+    long long count = 0;
+    long long start = editorNowNs();
+    size_t off = 0;
+    while (off < len) {
+        size_t n = len - off;
+        if (n > INT_MAX) {
+            char *nl = memrchr(&data[off], '\n', INT_MAX);
+            n = nl ? (size_t) (nl - &data[off]) + 1 : INT_MAX;
+        }
+        count += searchCount(&p, &data[off], n);
+        off += n;
+    }
+    headlessCompare *c = headlessCompareAdd(name, editorNowNs() - start, count);
+    searchPatternFree(&p);
+
+    size_t needlelen = strlen(needle);
+    c->other = "memmem";
+    c->othercount = 0;
+    start = editorNowNs();
+    char *at = data;
+    char *end = data + len;
+    while ((at = memmem(at, end - at, needle, needlelen)) != NULL) {
+        c->othercount++;
+        at += needlelen;
+    }
+    c->otherns = editorNowNs() - start;
+    c->bytes = len;
+
+    if (mapped) munmap(data, len);
+    else free(data);
+}
+
+// Puts the time editorOpen() took to load the file at path next to
+// loading it the way it used to be: a getline(), a copy and a row per
+// line, in an array of rows that grows as it goes.
+void headlessCompareOpen(const char *path, long long ns) {
+    headlessCompare *c = headlessCompareAdd("open", ns, E.numrows);
+    c->other = "getline";
+    c->otherns = -1;
+
+    long long start = editorNowNs();
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return;
+    erow *rows = NULL;
+    long long n = 0, cap = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (linelen > 0 && line[linelen - 1] == '\n') linelen--;
+        if (linelen > 0 && line[linelen - 1] == '\r') linelen--;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            rows = realloc(rows, sizeof(erow) * cap);
+        }
+        char *chars = malloc(linelen + 1);
+        memcpy(chars, line, linelen);
+        chars[linelen] = '\0';
+        editorRowInit(&rows[n++], chars, linelen, 0);
+    }
+    free(line);
+    fclose(fp);
+    c->otherns = editorNowNs() - start;
+    c->othercount = n;
+
+    while (n > 0) free(rows[--n].chars);
+    free(rows);
+}
+
+// Opens a gzip copy of the file at path, and has zcat decompress it and
+// count its lines. The copy is opened in a child, so that the buffer
+// isn't touched, and the child sends back how long it took.
+void headlessCompareZip(const char *path) {
+    char gz[] = "/tmp/yim-bench-XXXXXX.gz";
+    int fd = mkstemps(gz, 3);
+    if (fd == -1) die("mkstemps");
+    gzFile out = gzdopen(fd, "wb1");
+    if (out == NULL) die("gzdopen");
+    fd = open(path, O_RDONLY);
+    if (fd == -1) die("open");
+    size_t len;
+    int mapped;
+    char *data = editorLoadFile(fd, &len, &mapped);
+    close(fd);
+    size_t off = 0;
+    while (off < len) {
+        // gzwrite() takes an unsigned int.
+        unsigned int n = len - off > (1 << 30) ? 1 << 30 : len - off;
+        if (gzwrite(out, &data[off], n) != (int) n) die("gzwrite");
+        off += n;
+    }
+    if (gzclose(out) != Z_OK) die("gzclose");
+    if (mapped) munmap(data, len);
+    else free(data);
+
+    int fds[2];
+    if (pipe(fds) == -1) die("pipe");
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    long long took[2];
+    if (pid == 0) {
+        close(fds[0]);
+        long long start = editorNowNs();
+        editorOpen(gz);
+        took[0] = editorNowNs() - start;
+        took[1] = E.numrows;
+        write(fds[1], took, sizeof(took));
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], took, sizeof(took));
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    if (n != sizeof(took)) {
+        unlink(gz);
+        errno = EIO;
+        die("open gzip");
+    }
+
+    headlessCompare *c = headlessCompareAdd("open gzip", took[0], took[1]);
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "zcat %s | wc -l", gz);
+    c->other = "zcat";
+    c->otherns = headlessTimeCommand(cmd, &c->othercount);
+    unlink(gz);
+}
+
+// Times what -b compares against other programs, on the generated file
+// at path and on files of its own.
+void headlessBenchCompare(const char *path) {
+    headlessCompareSearch("search", "FIXME", path);
+    headlessCompareRegex("regex", "(int|char) \\*?[a-z]+ = ", path, 0);
+
+    // A pattern that used to make each search start over at every 'a':
+    // the match is the "c" after them.
+    char worst[] = "/tmp/yim-bench-XXXXXX";
+    int fd = mkstemp(worst);
+    if (fd == -1) die("mkstemp");
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) die("fdopen");
+    int i, j;
+    for (i = 0; i < 100; i++) {
+        fputc('x', fp);
+        for (j = 0; j < 30000; j++) fputc('a', fp);
+        fputs("c\n", fp);
+    }
+    if (fclose(fp) == EOF) die("fclose");
+    headlessCompareRegex("regex worst", "a*b|c", worst, 0);
+    unlink(worst);
+
+    // Every 'a' is a match, but each one has to look on to the end of the
+    // row for a 'b' that would make it longer. grep takes as long as the
+    // matches times the row, so the rows are kept short.
+    strcpy(worst, "/tmp/yim-bench-XXXXXX");
+    fd = mkstemp(worst);
+    if (fd == -1) die("mkstemp");
+    fp = fdopen(fd, "w");
+    if (fp == NULL) die("fdopen");
+    for (i = 0; i < 10; i++) {
+        for (j = 0; j < 5000; j++) fputc('a', fp);
+        fputc('\n', fp);
+    }
+    if (fclose(fp) == EOF) die("fclose");
+    headlessCompareRegex("regex count", "a|a*b", worst, 1);
+    unlink(worst);
+
+    headlessCompareZip(path);
+}
+
+// Opens files with mixed line endings and saves them straight back, the
+// way Ctrl-S does, in a child so that the buffer isn't touched. They must
+// come out the same, byte for byte. Each is big enough to be loaded by
+// three threads where there are the cores for it.
+void headlessCheckRoundTrip() {
+    static const char *first[] = {"LF first\n", "CRLF first\r\n"};
+    static const char *mixed[] = {"int x;\r\n", "int y;\n", "a\rb\n", "c\r\r\n", "\r\n", "\n"};
+    int nmixed = sizeof(mixed) / sizeof(mixed[0]);
+    int k;
+    for (k = 0; k < 2; k++) {
+        char orig[] = "/tmp/yim-bench-XXXXXX";
+        char copy[] = "/tmp/yim-bench-XXXXXX";
+        FILE *fp[2];
+        int fd = mkstemp(orig);
+        if (fd == -1 || (fp[0] = fdopen(fd, "w")) == NULL) die("mkstemp");
+        fd = mkstemp(copy);
+        if (fd == -1 || (fp[1] = fdopen(fd, "w")) == NULL) die("mkstemp");
+        int j;
+        for (j = 0; j < 2; j++) {
+            long long len = fprintf(fp[j], "%s", first[k]);
+            int i = 0;
+            while (len < 3LL * YIM_LOAD_CHUNK) len += fprintf(fp[j], "%s", mixed[i++ % nmixed]);
+            // And no line break at the end.
+            fputs("last", fp[j]);
+            if (fclose(fp[j]) == EOF) die("fclose");
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) die("fork");
+        if (pid == 0) {
+            editorOpen(copy);
+            editorSave();
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+        char cmd[128];
+        snprintf(cmd, sizeof(cmd), "cmp -s %s %s", orig, copy);
+        H.roundtrips++;
+        if (system(cmd) != 0) H.roundtripsbad++;
+        unlink(orig);
+        unlink(copy);
+    }
+}
+
+void headlessUsage() {
+    fprintf(stderr, "Usage: yim-headless [-s ROWSxCOLS] [-o OUTPUT] SCRIPT [FILE]\n"
+                    "       yim-headless [-s ROWSxCOLS] [-o OUTPUT] -b [LINES]\n"
+                    "       yim-headless [-s ROWSxCOLS] [-o OUTPUT] -i [LINES...]\n");
+    exit(1);
+}
+
+// Runs -i for each of the sizes given, or 1K, 100K and 10M lines, in a
+// child of its own and one after the other, so each is reported on its
+// own. Returns the size in the children and exits in the parent, with 1
+// if any of them failed.
+int headlessInsertSizes(int argc, char *argv[]) {
+    static const int sizes[] = {1000, 100000, 10000000};
+    int nsizes = optind < argc ? argc - optind : (int) (sizeof(sizes) / sizeof(sizes[0]));
+    int failed = 0;
+    int k;
+    for (k = 0; k < nsizes; k++) {
+        int lines = optind < argc ? atoi(argv[optind + k]) : sizes[k];
+        if (lines < 1) headlessUsage();
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) die("fork");
+        if (pid == 0) return lines;
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    exit(failed);
+}
+
+int headlessMain(int argc, char *argv[]) {
+    H.rows = 24;
+    H.cols = 80;
+    char *output = "/dev/null";
+    int bench = 0;
+    int insert = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:o:bi")) != -1) {
+        switch (opt) {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &H.rows, &H.cols) != 2 || H.rows < 3 || H.cols < 1)
+                    headlessUsage();
+                break;
+            case 'o': output = optarg; break;
+            case 'b': bench = 1; break;
+            case 'i': insert = 1; break;
+            default: headlessUsage();
+        }
+    }
+
+    char *script;
+    size_t len;
+    char *filename = NULL;
+    if (insert) {
+        script = headlessInsertBench(headlessInsertSizes(argc, argv), &len);
+        filename = H.tmpfile;
+    }
+    else if (bench) {
+        int lines = optind < argc ? atoi(argv[optind]) : 1000000;
+        if (lines < 1) headlessUsage();
+        script = headlessBench(lines, &len);
+        filename = H.tmpfile;
+    }
+    else {
+        if (optind >= argc) headlessUsage();
+        int fd = open(argv[optind], O_RDONLY);
+        if (fd == -1) die("open");
+        int mapped;
+        char *data = editorLoadFile(fd, &len, &mapped);
+        close(fd);
+        // The script is unescaped in place, so it needs a copy of its own.
+        script = malloc(len + 1);
+        if (len) memcpy(script, data, len);
+        if (mapped) munmap(data, len);
+        else free(data);
+        if (optind + 1 < argc) filename = argv[optind + 1];
+    }
+    headlessParse(script, len);
+    free(script);
+
+    // The report goes where the terminal would be and the frames go to
+    // the virtual one.
+    H.report = fdopen(dup(STDOUT_FILENO), "w");
+    if (H.report == NULL) die("fdopen");
+    int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) die("open");
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    initEditor();
+    atexit(headlessReport);
+    if (bench) {
+        headlessBenchCompare(filename);
+        headlessCheckRoundTrip();
+    }
+    long long start = editorNowNs();
+    if (filename) editorOpen(filename);
+    long long opened = editorNowNs();
+    editorRefreshScreen();
+    if (filename) {
+        H.opentime = opened - start;
+        H.firstframe = editorNowNs() - opened;
+    }
+    if (bench) headlessCompareOpen(filename, H.opentime);
+    headlessRun();
+    return 0;
+}
+#endif
+
 /*---------- Init Functions -----------*/
 void initEditor() {
     E.cx = 0;
@@ -771,29 +8480,80 @@ void initEditor() {
     E.rx = 0;
     E.rowoff = 0;
     E.coloff = 0;
+    E.wrap = 0;
+    E.wrapoff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.gen = 0;
+    E.screen = NULL;
+    E.scratch.chars = NULL;
+    E.scratch.hl = NULL;
+    E.drawntop = 0;
+    E.frame_bytes = 0;
     E.dirty = 0;
     E.filename = NULL;
+    E.crlf = 0;
+    E.noeol = 0;
+    E.compress = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
+    E.in.start = 0;
+    E.in.end = 0;
+    memset(&E.search, 0, sizeof(E.search));
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.search.matchrow = -1;
+    E.search.notify[0] = -1;
+    E.search.notify[1] = -1;
+    memset(&E.view, 0, sizeof(E.view));
+    E.view.notify[0] = -1;
+    E.view.notify[1] = -1;
+    memset(&E.swap, 0, sizeof(E.swap));
+    E.swap.fd = -1;
+    memset(&E.follow, 0, sizeof(E.follow));
+    E.follow.fd = -1;
+    E.follow.inotify = -1;
+    E.follow.wd = -1;
+    E.swap.notify[0] = -1;
+    E.swap.notify[1] = -1;
+    E.hlgen = 0;
+    E.syntax = NULL;
+    E.hlclean = 0;
+    E.gaprow = NULL;
+    memset(&E.mem, 0, sizeof(E.mem));
+#ifdef YIM_STATS
+    atexit(statsDump);
+#endif
+    E.redraw = 1;
+    E.lastframe = 0;
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-    E.screenrows -= 2;
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+    editorScreenResize(rows - 2, cols);
+    editorInitSignals();
 }
 
 int main(int argc, char *argv[]) {
+#ifdef YIM_HEADLESS
+    return headlessMain(argc, argv);
+#else
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
+    if (argc >= 3 && !strcmp(argv[1], "-R")) {
+        viewOpen(argv[2]);
+    }
+    else if (argc >= 3 && !strcmp(argv[1], "-F")) {
+        editorOpen(argv[2]);
+        followStart();
+    }
+    else if (argc >= 2) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrrl-s = save | Ctrl-q = quit");
+    if (!E.follow.on)
+        editorSetStatusMessage("HELP: ^S save ^Q quit ^F find ^G regex ^R replace ^T goto ^Z undo ^Y redo");
+    if (!E.view.on) swapRecover();
 
-    while(1) {
-        editorRefreshScreen();
-        editorProcessKeypress();
-    }
+    editorMainLoop();
     return 0;
+#endif
 }